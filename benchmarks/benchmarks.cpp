@@ -1,6 +1,9 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <random>
+#include <cstdlib>
+#include <algorithm>
 
 #include "measureTime.hpp"
 
@@ -15,15 +18,12 @@ T uniformRandom(T const& min = T(0), T const& max = T(1))
 }
 
 template<typename T>
-T* genRandomArray(size_t size, T min, T max)
+void fillRandom(anyfold::cpu::scratch_buffer<T>& array, T min, T max)
 {
-	T* array = new T[size];
-	for (size_t i = 0; i < size; ++i)
+	for (size_t i = 0; i < array.size(); ++i)
 	{
 		array[i] = uniformRandom(min, max);
 	}
-
-	return array;
 }
 
 int main(int argc, char *argv[])
@@ -34,25 +34,53 @@ int main(int argc, char *argv[])
 		          << "<0> : Buffer\n"
 		          << "<1> : Buffer and local memory\n"
 		          << "<2> : Images\n"
-		          << "<3> : Images and local memory" << std::endl;
+		          << "<3> : Images and local memory\n"
+		          << "calibrate : measure the cost model of anyfold::convolve and save it\n"
+		          << "devices : list the OpenCL devices, fastest first" << std::endl;
 		exit(-1);
 	}
+	if(std::string(argv[1]) == "calibrate")
+	{
+		const std::string path = anyfold::cost_model::default_path();
+		anyfold::calibrate().save(path);
+		std::cout << "calibration written to " << path << std::endl;
+		return 0;
+	}
+	if(std::string(argv[1]) == "devices")
+	{
+		// pick one for the other methods with ANYFOLD_CL_DEVICE=<index>
+		for(const anyfold::opencl::DeviceInfo& d : anyfold::opencl::Runtime::rankDevices())
+			std::cout << "<" << d.index << "> " << d.name << " (" << d.typeName() << ", " << d.platformName << ")"
+			          << "\t" << d.computeUnits << " compute units, " << (d.globalMemory >> 20) << " MB"
+			          << "\tprobe " << d.probeSeconds*1e3 << " ms" << std::endl;
+		return 0;
+	}
 	int method = std::atoi(argv[1]);
 
 	SimpleTimer timer;
 	int rep = 32;
 	std::vector<std::vector<int>> k = {{3,9,15}, {9,21,27}, {15,27,33}, {27,39,51}, {39, 51, 21}};
+	const int maxImage = 256;
+
+	// all buffers are allocated once for the largest sizes, every run uses their front
+	size_t maxKernel = 0;
 	for(auto ks : k)
-	for(int i = 64; i <= 256; i *= 2)
+		maxKernel = std::max(maxKernel, size_t(ks[0]*ks[1]*ks[2]));
+	anyfold::cpu::scratch_buffer<float> image(size_t(maxImage)*maxImage*maxImage);
+	anyfold::cpu::scratch_buffer<float> kernel(maxKernel);
+	anyfold::cpu::scratch_buffer<float> output(image.size());
+	anyfold::cpu::scratch_buffer<float> outputCPU(image.size());
+	fillRandom(image, 0.0f, 1.0f);
+	fillRandom(kernel, 0.0f, 1.0f);
+
+	for(auto ks : k)
+	for(int i = 64; i <= maxImage; i *= 2)
 	{
 		std::cout << "\nImage size:  " << i
 		          << "\nKernel size: " << ks[0] << "x" << ks[1] << "x" << ks[2] << std::endl;
-		
-		float* image = genRandomArray(i*i*i, 0.0f, 1.0f);
+
 		int imageShape[] = {i, i, i};
-		float* kernel = genRandomArray(ks[0]*ks[1]*ks[2], 0.0f, 1.0f);
 		int kernelShape[] = {ks[0], ks[1], ks[2]};
-		float* output = new float[i*i*i];
 
 		uint64_t time = 0;
 		// OpenCL
@@ -61,19 +89,19 @@ int main(int argc, char *argv[])
 			timer.start();
 			switch(method)
 			{
-			case 0: anyfold::opencl::convolve_3dBuffer(image, imageShape,
-			                                           kernel, kernelShape, output);
+			case 0: anyfold::opencl::convolve_3dBuffer(image.data(), imageShape,
+			                                           kernel.data(), kernelShape, output.data());
 				break;
-			case 1: anyfold::opencl::convolve_3dBufferLocalMem(image, imageShape,
-			                                                   kernel, kernelShape,
-			                                                   output);
+			case 1: anyfold::opencl::convolve_3dBufferLocalMem(image.data(), imageShape,
+			                                                   kernel.data(), kernelShape,
+			                                                   output.data());
 				break;
-			case 2: anyfold::opencl::convolve_3dImage(image, imageShape,
-			                                          kernel, kernelShape, output);
+			case 2: anyfold::opencl::convolve_3dImage(image.data(), imageShape,
+			                                          kernel.data(), kernelShape, output.data());
 				break;
-			case 3: anyfold::opencl::convolve_3dImageLocalMem(image, imageShape,
-			                                                  kernel, kernelShape,
-			                                                  output);
+			case 3: anyfold::opencl::convolve_3dImageLocalMem(image.data(), imageShape,
+			                                                  kernel.data(), kernelShape,
+			                                                  output.data());
 				break;
 			default:
 				std::cerr << "Invalid method!" << std::endl;
@@ -85,18 +113,22 @@ int main(int argc, char *argv[])
 		std::cout << "OpenCL (average): \n" << (float)time / 1000000000.0f / (float)rep << std::endl;
 
 		// CPU
-		float* outputCPU = new float[i*i*i];
 		timer.start();
-		anyfold::cpu::convolve_3d(image, imageShape, kernel, kernelShape, outputCPU);
+		anyfold::cpu::convolve_3d(image.data(), imageShape, kernel.data(), kernelShape, outputCPU.data());
 		timer.end();
 		std::cout << "CPU (single core): \n";
 		timer.print(true);
-		delete[] outputCPU;
 
+		timer.start();
+		anyfold::cpu::parallel_convolve_3d(image.data(), imageShape, kernel.data(), kernelShape, outputCPU.data());
+		timer.end();
+		std::cout << "CPU (" << anyfold::cpu::thread_pool::global().size() << " threads): \n";
+		timer.print(true);
+	}
 
-		delete[] image;
-		delete[] kernel;
-		delete[] output;
-	}	
+	const anyfold::cpu::scratch_pool& pool = anyfold::cpu::scratch_pool::global();
+	std::cout << "\nScratch memory (MB): " << pool.bytes_in_use()/1e6
+	          << " in use, " << pool.peak_bytes()/1e6 << " at peak, "
+	          << pool.cached_bytes()/1e6 << " cached" << std::endl;
 	return 0;
 }
@@ -2,9 +2,23 @@
 #define _ANYFOLD_H_
 
 #include "cpu/convolve.hpp"
+#include "cpu/vectorized_convolve.hpp"
+#include "cpu/tiled_convolve.hpp"
+#include "cpu/low_rank.hpp"
+#include "cpu/fft_convolve.hpp"
+#include "cpu/overlap_save.hpp"
+#include "cpu/boundary.hpp"
+#include "cpu/out_of_core.hpp"
+#include "cpu/filter_bank.hpp"
+#include "cpu/plane_stream.hpp"
+#include "cpu/scratch_pool.hpp"
+#include "cpu/typed_convolve.hpp"
 
 #ifdef HAS_OPENCL
 #include "opencl/convolve.hpp"
 #endif
 
+#include "dispatch.hpp"
+#include "plan.hpp"
+
 #endif /* _ANYFOLD_H_ */
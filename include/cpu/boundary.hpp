@@ -0,0 +1,105 @@
+#ifndef _CPU_BOUNDARY_HPP_
+#define _CPU_BOUNDARY_HPP_
+#include <vector>
+#include <algorithm>
+#include "padd_utils.h"
+#include "thread_pool.hpp"
+#include "fixed_convolve.hpp"
+#include "vectorized_convolve.hpp"
+
+namespace anyfold {
+
+  namespace cpu {
+
+    //convolves the voxels of plane _x whose kernel window leaves the image; _maps[d]
+    //translates the window coordinate i (0 <= i < extent + kernel - 1, i.e. the image
+    //coordinate plus half a kernel) to the source index of axis d or -1 for zero
+    inline void convolve_border_plane(const float* _src, float* _dst,
+				      const long* _shape,
+				      const std::vector<float>& _flipped, const long* _kernel_shape,
+				      const std::vector<long> (&_maps)[3],
+				      long _x){
+
+      const long half[3] = {_kernel_shape[0]/2, _kernel_shape[1]/2, _kernel_shape[2]/2};
+      const bool border_plane = _x < half[0] || _x >= _shape[0] - half[0];
+
+      auto voxel = [&](long _y, long _z){
+	const float* tap = &_flipped[0];
+	float value = 0;
+	for(long a = 0;a<_kernel_shape[0];++a){
+	  const long sa = _maps[0][_x + a];
+	  if(sa < 0){
+	    tap += _kernel_shape[1]*_kernel_shape[2];
+	    continue;
+	  }
+	  for(long b = 0;b<_kernel_shape[1];++b){
+	    const long sb = _maps[1][_y + b];
+	    if(sb < 0){
+	      tap += _kernel_shape[2];
+	      continue;
+	    }
+	    const float* row = _src + (sa*_shape[1] + sb)*_shape[2];
+	    for(long c = 0;c<_kernel_shape[2];++c, ++tap){
+	      const long sc = _maps[2][_z + c];
+	      if(sc >= 0)
+		value += *tap * row[sc];
+	    }
+	  }
+	}
+	_dst[(_x*_shape[1] + _y)*_shape[2] + _z] = value;
+      };
+
+      for(long y = 0;y<_shape[1];++y){
+	if(border_plane || y < half[1] || y >= _shape[1] - half[1]){
+	  for(long z = 0;z<_shape[2];++z)
+	    voxel(y, z);
+	  continue;
+	}
+
+	//rows through the interior only have border voxels at both ends
+	for(long z = 0;z<std::min(half[2], _shape[2]);++z)
+	  voxel(y, z);
+	for(long z = std::max(_shape[2] - half[2], half[2]);z<_shape[2];++z)
+	  voxel(y, z);
+      }
+    }
+
+    //full size convolution of an unpadded image (c storage order): voxels whose kernel
+    //window lies inside the image are computed by the fixed size or vectorized line
+    //kernels without any checks, only the border shells of half a kernel thickness look
+    //up the voxels outside of the image according to _mode; no padded copy is made
+    template <typename ExtentT>
+    void convolve_boundary_3d(const float* src_begin, ExtentT* src_extents,
+			      const float* kernel_begin, ExtentT* kernel_extents,
+			      float* out_begin,
+			      boundary_mode _mode,
+			      unsigned _num_threads = 0)
+    {
+      const long shape[3] = {long(src_extents[0]), long(src_extents[1]), long(src_extents[2])};
+      const long kernel_shape[3] = {long(kernel_extents[0]), long(kernel_extents[1]), long(kernel_extents[2])};
+      const long strides[3] = {shape[1]*shape[2], shape[2], 1};
+      if(!shape[0] || !shape[1] || !shape[2])
+	return;
+
+      if(!dispatch_fixed(src_begin, out_begin, shape, strides, kernel_begin, kernel_shape, _num_threads))
+	vectorized_convolve_3d(src_begin, shape, kernel_begin, kernel_shape, out_begin, _num_threads);
+
+      std::vector<long> maps[3];
+      for(int d = 0;d<3;++d){
+	maps[d].resize(shape[d] + kernel_shape[d] - 1);
+	for(long i = 0;i<long(maps[d].size());++i)
+	  maps[d][i] = boundary_index(i - kernel_shape[d]/2, shape[d], _mode);
+      }
+
+      const std::vector<float> flipped = flip_kernel(kernel_begin, kernel_shape);
+      thread_pool::global().parallel_for(0, shape[0],
+					 [&](long _x){
+					   convolve_border_plane(src_begin, out_begin, shape, flipped, kernel_shape, maps, _x);
+					 },
+					 _num_threads);
+    }
+
+  };
+};
+
+#endif /* _CPU_BOUNDARY_HPP_ */
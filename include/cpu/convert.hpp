@@ -0,0 +1,198 @@
+#ifndef _CPU_CONVERT_HPP_
+#define _CPU_CONVERT_HPP_
+#include <algorithm>
+#include "sample_utils.h"
+#include "cpu_features.hpp"
+
+#ifdef ANYFOLD_X86_SIMD
+#include <immintrin.h>
+#endif
+
+namespace anyfold {
+
+  namespace cpu {
+
+    //bulk conversion of _size samples between their storage type and float, F16C for
+    //binary16, integer shifts for bfloat16 and widening conversions for 8 and 16 bit
+    //integers on cpus with avx2 (every cpu with avx2 has F16C), the scalar conversions
+    //of sample_utils.h otherwise; stores to integers saturate
+
+    inline void load_samples(const float* _src, float* _dst, std::size_t _size,
+			     instruction_set = instruction_set::scalar){
+      std::copy(_src, _src + _size, _dst);
+    }
+
+    inline void store_samples(const float* _src, float* _dst, std::size_t _size,
+			      instruction_set = instruction_set::scalar){
+      std::copy(_src, _src + _size, _dst);
+    }
+
+#ifdef ANYFOLD_X86_SIMD
+
+    __attribute__((target("avx2,f16c")))
+    inline std::size_t load_samples_avx2(const float16* _src, float* _dst, std::size_t _size){
+      std::size_t i = 0;
+      for(;i + 8<=_size;i += 8)
+	_mm256_storeu_ps(_dst + i, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(_src + i))));
+      return i;
+    }
+
+    __attribute__((target("avx2,f16c")))
+    inline std::size_t store_samples_avx2(const float* _src, float16* _dst, std::size_t _size){
+      std::size_t i = 0;
+      for(;i + 8<=_size;i += 8)
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(_dst + i),
+			 _mm256_cvtps_ph(_mm256_loadu_ps(_src + i), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+      return i;
+    }
+
+    __attribute__((target("avx2")))
+    inline std::size_t load_samples_avx2(const bfloat16* _src, float* _dst, std::size_t _size){
+      std::size_t i = 0;
+      for(;i + 8<=_size;i += 8){
+	const __m256i wide = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(_src + i)));
+	_mm256_storeu_ps(_dst + i, _mm256_castsi256_ps(_mm256_slli_epi32(wide, 16)));
+      }
+      return i;
+    }
+
+    __attribute__((target("avx2")))
+    inline std::size_t store_samples_avx2(const float* _src, bfloat16* _dst, std::size_t _size){
+      const __m256i bias = _mm256_set1_epi32(0x7fff);
+      const __m256i one = _mm256_set1_epi32(1);
+      const __m256i quiet = _mm256_set1_epi32(0x400000);
+      std::size_t i = 0;
+      for(;i + 8<=_size;i += 8){
+	const __m256 value = _mm256_loadu_ps(_src + i);
+	const __m256i bits = _mm256_castps_si256(value);
+	//round to nearest even, nan is kept (and made quiet) instead of rounded
+	const __m256i lsb = _mm256_and_si256(_mm256_srli_epi32(bits, 16), one);
+	const __m256i rounded = _mm256_add_epi32(bits, _mm256_add_epi32(bias, lsb));
+	const __m256i nan = _mm256_castps_si256(_mm256_cmp_ps(value, value, _CMP_UNORD_Q));
+	const __m256i upper = _mm256_srli_epi32(_mm256_blendv_epi8(rounded, _mm256_or_si256(bits, quiet), nan), 16);
+	//packus works within the 128 bit lanes, the permute gathers both halves
+	const __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(upper, upper), 0x08);
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(_dst + i), _mm256_castsi256_si128(packed));
+      }
+      return i;
+    }
+
+    __attribute__((target("avx2")))
+    inline std::size_t load_samples_avx2(const std::uint8_t* _src, float* _dst, std::size_t _size){
+      std::size_t i = 0;
+      for(;i + 8<=_size;i += 8)
+	_mm256_storeu_ps(_dst + i, _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(_src + i)))));
+      return i;
+    }
+
+    __attribute__((target("avx2")))
+    inline std::size_t load_samples_avx2(const std::uint16_t* _src, float* _dst, std::size_t _size){
+      std::size_t i = 0;
+      for(;i + 8<=_size;i += 8)
+	_mm256_storeu_ps(_dst + i, _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(_src + i)))));
+      return i;
+    }
+
+    //max before min maps nan to 0 like saturate_sample, cvtps rounds to nearest even
+    __attribute__((target("avx2")))
+    inline __m256i saturated_epi32(const float* _src, __m256 _top){
+      return _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(_src), _mm256_setzero_ps()), _top));
+    }
+
+    __attribute__((target("avx2")))
+    inline std::size_t store_samples_avx2(const float* _src, std::uint16_t* _dst, std::size_t _size){
+      const __m256 top = _mm256_set1_ps(65535.f);
+      std::size_t i = 0;
+      for(;i + 8<=_size;i += 8){
+	const __m256i value = saturated_epi32(_src + i, top);
+	const __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(value, value), 0x08);
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(_dst + i), _mm256_castsi256_si128(packed));
+      }
+      return i;
+    }
+
+    __attribute__((target("avx2")))
+    inline std::size_t store_samples_avx2(const float* _src, std::uint8_t* _dst, std::size_t _size){
+      const __m256 top = _mm256_set1_ps(255.f);
+      const __m256i gather = _mm256_setr_epi32(0, 4, 0, 0, 0, 0, 0, 0);
+      std::size_t i = 0;
+      for(;i + 8<=_size;i += 8){
+	const __m256i value = saturated_epi32(_src + i, top);
+	const __m256i words = _mm256_packus_epi32(value, value);
+	//every lane holds its 4 bytes in its first 32 bits
+	const __m256i bytes = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(words, words), gather);
+	_mm_storel_epi64(reinterpret_cast<__m128i*>(_dst + i), _mm256_castsi256_si128(bytes));
+      }
+      return i;
+    }
+
+#endif
+
+    template <typename T>
+    void load_samples(const T* _src, float* _dst, std::size_t _size,
+		      instruction_set _isa = best_instruction_set()){
+      std::size_t i = 0;
+#ifdef ANYFOLD_X86_SIMD
+      if(_isa != instruction_set::scalar)
+	i = load_samples_avx2(_src, _dst, _size);
+#endif
+      for(;i<_size;++i)
+	_dst[i] = to_float(_src[i]);
+    }
+
+    inline void store_sample(float _value, float16& _dst){
+      _dst = to_float16(_value);
+    }
+
+    inline void store_sample(float _value, bfloat16& _dst){
+      _dst = to_bfloat16(_value);
+    }
+
+    inline void store_sample(float _value, std::uint8_t& _dst){
+      _dst = saturate_sample<std::uint8_t>(_value);
+    }
+
+    inline void store_sample(float _value, std::uint16_t& _dst){
+      _dst = saturate_sample<std::uint16_t>(_value);
+    }
+
+    template <typename T>
+    void store_samples(const float* _src, T* _dst, std::size_t _size,
+		       instruction_set _isa = best_instruction_set()){
+      std::size_t i = 0;
+#ifdef ANYFOLD_X86_SIMD
+      if(_isa != instruction_set::scalar)
+	i = store_samples_avx2(_src, _dst, _size);
+#endif
+      for(;i<_size;++i)
+	store_sample(_src[i], _dst[i]);
+    }
+
+    //linear map applied to results before they are stored, e.g. to fit them into
+    //the range of an integer type: value*scale_ + offset_
+    struct sample_scaling {
+
+      float scale_;
+      float offset_;
+
+      sample_scaling(float _scale = 1.f, float _offset = 0.f):
+	scale_(_scale),
+	offset_(_offset)
+      {}
+
+      bool identity() const {
+	return scale_ == 1.f && offset_ == 0.f;
+      }
+
+      void apply(float* _values, std::size_t _size) const {
+	if(identity())
+	  return;
+	for(std::size_t i = 0;i<_size;++i)
+	  _values[i] = _values[i]*scale_ + offset_;
+      }
+    };
+
+  };
+};
+
+#endif /* _CPU_CONVERT_HPP_ */
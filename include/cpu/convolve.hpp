@@ -3,18 +3,27 @@
 #include <sstream>
 #include <numeric>
 #include <functional>
+#include <algorithm>
+#include <type_traits>
 #include "image_stack_utils.h"
+#include "thread_pool.hpp"
+#include "separable.hpp"
+#include "fixed_convolve.hpp"
+#include "vectorized_convolve.hpp"
 
 namespace anyfold {
 
   namespace cpu {
     
+    //convolves the planes [_begin,_end) of the first (slowest varying) dimension,
+    //planes outside of the interior defined by _offset are skipped
     template <typename ImageStackT,typename CImageStackT, typename DimT>
-    void convolve(CImageStackT& _image, 
-		  CImageStackT& _kernel, 
-		  ImageStackT& _result,
-		  const std::vector<DimT>& _offset){
-
+    void convolve_slab(CImageStackT& _image, 
+		       CImageStackT& _kernel, 
+		       ImageStackT& _result,
+		       const std::vector<DimT>& _offset,
+		       long _begin,
+		       long _end){
 
       if(!_image.num_elements())
 	return;
@@ -23,13 +32,16 @@ namespace anyfold {
       for(unsigned i = 0;i<3;++i)
 	half_kernel[i] = _kernel.shape()[i]/2;
 
+      const long x_begin = std::max<long>(_begin, _offset[0]);
+      const long x_end = std::min<long>(_end, long(_image.shape()[0]) - long(_offset[0]));
+
       float image_value = 0;    
       float kernel_value = 0;    
       float value = 0;    
 
-      for(int image_z = _offset[2];image_z<int(_image.shape()[2]-_offset[2]);++image_z){
+      for(int image_x = x_begin;image_x<x_end;++image_x){
 	for(int image_y = _offset[1];image_y<int(_image.shape()[1]-_offset[1]);++image_y){
-	  for(int image_x = _offset[0];image_x<int(_image.shape()[0]-_offset[0]);++image_x){
+	  for(int image_z = _offset[2];image_z<int(_image.shape()[2]-_offset[2]);++image_z){
 
 	    _result[image_x][image_y][image_z] = 0.f;
 	  
@@ -55,7 +67,39 @@ namespace anyfold {
 
 
     }
+
+    template <typename ImageStackT,typename CImageStackT, typename DimT>
+    void convolve(CImageStackT& _image, 
+		  CImageStackT& _kernel, 
+		  ImageStackT& _result,
+		  const std::vector<DimT>& _offset){
+
+      convolve_slab(_image, _kernel, _result, _offset, 0, _image.shape()[0]);
+
+    }
+
+    //every voxel is computed with the same summation order as in convolve, so the
+    //result is bit-identical to the serial path for any number of threads
+    template <typename ImageStackT,typename CImageStackT, typename DimT>
+    void parallel_convolve(CImageStackT& _image, 
+			   CImageStackT& _kernel, 
+			   ImageStackT& _result,
+			   const std::vector<DimT>& _offset,
+			   unsigned _num_threads = 0,
+			   thread_pool& _pool = thread_pool::global()){
+
+      if(!_image.num_elements())
+	return;
+
+      _pool.parallel_for(_offset[0], long(_image.shape()[0]) - long(_offset[0]),
+			 [&](long _plane){
+			   convolve_slab(_image, _kernel, _result, _offset, _plane, _plane+1);
+			 },
+			 _num_threads);
+    }
   
+    //kernels that are rank-1 (within default_separable_tolerance) are factorized and
+    //applied as three 1D passes, 3x3x3, 5x5x5 and 7x7x7 kernels use convolve_fixed
     template <typename ExtentT, typename SrcIterT, typename KernIterT, typename OutIterT>
     void convolve_3d(SrcIterT src_begin, ExtentT* src_extents,
 		     KernIterT kernel_begin, ExtentT* kernel_extents,
@@ -68,6 +112,15 @@ namespace anyfold {
       anyfold::image_stack_cref kernel(kernel_begin, kernel_shape);
       anyfold::image_stack_ref output(out_begin, image_shape);
 
+      std::vector<float> factors[3];
+      if(prefer_separable(kernel_begin, kernel_extents, factors))
+	return convolve_separable(image, factors[0], factors[1], factors[2], output);
+
+      const long shape[3] = {long(src_extents[0]), long(src_extents[1]), long(src_extents[2])};
+      const long strides[3] = {shape[1]*shape[2], shape[2], 1};
+      if(dispatch_fixed(src_begin, out_begin, shape, strides, kernel_begin, kernel_extents))
+	return;
+
       std::vector<ExtentT> offsets(3);
       for (unsigned i = 0; i < offsets.size(); ++i)
 	offsets[i] = kernel_shape[i]/2;
@@ -75,11 +128,87 @@ namespace anyfold {
       return convolve(image,kernel,output,offsets);
     }
 
+    //same as convolve_3d (without the separable shortcut), the planes of the first
+    //dimension are distributed over _num_threads threads of _pool (0 means all threads
+    //of the pool)
+    template <typename ExtentT, typename SrcIterT, typename KernIterT, typename OutIterT>
+    void parallel_convolve_3d(SrcIterT src_begin, ExtentT* src_extents,
+			      KernIterT kernel_begin, ExtentT* kernel_extents,
+			      OutIterT out_begin,
+			      unsigned _num_threads = 0,
+			      thread_pool& _pool = thread_pool::global())
+    {
+      std::vector<ExtentT> image_shape(src_extents,src_extents+3);
+      std::vector<ExtentT> kernel_shape(kernel_extents,kernel_extents+3);
+      
+      anyfold::image_stack_cref image(src_begin, image_shape);
+      anyfold::image_stack_cref kernel(kernel_begin, kernel_shape);
+      anyfold::image_stack_ref output(out_begin, image_shape);
+
+      const long shape[3] = {long(src_extents[0]), long(src_extents[1]), long(src_extents[2])};
+      const long strides[3] = {shape[1]*shape[2], shape[2], 1};
+      if(dispatch_fixed(src_begin, out_begin, shape, strides, kernel_begin, kernel_extents, _num_threads, _pool))
+	return;
 
+      std::vector<ExtentT> offsets(3);
+      for (unsigned i = 0; i < offsets.size(); ++i)
+	offsets[i] = kernel_shape[i]/2;
+      
+      return parallel_convolve(image,kernel,output,offsets,_num_threads,_pool);
+    }
+
+
+    //strided loops over the interior of a volume seen in c order (_shape/_kernel_shape
+    //slowest axis first), works for any random access iterator
+    template <typename SrcIterT, typename KernIterT, typename OutIterT>
+    void discrete_convolve_strided(SrcIterT src_begin, const long* _shape,
+				   KernIterT kernel_begin, const long* _kernel_shape,
+				   OutIterT out_begin, std::false_type){
+
+      const long strides[3] = {_shape[1]*_shape[2], _shape[2], 1};
+      const long half[3] = {_kernel_shape[0]/2, _kernel_shape[1]/2, _kernel_shape[2]/2};
+      const long kernel_size = _kernel_shape[0]*_kernel_shape[1]*_kernel_shape[2];
+
+      for(long x = half[0];x<_shape[0] - half[0];++x)
+	for(long y = half[1];y<_shape[1] - half[1];++y)
+	  for(long z = half[2];z<_shape[2] - half[2];++z){
+
+	    SrcIterT window = src_begin + ((x-half[0])*strides[0] + (y-half[1])*strides[1] + z-half[2]);
+	    //the kernel is walked backwards, so no flipped copy is needed
+	    KernIterT tap = kernel_begin + (kernel_size-1);
+	    float value = 0;
+	    for(long a = 0;a<_kernel_shape[0];++a)
+	      for(long b = 0;b<_kernel_shape[1];++b){
+		const long row = a*strides[0] + b*strides[1];
+		for(long c = 0;c<_kernel_shape[2];++c, --tap)
+		  value += *(window + (row + c)) * *tap;
+	      }
+	    *(out_begin + (x*strides[0] + y*strides[1] + z)) = value;
+	  }
+    }
+
+    //float pointers go to the fixed size or the vectorized line kernels
+    template <typename SrcIterT, typename KernIterT, typename OutIterT>
+    void discrete_convolve_strided(SrcIterT src_begin, const long* _shape,
+				   KernIterT kernel_begin, const long* _kernel_shape,
+				   OutIterT out_begin, std::true_type){
+
+      const long strides[3] = {_shape[1]*_shape[2], _shape[2], 1};
+      if(dispatch_fixed(src_begin, out_begin, _shape, strides, kernel_begin, _kernel_shape))
+	return;
+
+      vectorized_convolve_3d(src_begin, _shape, kernel_begin, _kernel_shape, out_begin);
+    }
+
+    //convolves the interior of the volume at src_begin and copies the remaining voxels
+    //of the source to out_begin; image and kernel share the storage order _order
+    //(fortran order by default, i.e. extents[0] runs fastest) which has to be ascending
+    //in every dimension; no memory proportional to the image is allocated
     template <typename ExtentT, typename SrcIterT, typename KernIterT, typename OutIterT>
     void discrete_convolve_3d(SrcIterT src_begin, ExtentT* src_extents,
 			      KernIterT kernel_begin, ExtentT* kernel_extents,
-			      OutIterT out_begin)
+			      OutIterT out_begin,
+			      const storage& _order = storage(boost::fortran_storage_order()))
     {
 
       for(int d = 0;d<3;++d){
@@ -89,75 +218,31 @@ namespace anyfold {
 	      << kernel_extents[0] << "x" << kernel_extents[1] << "x" << kernel_extents[2] << " NOT SUPPORTED\n";
 	  throw std::runtime_error(msg.str().c_str());
 	}
+	if(!_order.ascending(d)){
+	  std::ostringstream msg;
+	  msg << "[anyfold::discrete_convolve_3d]\tdescending storage order of dimension " << d << " NOT SUPPORTED\n";
+	  throw std::runtime_error(msg.str().c_str());
+	}
       }
 
-    
-      const unsigned long src_size = std::accumulate(src_extents, src_extents + 3, 1, std::multiplies<ExtentT>());
-      const unsigned long src_frame_size = std::accumulate(src_extents, src_extents + 2, 1, std::multiplies<ExtentT>());
-      //const unsigned long kernel_size = std::accumulate(kernel_extents, kernel_extents + 3, 1, std::multiplies<ExtentT>());
-
+      const unsigned long src_size = std::accumulate(src_extents, src_extents + 3, 1ul, std::multiplies<unsigned long>());
       std::copy(src_begin, src_begin + src_size, out_begin);
-      std::vector<unsigned long> src_indices;
-      src_indices.reserve(src_size);
-
-      //FIXME: not storage order independent, assuming row-major of all input containers
-      //create index list input (strategy dependent: assume not padding for now)
-      std::vector<long> half_kernel_dims(kernel_extents, kernel_extents + 3);
-      std::transform(half_kernel_dims.begin(), half_kernel_dims.end(), half_kernel_dims.begin(),
-		     std::bind2nd(std::divides<ExtentT>(), 2));
 
-      unsigned long src_index;
-    
-    
-      for(unsigned long z_index = half_kernel_dims[2];z_index<=(src_extents[2] - half_kernel_dims[2]);++z_index){
-	for(unsigned long y_index = half_kernel_dims[1];y_index<=(src_extents[1]- half_kernel_dims[1]);++y_index){
-	  for(unsigned long x_index = half_kernel_dims[0];x_index<=(src_extents[0]- half_kernel_dims[0]);++x_index){
-	  
-	    src_index = z_index*src_frame_size + y_index*src_extents[0] + x_index;
-      
-	    // is_bulk_index = (z_index >= half_kernel_dims[2] && z_index < (src_extents[2] - half_kernel_dims[2])) &&
-	    //   (y_index >= half_kernel_dims[1] && y_index < (src_extents[1] - half_kernel_dims[1])) &&
-	    //   (x_index >= half_kernel_dims[0] && x_index < (src_extents[0] - half_kernel_dims[0]));
-
-	    // if(is_bulk_index){
-	    src_indices.push_back(src_index);
-	    // }
-	  }
-	}
+      //in memory the volume is a c ordered array of the extents from the slowest to the
+      //fastest dimension
+      long shape[3];
+      long kernel_shape[3];
+      for(int d = 0;d<3;++d){
+	shape[d] = src_extents[_order.ordering(2-d)];
+	kernel_shape[d] = kernel_extents[_order.ordering(2-d)];
+	if(shape[d] <= 2*(kernel_shape[d]/2))
+	  return;
       }
-    
-      //perform convolution
-      long global_offset = 0;
-      long kernel_offset = 0;
-      long z,y,x,t;
-    
-      for(unsigned long bulk_index = 0;bulk_index<src_indices.size();++bulk_index){
-	OutIterT value = out_begin + src_indices[bulk_index];
-	*value = 0;
-      
-	// SrcIterT in = src_begin + src_indices[bulk_index];
-	// KernIterT kernel_rev_iterator = kernel_begin + kernel_size - 1;      
-	KernIterT kernel = kernel_begin;
-
-	for(long z_offset = -1*half_kernel_dims[2];z_offset<=half_kernel_dims[2];++z_offset){
-	  for(long y_offset = -1*half_kernel_dims[1];y_offset<=half_kernel_dims[1];++y_offset){
-	    for(long x_offset = -1*half_kernel_dims[0];x_offset<=half_kernel_dims[0];++x_offset){
-
-	      z = src_indices[bulk_index]/src_frame_size;
-	      t = src_indices[bulk_index] - (z*src_frame_size);
-	      y = t/src_extents[0];
-	      x = t - (y*src_extents[0]);
-	    
-	      global_offset = (z + z_offset)*src_frame_size + (y+y_offset)*src_extents[0] + x+ x_offset;
-	      // global_offset = z_offset*src_frame_size + y_offset*src_extents[0] + x_offset;
-	      kernel_offset = (-1*z_offset + half_kernel_dims[2])*kernel_extents[1]*kernel_extents[0] + (-1*y_offset + half_kernel_dims[1])*kernel_extents[0] + (-1*x_offset + half_kernel_dims[0]); 
-	      // *value += *(in + global_offset) * *(kernel_rev_iterator--);
-	      *value += *(src_begin + global_offset) * *(kernel + kernel_offset);
 
-	    }
-	  }
-	}
-      }
+      typedef std::integral_constant<bool, is_float_pointer<SrcIterT>::value &&
+				     is_float_pointer<KernIterT>::value &&
+				     is_float_pointer<OutIterT>::value> pointers;
+      discrete_convolve_strided(src_begin, shape, kernel_begin, kernel_shape, out_begin, pointers());
     }
 
   };
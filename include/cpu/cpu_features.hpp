@@ -0,0 +1,123 @@
+#ifndef _CPU_FEATURES_HPP_
+#define _CPU_FEATURES_HPP_
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define ANYFOLD_X86_SIMD 1
+#endif
+
+#include <cstddef>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <algorithm>
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+namespace anyfold {
+
+  namespace cpu {
+
+    enum class instruction_set {
+      scalar = 0,
+      avx2 = 1,
+      avx512 = 2
+    };
+
+    inline const char* name(instruction_set _isa){
+      switch(_isa){
+      case instruction_set::avx2:
+	return "avx2";
+      case instruction_set::avx512:
+	return "avx512";
+      default:
+	return "scalar";
+      }
+    }
+
+    //queries the host cpu (and operating system support) once, independent of the flags
+    //the library was compiled with
+    inline instruction_set best_instruction_set(){
+
+#ifdef ANYFOLD_X86_SIMD
+      static const instruction_set value = __builtin_cpu_supports("avx512f") ? instruction_set::avx512 :
+	((__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) ? instruction_set::avx2 : instruction_set::scalar);
+      return value;
+#else
+      return instruction_set::scalar;
+#endif
+    }
+
+    inline bool supported(instruction_set _isa){
+      return int(_isa) <= int(best_instruction_set());
+    }
+
+    //data cache sizes in bytes per core (l3 is shared)
+    struct cache_sizes {
+      std::size_t l1_;
+      std::size_t l2_;
+      std::size_t l3_;
+    };
+
+    //size of the data or unified cache of _level as reported by sysfs for cpu0, 0 if unknown
+    inline std::size_t sysfs_cache_size(int _level){
+
+      for(int index = 0;index<8;++index){
+	std::ostringstream dir;
+	dir << "/sys/devices/system/cpu/cpu0/cache/index" << index << "/";
+
+	std::ifstream level_file((dir.str() + "level").c_str());
+	std::ifstream type_file((dir.str() + "type").c_str());
+	std::ifstream size_file((dir.str() + "size").c_str());
+	int level = 0;
+	std::string type;
+	std::size_t size = 0;
+	std::string unit;
+	if(!(level_file >> level) || !(type_file >> type) || !(size_file >> size))
+	  continue;
+	if(level != _level || type == "Instruction")
+	  continue;
+
+	size_file >> unit;
+	if(unit == "K")
+	  size <<= 10;
+	else if(unit == "M")
+	  size <<= 20;
+	return size;
+      }
+      return 0;
+    }
+
+    //sysconf first, sysfs if the c library doesn't know, typical desktop sizes as the last resort
+    inline const cache_sizes& detected_cache_sizes(){
+
+      static const cache_sizes value = [](){
+	cache_sizes sizes = {0, 0, 0};
+#if defined(__linux__) && defined(_SC_LEVEL1_DCACHE_SIZE)
+	sizes.l1_ = std::max(0L, sysconf(_SC_LEVEL1_DCACHE_SIZE));
+	sizes.l2_ = std::max(0L, sysconf(_SC_LEVEL2_CACHE_SIZE));
+	sizes.l3_ = std::max(0L, sysconf(_SC_LEVEL3_CACHE_SIZE));
+#endif
+	if(!sizes.l1_)
+	  sizes.l1_ = sysfs_cache_size(1);
+	if(!sizes.l2_)
+	  sizes.l2_ = sysfs_cache_size(2);
+	if(!sizes.l3_)
+	  sizes.l3_ = sysfs_cache_size(3);
+
+	if(!sizes.l1_)
+	  sizes.l1_ = 32 << 10;
+	if(!sizes.l2_)
+	  sizes.l2_ = 256 << 10;
+	if(!sizes.l3_)
+	  sizes.l3_ = sizes.l2_;
+	return sizes;
+      }();
+      return value;
+    }
+
+  };
+};
+
+#endif /* _CPU_FEATURES_HPP_ */
@@ -0,0 +1,433 @@
+#ifndef _CPU_FFT_HPP_
+#define _CPU_FFT_HPP_
+#include <vector>
+#include <complex>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include "boost/multi_array.hpp"
+#include "image_stack_utils.h"
+#include "thread_pool.hpp"
+#include "scratch_pool.hpp"
+
+#ifdef HAS_FFTW
+#include <fftw3.h>
+#endif
+
+namespace anyfold {
+
+  namespace cpu {
+
+    typedef std::complex<float> complex_type;
+
+    //smallest size >= _size whose prime factors are all <= 7, transforms of these
+    //sizes are fast in FFTW and in the built-in fallback alike
+    inline long next_fast_fft_size(long _size){
+
+      for(long candidate = std::max(_size, 1L);;++candidate){
+	long rest = candidate;
+	const long primes[4] = {2, 3, 5, 7};
+	for(int p = 0;p<4;++p)
+	  while(rest % primes[p] == 0)
+	    rest /= primes[p];
+	if(rest == 1)
+	  return candidate;
+      }
+    }
+
+    //floats allocated with the alignment the fft backend expects (64 bytes, the
+    //strictest of the SIMD widths FFTW plans for), taken from the scratch pool
+    typedef scratch_buffer<float> fft_buffer;
+
+    //mixed radix complex fft of arbitrary length (recursive decimation in time,
+    //specialised radix-2 and radix-4 butterflies and a generic one for all other
+    //factors), used when the library is built without FFTW
+    class complex_fft {
+
+    public:
+
+      explicit complex_fft(long _size):
+	size_(_size),
+	factors_(),
+	twiddles_(_size)
+      {
+	const double pi = std::acos(-1.);
+	for(long i = 0;i<size_;++i){
+	  const double phase = -2.*pi*double(i)/double(size_);
+	  twiddles_[i] = complex_type(std::cos(phase), std::sin(phase));
+	}
+
+	long rest = size_;
+	while(rest % 16 == 0){
+	  rest /= 4;
+	  factors_.push_back(4);
+	  factors_.push_back(rest);
+	}
+	for(long p = 2;rest > 1;){
+	  if(rest % p){
+	    p = (p == 2) ? 3 : p + 2;
+	    if(p*p > rest)
+	      p = rest;
+	    continue;
+	  }
+	  rest /= p;
+	  factors_.push_back(p);
+	  factors_.push_back(rest);
+	}
+      }
+
+      long size() const {
+	return size_;
+      }
+
+      //unnormalized transform of _size elements from _in (stride _in_stride) to the
+      //contiguous _out, the inverse uses the conjugate twiddles
+      void transform(const complex_type* _in, long _in_stride, complex_type* _out, bool _inverse) const {
+
+	if(size_ == 1){
+	  _out[0] = _in[0];
+	  return;
+	}
+	work(_out, _in, 1, _in_stride, &factors_[0], _inverse);
+      }
+
+    private:
+
+      complex_type twiddle(long _index, bool _inverse) const {
+	return _inverse ? std::conj(twiddles_[_index]) : twiddles_[_index];
+      }
+
+      //plain complex product, std::complex's operator* guards against inf/nan which
+      //keeps it from being inlined without -ffast-math
+      static complex_type multiply(const complex_type& _a, const complex_type& _b){
+	return complex_type(_a.real()*_b.real() - _a.imag()*_b.imag(),
+			    _a.real()*_b.imag() + _a.imag()*_b.real());
+      }
+
+      void work(complex_type* _out, const complex_type* _in, long _fstride, long _in_stride,
+		const long* _factors, bool _inverse) const {
+
+	const long p = _factors[0];
+	const long m = _factors[1];
+	complex_type* out = _out;
+	complex_type* const out_end = _out + p*m;
+
+	if(m == 1){
+	  for(;out != out_end;++out, _in += _fstride*_in_stride)
+	    *out = *_in;
+	}
+	else {
+	  for(;out != out_end;out += m, _in += _fstride*_in_stride)
+	    work(out, _in, _fstride*p, _in_stride, _factors + 2, _inverse);
+	}
+
+	if(p == 2)
+	  butterfly_2(_out, _fstride, m, _inverse);
+	else if(p == 4)
+	  butterfly_4(_out, _fstride, m, _inverse);
+	else
+	  butterfly_generic(_out, _fstride, m, p, _inverse);
+      }
+
+      void butterfly_2(complex_type* _out, long _fstride, long _m, bool _inverse) const {
+
+	complex_type* second = _out + _m;
+	for(long u = 0;u<_m;++u){
+	  const complex_type t = multiply(second[u], twiddle(u*_fstride, _inverse));
+	  second[u] = _out[u] - t;
+	  _out[u] += t;
+	}
+      }
+
+      void butterfly_4(complex_type* _out, long _fstride, long _m, bool _inverse) const {
+
+	for(long u = 0;u<_m;++u){
+	  const complex_type a0 = _out[u];
+	  const complex_type a1 = multiply(_out[u + _m], twiddle(u*_fstride, _inverse));
+	  const complex_type a2 = multiply(_out[u + 2*_m], twiddle(2*u*_fstride, _inverse));
+	  const complex_type a3 = multiply(_out[u + 3*_m], twiddle(3*u*_fstride, _inverse));
+
+	  const complex_type s0 = a0 + a2;
+	  const complex_type s1 = a0 - a2;
+	  const complex_type s2 = a1 + a3;
+	  const complex_type d = a1 - a3;
+	  //multiplication by -i (forward) or +i (inverse)
+	  const complex_type s3 = _inverse ? complex_type(-d.imag(), d.real()) : complex_type(d.imag(), -d.real());
+
+	  _out[u] = s0 + s2;
+	  _out[u + _m] = s1 + s3;
+	  _out[u + 2*_m] = s0 - s2;
+	  _out[u + 3*_m] = s1 - s3;
+	}
+      }
+
+      void butterfly_generic(complex_type* _out, long _fstride, long _m, long _p, bool _inverse) const {
+
+	complex_type small[16];
+	std::vector<complex_type> large(_p > 16 ? _p : 0);
+	complex_type* scratch = (_p > 16) ? &large[0] : small;
+
+	for(long u = 0;u<_m;++u){
+	  for(long q = 0, k = u;q<_p;++q, k += _m)
+	    scratch[q] = _out[k];
+
+	  for(long q1 = 0, k = u;q1<_p;++q1, k += _m){
+	    long index = 0;
+	    complex_type value = scratch[0];
+	    for(long q = 1;q<_p;++q){
+	      index += _fstride*k;
+	      if(index >= size_)
+		index %= size_;
+	      value += multiply(scratch[q], twiddle(index, _inverse));
+	    }
+	    _out[k] = value;
+	  }
+	}
+      }
+
+      long size_;
+      std::vector<long> factors_;
+      std::vector<complex_type> twiddles_;
+    };
+
+    //in-place real-to-complex 3D transform on the layout computed by
+    //adapt_extents_for_fftw_inplace (c storage order, the last dimension is padded to
+    //2*(n/2+1) floats); transforms are unnormalized like FFTW's
+    class fft_plan_3d {
+
+    public:
+
+      fft_plan_3d(const std::vector<long>& _extents, unsigned _num_threads = 0):
+	extents_(_extents),
+	padded_extents_(3),
+	num_threads_(_num_threads ? _num_threads : thread_pool::global().size())
+#ifdef HAS_FFTW
+	,forward_(0),
+	backward_(0)
+#endif
+      {
+	adapt_extents_for_fftw_inplace(storage(boost::c_storage_order()), extents_, padded_extents_);
+
+#ifdef HAS_FFTW
+	std::lock_guard<std::mutex> lock(planner_mutex());
+	static bool threads_initialized = fftwf_init_threads() != 0;
+	if(threads_initialized)
+	  fftwf_plan_with_nthreads(num_threads_);
+
+	//FFTW_MEASURE overwrites the array it plans on, so a scratch buffer is used
+	fft_buffer scratch(padded_size());
+	forward_ = fftwf_plan_dft_r2c_3d(extents_[0], extents_[1], extents_[2],
+					 scratch.data(), reinterpret_cast<fftwf_complex*>(scratch.data()),
+					 FFTW_MEASURE);
+	backward_ = fftwf_plan_dft_c2r_3d(extents_[0], extents_[1], extents_[2],
+					  reinterpret_cast<fftwf_complex*>(scratch.data()), scratch.data(),
+					  FFTW_MEASURE);
+#else
+	for(int d = 0;d<3;++d)
+	  lines_.push_back(std::make_shared<complex_fft>(extents_[d]));
+#endif
+      }
+
+      ~fft_plan_3d(){
+#ifdef HAS_FFTW
+	std::lock_guard<std::mutex> lock(planner_mutex());
+	fftwf_destroy_plan(forward_);
+	fftwf_destroy_plan(backward_);
+#endif
+      }
+
+      //set_cache_limit value of the default bound
+      static const std::size_t default_cache_limit = 16;
+
+      //returns a plan from the process wide cache, so that repeated calls with the same
+      //extents only pay for planning once; the least recently used plan is dropped from
+      //the cache once it holds more than cache_limit() plans
+      static std::shared_ptr<const fft_plan_3d> get(const std::vector<long>& _extents, unsigned _num_threads = 0){
+
+	std::vector<long> key(_extents);
+	key.push_back(_num_threads);
+
+	plan_cache& cache = shared_cache();
+	std::lock_guard<std::mutex> lock(cache.mutex_);
+	for(plan_cache::entries::iterator entry = cache.entries_.begin();entry!=cache.entries_.end();++entry)
+	  if(entry->first == key){
+	    cache.entries_.splice(cache.entries_.begin(), cache.entries_, entry);
+	    return entry->second;
+	  }
+
+	std::shared_ptr<const fft_plan_3d> value = std::make_shared<const fft_plan_3d>(_extents, _num_threads);
+	cache.entries_.push_front(std::make_pair(key, value));
+	cache.shrink();
+	return value;
+      }
+
+      //at most _plans plans are kept, plans still in use stay alive with their users
+      static void set_cache_limit(std::size_t _plans){
+	plan_cache& cache = shared_cache();
+	std::lock_guard<std::mutex> lock(cache.mutex_);
+	cache.limit_ = _plans;
+	cache.shrink();
+      }
+
+      static std::size_t cache_limit(){
+	plan_cache& cache = shared_cache();
+	std::lock_guard<std::mutex> lock(cache.mutex_);
+	return cache.limit_;
+      }
+
+      static std::size_t cached_plans(){
+	plan_cache& cache = shared_cache();
+	std::lock_guard<std::mutex> lock(cache.mutex_);
+	return cache.entries_.size();
+      }
+
+      static void clear_cache(){
+	plan_cache& cache = shared_cache();
+	std::lock_guard<std::mutex> lock(cache.mutex_);
+	cache.entries_.clear();
+      }
+
+      const std::vector<long>& extents() const { return extents_; }
+      const std::vector<long>& padded_extents() const { return padded_extents_; }
+
+      std::size_t padded_size() const {
+	return std::size_t(padded_extents_[0])*padded_extents_[1]*padded_extents_[2];
+      }
+
+      //number of complex values in the transformed array
+      std::size_t spectrum_size() const {
+	return padded_size()/2;
+      }
+
+      void forward(float* _data) const {
+#ifdef HAS_FFTW
+	fftwf_execute_dft_r2c(forward_, _data, reinterpret_cast<fftwf_complex*>(_data));
+#else
+	real_lines(_data, false);
+	complex_axis(reinterpret_cast<complex_type*>(_data), 1, false);
+	complex_axis(reinterpret_cast<complex_type*>(_data), 0, false);
+#endif
+      }
+
+      void backward(float* _data) const {
+#ifdef HAS_FFTW
+	fftwf_execute_dft_c2r(backward_, reinterpret_cast<fftwf_complex*>(_data), _data);
+#else
+	complex_axis(reinterpret_cast<complex_type*>(_data), 0, true);
+	complex_axis(reinterpret_cast<complex_type*>(_data), 1, true);
+	real_lines(_data, true);
+#endif
+      }
+
+    private:
+
+      fft_plan_3d(const fft_plan_3d&);
+      fft_plan_3d& operator=(const fft_plan_3d&);
+
+      //plans keyed by extents and thread count, most recently used first
+      struct plan_cache {
+	typedef std::list<std::pair<std::vector<long>, std::shared_ptr<const fft_plan_3d> > > entries;
+
+	std::mutex mutex_;
+	entries entries_;
+	std::size_t limit_;
+
+	plan_cache():
+	  limit_(default_cache_limit)
+	{}
+
+	void shrink(){
+	  while(entries_.size() > limit_)
+	    entries_.pop_back();
+	}
+      };
+
+      static plan_cache& shared_cache(){
+	static plan_cache value;
+	return value;
+      }
+
+#ifdef HAS_FFTW
+      //FFTW's planner is not thread safe; never destroyed as cached plans may outlive it
+      static std::mutex& planner_mutex(){
+	static std::mutex* value = new std::mutex();
+	return *value;
+      }
+#else
+      //transforms along the last dimension: real lines to the n/2+1 non-redundant bins
+      //and back (the missing bins follow from hermitian symmetry)
+      void real_lines(float* _data, bool _inverse) const {
+
+	const long n = extents_[2];
+	const long bins = n/2 + 1;
+	const long row = padded_extents_[2];
+	const complex_fft& line = *lines_[2];
+
+	thread_pool::global().parallel_for(0, extents_[0],
+					   [&](long _x){
+					     std::vector<complex_type> in(n);
+					     std::vector<complex_type> out(n);
+					     for(long y = 0;y<extents_[1];++y){
+					       float* values = _data + (_x*extents_[1] + y)*row;
+					       complex_type* spectrum = reinterpret_cast<complex_type*>(values);
+					       if(!_inverse){
+						 for(long i = 0;i<n;++i)
+						   in[i] = complex_type(values[i], 0.f);
+						 line.transform(&in[0], 1, &out[0], false);
+						 std::copy(out.begin(), out.begin() + bins, spectrum);
+					       }
+					       else {
+						 std::copy(spectrum, spectrum + bins, in.begin());
+						 for(long i = bins;i<n;++i)
+						   in[i] = std::conj(in[n-i]);
+						 line.transform(&in[0], 1, &out[0], true);
+						 for(long i = 0;i<n;++i)
+						   values[i] = out[i].real();
+					       }
+					     }
+					   },
+					   num_threads_);
+      }
+
+      //complex transforms along dimension _axis (0 or 1) of the spectrum
+      void complex_axis(complex_type* _data, int _axis, bool _inverse) const {
+
+	const long bins = padded_extents_[2]/2;
+	const long strides[2] = {extents_[1]*bins, bins};
+	const long n = extents_[_axis];
+	const long other = extents_[1 - _axis];
+	const complex_fft& line = *lines_[_axis];
+
+	thread_pool::global().parallel_for(0, other,
+					   [&](long _o){
+					     std::vector<complex_type> out(n);
+					     for(long c = 0;c<bins;++c){
+					       complex_type* first = _data + _o*strides[1 - _axis] + c;
+					       line.transform(first, strides[_axis], &out[0], _inverse);
+					       for(long i = 0;i<n;++i)
+						 first[i*strides[_axis]] = out[i];
+					     }
+					   },
+					   num_threads_);
+      }
+#endif
+
+      std::vector<long> extents_;
+      std::vector<long> padded_extents_;
+      unsigned num_threads_;
+#ifdef HAS_FFTW
+      fftwf_plan forward_;
+      fftwf_plan backward_;
+#else
+      std::vector<std::shared_ptr<complex_fft> > lines_;
+#endif
+    };
+
+  };
+};
+
+#endif /* _CPU_FFT_HPP_ */
@@ -0,0 +1,159 @@
+#ifndef _CPU_FFT_CONVOLVE_HPP_
+#define _CPU_FFT_CONVOLVE_HPP_
+#include <vector>
+#include <algorithm>
+#include "image_stack_utils.h"
+#include "padd_utils.h"
+#include "fft.hpp"
+
+namespace anyfold {
+
+  namespace cpu {
+
+    //multiplies the spectrum _image by the spectrum _kernel and by _scale
+    inline void multiply_spectra(float* _image, const float* _kernel, std::size_t _size, float _scale){
+
+      complex_type* image = reinterpret_cast<complex_type*>(_image);
+      const complex_type* kernel = reinterpret_cast<const complex_type*>(_kernel);
+      for(std::size_t i = 0;i<_size;++i){
+	const complex_type a = image[i];
+	const complex_type b = kernel[i];
+	image[i] = complex_type((a.real()*b.real() - a.imag()*b.imag())*_scale,
+				(a.real()*b.imag() + a.imag()*b.real())*_scale);
+      }
+    }
+
+    //zero padded extents (image + kernel - 1) rounded up to sizes the fft is fast for
+    template <typename ExtentT>
+    zero_padd<image_stack> fft_padding(ExtentT* _image_extents, ExtentT* _kernel_extents){
+
+      zero_padd<image_stack> padding(_image_extents, _kernel_extents);
+      for(int d = 0;d<3;++d)
+	padding.extents_[d] = next_fast_fft_size(padding.extents_[d]);
+      return padding;
+    }
+
+    //writes the kernel centered at the origin with wrap around into _buffer (padded
+    //layout of _plan) and transforms it; the center is voxel K-1-K/2 of every axis
+    //like in convolve_3d, which is K/2 for odd extents only
+    template <typename ExtentT>
+    void kernel_spectrum(const float* _kernel, ExtentT* _kernel_extents,
+			 const fft_plan_3d& _plan,
+			 fft_buffer& _buffer){
+
+      const long shape[3] = {long(_kernel_extents[0]), long(_kernel_extents[1]), long(_kernel_extents[2])};
+      const std::vector<long>& extents = _plan.extents();
+      const std::vector<long>& padded = _plan.padded_extents();
+
+      _buffer.resize(_plan.padded_size());
+      std::fill(_buffer.data(), _buffer.data() + _buffer.size(), 0.f);
+      for(long x = 0;x<shape[0];++x)
+	for(long y = 0;y<shape[1];++y)
+	  for(long z = 0;z<shape[2];++z){
+	    //not zero_padd::wrapped_insert_at_offsets, which centers even kernels at K/2
+	    const long wx = (x - (shape[0] - 1 - shape[0]/2) + extents[0]) % extents[0];
+	    const long wy = (y - (shape[1] - 1 - shape[1]/2) + extents[1]) % extents[1];
+	    const long wz = (z - (shape[2] - 1 - shape[2]/2) + extents[2]) % extents[2];
+	    _buffer[(wx*padded[1] + wy)*padded[2] + wz] = _kernel[(x*shape[1] + y)*shape[2] + z];
+	  }
+
+      _plan.forward(_buffer.data());
+    }
+
+    //the shape dependent part of fft_convolve_3d (fft plan, kernel spectrum and padded
+    //image buffer), set up once to convolve any number of images of the same extents;
+    //the image buffer is allocated by the first convolve
+    class fft_convolution {
+
+      long shape_[3];
+      long half_[3];
+      std::shared_ptr<const fft_plan_3d> plan_;
+      std::shared_ptr<const fft_buffer> kernel_;
+      fft_buffer image_;
+      float scale_;
+
+      fft_convolution& operator=(const fft_convolution&);
+
+    public:
+
+      template <typename ExtentT>
+      fft_convolution(ExtentT* src_extents,
+		      const float* kernel_begin, ExtentT* kernel_extents,
+		      unsigned _num_threads = 0):
+	scale_(1)
+      {
+	for(int d = 0;d<3;++d){
+	  shape_[d] = src_extents[d];
+	  half_[d] = long(kernel_extents[d])/2;
+	  if(shape_[d] <= 2*half_[d])
+	    return;
+	}
+
+	zero_padd<image_stack> padding = fft_padding(src_extents, kernel_extents);
+	const std::vector<long> extents(padding.extents(), padding.extents() + 3);
+	plan_ = fft_plan_3d::get(extents, _num_threads);
+	std::shared_ptr<fft_buffer> kernel = std::make_shared<fft_buffer>();
+	kernel_spectrum(kernel_begin, kernel_extents, *plan_, *kernel);
+	kernel_ = kernel;
+	scale_ = 1.f/float(extents[0]*extents[1]*extents[2]);
+      }
+
+      //shares the kernel spectrum of _other, but has an image buffer of its own and
+      //transforms with _num_threads threads, so both can convolve at the same time
+      fft_convolution(const fft_convolution& _other, unsigned _num_threads):
+	kernel_(_other.kernel_),
+	scale_(_other.scale_)
+      {
+	std::copy(_other.shape_, _other.shape_ + 3, shape_);
+	std::copy(_other.half_, _other.half_ + 3, half_);
+	if(_other.plan_)
+	  plan_ = fft_plan_3d::get(_other.plan_->extents(), _num_threads);
+      }
+
+      //writes the interior of the convolution of src_begin to out_begin, does nothing
+      //for images without an interior
+      void convolve(const float* src_begin, float* out_begin){
+
+	if(!plan_)
+	  return;
+
+	const std::vector<long>& padded = plan_->padded_extents();
+	image_.resize(plan_->padded_size());
+	std::fill(image_.data(), image_.data() + image_.size(), 0.f);
+	for(long x = 0;x<shape_[0];++x)
+	  for(long y = 0;y<shape_[1];++y)
+	    std::copy(src_begin + (x*shape_[1] + y)*shape_[2],
+		      src_begin + (x*shape_[1] + y + 1)*shape_[2],
+		      image_.data() + (x*padded[1] + y)*padded[2]);
+
+	plan_->forward(image_.data());
+	multiply_spectra(image_.data(), kernel_->data(), plan_->spectrum_size(), scale_);
+	plan_->backward(image_.data());
+
+	for(long x = half_[0];x<shape_[0] - half_[0];++x)
+	  for(long y = half_[1];y<shape_[1] - half_[1];++y){
+	    const float* row = image_.data() + (x*padded[1] + y)*padded[2];
+	    std::copy(row + half_[2], row + shape_[2] - half_[2],
+		      out_begin + (x*shape_[1] + y)*shape_[2] + half_[2]);
+	  }
+      }
+    };
+
+    //frequency domain convolution: image and kernel are zero padded to the linear
+    //convolution size and transformed in place (real-to-complex), the interior voxels
+    //of the product's inverse are written to out_begin (voxels closer than half a kernel
+    //to the border are not touched, like in convolve_3d); uses FFTW if the library was
+    //built with it and the built-in mixed radix fft otherwise
+    template <typename ExtentT>
+    void fft_convolve_3d(const float* src_begin, ExtentT* src_extents,
+			 const float* kernel_begin, ExtentT* kernel_extents,
+			 float* out_begin,
+			 unsigned _num_threads = 0)
+    {
+      fft_convolution(src_extents, kernel_begin, kernel_extents, _num_threads).convolve(src_begin, out_begin);
+    }
+
+  };
+};
+
+#endif /* _CPU_FFT_CONVOLVE_HPP_ */
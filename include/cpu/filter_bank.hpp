@@ -0,0 +1,152 @@
+#ifndef _CPU_FILTER_BANK_HPP_
+#define _CPU_FILTER_BANK_HPP_
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include "image_stack_utils.h"
+#include "padd_utils.h"
+#include "cpu_features.hpp"
+#include "thread_pool.hpp"
+#include "vectorized_convolve.hpp"
+#include "tiled_convolve.hpp"
+#include "fft.hpp"
+#include "fft_convolve.hpp"
+
+namespace anyfold {
+
+  namespace cpu {
+
+    //convolves one image with _count kernels (kernel_begins[k] of the extents
+    //kernel_extents[k], any sizes, even ones centered like vectorized_convolve_3d) into
+    //out_begins[k], interior voxels of each kernel only; the image is walked tile by tile (tiles
+    //sized for the largest kernel by choose_tile_shape) and all kernels are applied to
+    //a tile while its input is still in cache, so the image is streamed from memory
+    //about once instead of once per kernel; tiles are distributed over _num_threads
+    template <typename ExtentT>
+    void tiled_filter_bank_3d(const float* src_begin, ExtentT* src_extents,
+			      const float* const* kernel_begins, ExtentT* const* kernel_extents,
+			      std::size_t _count,
+			      float* const* out_begins,
+			      unsigned _num_threads = 0,
+			      instruction_set _isa = best_instruction_set())
+    {
+      const long shape[3] = {long(src_extents[0]), long(src_extents[1]), long(src_extents[2])};
+      if(!_count || !shape[0] || !shape[1] || !shape[2])
+	return;
+
+      std::vector<std::vector<float> > flipped(_count);
+      std::vector<line_geometry> geometry(_count);
+      long largest[3] = {1, 1, 1};
+      for(std::size_t k = 0;k<_count;++k){
+	flipped[k] = flip_kernel(kernel_begins[k], kernel_extents[k]);
+	geometry[k].kernel_ = &flipped[k][0];
+	for(int d = 0;d<3;++d){
+	  geometry[k].kernel_shape_[d] = kernel_extents[k][d];
+	  largest[d] = std::max(largest[d], long(kernel_extents[k][d]));
+	}
+	geometry[k].line_stride_ = shape[2];
+	geometry[k].plane_stride_ = shape[1]*shape[2];
+      }
+
+      //the tiles cover the whole image, every kernel clips them to its own interior
+      const std::vector<long> tile = choose_tile_shape(shape, largest);
+      const line_kernel line = select_line_kernel(_isa);
+
+      long tiles[3];
+      for(int d = 0;d<3;++d)
+	tiles[d] = (shape[d] + tile[d] - 1)/tile[d];
+
+      thread_pool::global().parallel_for(0, tiles[0]*tiles[1]*tiles[2],
+					 [&](long _index){
+					   const long t[3] = {_index/(tiles[1]*tiles[2]), (_index/tiles[2]) % tiles[1], _index % tiles[2]};
+
+					   for(std::size_t k = 0;k<_count;++k){
+					     const line_geometry& g = geometry[k];
+					     long half[3];
+					     long begin[3];
+					     long end[3];
+					     for(int d = 0;d<3;++d){
+					       half[d] = g.kernel_shape_[d]/2;
+					       begin[d] = std::max(t[d]*tile[d], half[d]);
+					       end[d] = std::min((t[d] + 1)*tile[d], shape[d] - half[d]);
+					     }
+					     if(begin[0] >= end[0] || begin[1] >= end[1] || begin[2] >= end[2])
+					       continue;
+
+					     for(long x = begin[0];x<end[0];++x)
+					       for(long y = begin[1];y<end[1];++y){
+						 const float* src = src_begin + (x-half[0])*g.plane_stride_ + (y-half[1])*g.line_stride_ + begin[2] - half[2];
+						 float* dst = out_begins[k] + x*g.plane_stride_ + y*g.line_stride_ + begin[2];
+						 line(src, dst, end[2] - begin[2], g);
+					       }
+					   }
+					 },
+					 _num_threads);
+    }
+
+    //same result as fft_convolve_3d for every kernel, but the image is padded for the
+    //largest kernel and transformed only once, each kernel then costs its own spectrum,
+    //one product and one inverse transform
+    template <typename ExtentT>
+    void fft_filter_bank_3d(const float* src_begin, ExtentT* src_extents,
+			    const float* const* kernel_begins, ExtentT* const* kernel_extents,
+			    std::size_t _count,
+			    float* const* out_begins,
+			    unsigned _num_threads = 0)
+    {
+      long shape[3] = {long(src_extents[0]), long(src_extents[1]), long(src_extents[2])};
+      long largest[3] = {1, 1, 1};
+      for(std::size_t k = 0;k<_count;++k)
+	for(int d = 0;d<3;++d)
+	  largest[d] = std::max(largest[d], long(kernel_extents[k][d]));
+      if(!_count || !shape[0] || !shape[1] || !shape[2])
+	return;
+
+      zero_padd<image_stack> padding = fft_padding(shape, largest);
+      const std::vector<long> extents(padding.extents(), padding.extents() + 3);
+      std::shared_ptr<const fft_plan_3d> plan = fft_plan_3d::get(extents, _num_threads);
+      const std::vector<long>& padded = plan->padded_extents();
+      const float scale = 1.f/float(extents[0]*extents[1]*extents[2]);
+
+      fft_buffer image(plan->padded_size());
+      std::fill(image.data(), image.data() + image.size(), 0.f);
+      for(long x = 0;x<shape[0];++x)
+	for(long y = 0;y<shape[1];++y)
+	  std::copy(src_begin + (x*shape[1] + y)*shape[2],
+		    src_begin + (x*shape[1] + y + 1)*shape[2],
+		    image.data() + (x*padded[1] + y)*padded[2]);
+      plan->forward(image.data());
+
+      fft_buffer kernel;
+      fft_buffer product(plan->padded_size());
+      for(std::size_t k = 0;k<_count;++k){
+
+	long half[3];
+	bool interior = true;
+	for(int d = 0;d<3;++d){
+	  half[d] = long(kernel_extents[k][d])/2;
+	  interior = interior && shape[d] > 2*half[d];
+	}
+	if(!interior)
+	  continue;
+
+	//the kernel is centered at the origin of the common padded extents
+	kernel_spectrum(kernel_begins[k], kernel_extents[k], *plan, kernel);
+
+	std::copy(image.data(), image.data() + image.size(), product.data());
+	multiply_spectra(product.data(), kernel.data(), plan->spectrum_size(), scale);
+	plan->backward(product.data());
+
+	for(long x = half[0];x<shape[0] - half[0];++x)
+	  for(long y = half[1];y<shape[1] - half[1];++y){
+	    const float* row = product.data() + (x*padded[1] + y)*padded[2];
+	    std::copy(row + half[2], row + shape[2] - half[2],
+		      out_begins[k] + (x*shape[1] + y)*shape[2] + half[2]);
+	  }
+      }
+    }
+
+  };
+};
+
+#endif /* _CPU_FILTER_BANK_HPP_ */
@@ -0,0 +1,231 @@
+#ifndef _CPU_FIXED_CONVOLVE_HPP_
+#define _CPU_FIXED_CONVOLVE_HPP_
+#include <algorithm>
+#include <type_traits>
+#include "cpu_features.hpp"
+#include "thread_pool.hpp"
+#include "vectorized_convolve.hpp"
+
+#ifdef ANYFOLD_X86_SIMD
+#include <immintrin.h>
+#endif
+
+namespace anyfold {
+
+  namespace cpu {
+
+    //line kernels for kernel extents known at compile time: the tap loops have constant
+    //trip counts, so the compiler unrolls them and folds the tap offsets into the
+    //addressing; _src points to the first input voxel of the first output voxel _dst,
+    //_length consecutive (unit-stride) output voxels are computed; _taps is the flipped
+    //kernel, c ordered K0xK1xK2 with kernel axis 0 along _plane_stride
+    typedef void (*fixed_line_kernel)(const float* _src, float* _dst, long _length,
+				      long _line_stride, long _plane_stride, const float* _taps);
+
+    template <int K0, int K1, int K2>
+    void convolve_fixed_line_scalar(const float* _src, float* _dst, long _length,
+				    long _line_stride, long _plane_stride, const float* _taps){
+
+      for(long i = 0;i<_length;++i){
+	float value = 0;
+	for(int a = 0;a<K0;++a)
+	  for(int b = 0;b<K1;++b)
+	    for(int c = 0;c<K2;++c)
+	      value += _taps[(a*K1 + b)*K2 + c]*_src[a*_plane_stride + b*_line_stride + c + i];
+	_dst[i] = value;
+      }
+    }
+
+#ifdef ANYFOLD_X86_SIMD
+
+    template <int K0, int K1, int K2>
+    __attribute__((target("avx2,fma")))
+    void convolve_fixed_line_avx2(const float* _src, float* _dst, long _length,
+				  long _line_stride, long _plane_stride, const float* _taps){
+
+      const long width = 8;
+      long i = 0;
+
+      for(;i + 4*width<=_length;i += 4*width){
+	__m256 acc0 = _mm256_setzero_ps();
+	__m256 acc1 = _mm256_setzero_ps();
+	__m256 acc2 = _mm256_setzero_ps();
+	__m256 acc3 = _mm256_setzero_ps();
+	for(int a = 0;a<K0;++a)
+	  for(int b = 0;b<K1;++b){
+	    const float* row = _src + a*_plane_stride + b*_line_stride + i;
+	    for(int c = 0;c<K2;++c){
+	      const __m256 weight = _mm256_broadcast_ss(_taps + (a*K1 + b)*K2 + c);
+	      acc0 = _mm256_fmadd_ps(weight, _mm256_loadu_ps(row + c), acc0);
+	      acc1 = _mm256_fmadd_ps(weight, _mm256_loadu_ps(row + c + width), acc1);
+	      acc2 = _mm256_fmadd_ps(weight, _mm256_loadu_ps(row + c + 2*width), acc2);
+	      acc3 = _mm256_fmadd_ps(weight, _mm256_loadu_ps(row + c + 3*width), acc3);
+	    }
+	  }
+	_mm256_storeu_ps(_dst + i, acc0);
+	_mm256_storeu_ps(_dst + i + width, acc1);
+	_mm256_storeu_ps(_dst + i + 2*width, acc2);
+	_mm256_storeu_ps(_dst + i + 3*width, acc3);
+      }
+
+      for(;i + width<=_length;i += width){
+	__m256 acc = _mm256_setzero_ps();
+	for(int a = 0;a<K0;++a)
+	  for(int b = 0;b<K1;++b){
+	    const float* row = _src + a*_plane_stride + b*_line_stride + i;
+	    for(int c = 0;c<K2;++c)
+	      acc = _mm256_fmadd_ps(_mm256_broadcast_ss(_taps + (a*K1 + b)*K2 + c), _mm256_loadu_ps(row + c), acc);
+	  }
+	_mm256_storeu_ps(_dst + i, acc);
+      }
+
+      convolve_fixed_line_scalar<K0,K1,K2>(_src + i, _dst + i, _length - i, _line_stride, _plane_stride, _taps);
+    }
+
+    template <int K0, int K1, int K2>
+    __attribute__((target("avx512f")))
+    void convolve_fixed_line_avx512(const float* _src, float* _dst, long _length,
+				    long _line_stride, long _plane_stride, const float* _taps){
+
+      const long width = 16;
+      long i = 0;
+
+      for(;i + 4*width<=_length;i += 4*width){
+	__m512 acc0 = _mm512_setzero_ps();
+	__m512 acc1 = _mm512_setzero_ps();
+	__m512 acc2 = _mm512_setzero_ps();
+	__m512 acc3 = _mm512_setzero_ps();
+	for(int a = 0;a<K0;++a)
+	  for(int b = 0;b<K1;++b){
+	    const float* row = _src + a*_plane_stride + b*_line_stride + i;
+	    for(int c = 0;c<K2;++c){
+	      const __m512 weight = _mm512_set1_ps(_taps[(a*K1 + b)*K2 + c]);
+	      acc0 = _mm512_fmadd_ps(weight, _mm512_loadu_ps(row + c), acc0);
+	      acc1 = _mm512_fmadd_ps(weight, _mm512_loadu_ps(row + c + width), acc1);
+	      acc2 = _mm512_fmadd_ps(weight, _mm512_loadu_ps(row + c + 2*width), acc2);
+	      acc3 = _mm512_fmadd_ps(weight, _mm512_loadu_ps(row + c + 3*width), acc3);
+	    }
+	  }
+	_mm512_storeu_ps(_dst + i, acc0);
+	_mm512_storeu_ps(_dst + i + width, acc1);
+	_mm512_storeu_ps(_dst + i + 2*width, acc2);
+	_mm512_storeu_ps(_dst + i + 3*width, acc3);
+      }
+
+      for(;i<_length;i += width){
+	const __mmask16 mask = (_length - i >= width) ? __mmask16(0xffff) : __mmask16((1u << (_length - i)) - 1u);
+	__m512 acc = _mm512_setzero_ps();
+	for(int a = 0;a<K0;++a)
+	  for(int b = 0;b<K1;++b){
+	    const float* row = _src + a*_plane_stride + b*_line_stride + i;
+	    for(int c = 0;c<K2;++c)
+	      acc = _mm512_fmadd_ps(_mm512_set1_ps(_taps[(a*K1 + b)*K2 + c]), _mm512_maskz_loadu_ps(mask, row + c), acc);
+	  }
+	_mm512_mask_storeu_ps(_dst + i, mask, acc);
+      }
+    }
+
+#endif
+
+    template <int K0, int K1, int K2>
+    fixed_line_kernel select_fixed_line_kernel(instruction_set _isa){
+
+      //throws for unsupported instruction sets
+      select_line_kernel(_isa);
+
+#ifdef ANYFOLD_X86_SIMD
+      if(_isa == instruction_set::avx512)
+	return convolve_fixed_line_avx512<K0,K1,K2>;
+      if(_isa == instruction_set::avx2)
+	return convolve_fixed_line_avx2<K0,K1,K2>;
+#endif
+      return convolve_fixed_line_scalar<K0,K1,K2>;
+    }
+
+    //direct convolution with a kernel of the compile time extents K0xK1xK2 (c ordered,
+    //kernel axis d runs along volume axis d); the volume has the extents _shape and
+    //axis d is _strides[d] floats apart in memory, _strides[2] has to be 1 (callers
+    //with other storage orders permute the axes first); the interior is written to
+    //_dst, planes of axis 0 are distributed over _num_threads threads
+    template <int K0, int K1, int K2>
+    void convolve_fixed(const float* _src, float* _dst,
+			const long* _shape, const long* _strides,
+			const float* _kernel,
+			unsigned _num_threads = 0,
+			thread_pool& _pool = thread_pool::global(),
+			instruction_set _isa = best_instruction_set()){
+
+      const long half[3] = {K0/2, K1/2, K2/2};
+      const long length = _shape[2] - 2*half[2];
+      if(_shape[0] <= 2*half[0] || _shape[1] <= 2*half[1] || length <= 0)
+	return;
+
+      float taps[K0*K1*K2];
+      std::reverse_copy(_kernel, _kernel + K0*K1*K2, taps);
+      const fixed_line_kernel line = select_fixed_line_kernel<K0,K1,K2>(_isa);
+
+      _pool.parallel_for(half[0], _shape[0] - half[0],
+			 [&](long _x){
+			   for(long y = half[1];y<_shape[1] - half[1];++y)
+			     line(_src + (_x-half[0])*_strides[0] + (y-half[1])*_strides[1],
+				  _dst + _x*_strides[0] + y*_strides[1] + half[2],
+				  length, _strides[1], _strides[0], taps);
+			 },
+			 _num_threads);
+    }
+
+    template <typename IterT>
+    struct is_float_pointer :
+      std::integral_constant<bool, std::is_pointer<IterT>::value &&
+			     std::is_same<typename std::remove_cv<typename std::remove_pointer<IterT>::type>::type, float>::value> {};
+
+    template <typename ExtentT>
+    bool dispatch_fixed(const float* _src, float* _dst,
+			const long* _shape, const long* _strides,
+			const float* _kernel, ExtentT* _kernel_extents,
+			unsigned _num_threads, thread_pool& _pool, std::true_type){
+
+      if(_strides[2] != 1 || _kernel_extents[0] != _kernel_extents[1] || _kernel_extents[0] != _kernel_extents[2])
+	return false;
+
+      switch(_kernel_extents[0]){
+      case 3:
+	convolve_fixed<3,3,3>(_src, _dst, _shape, _strides, _kernel, _num_threads, _pool);
+	return true;
+      case 5:
+	convolve_fixed<5,5,5>(_src, _dst, _shape, _strides, _kernel, _num_threads, _pool);
+	return true;
+      case 7:
+	convolve_fixed<7,7,7>(_src, _dst, _shape, _strides, _kernel, _num_threads, _pool);
+	return true;
+      default:
+	return false;
+      }
+    }
+
+    template <typename ExtentT, typename SrcIterT, typename KernIterT, typename OutIterT>
+    bool dispatch_fixed(SrcIterT, OutIterT, const long*, const long*, KernIterT, ExtentT*,
+			unsigned, thread_pool&, std::false_type){
+      return false;
+    }
+
+    //runs convolve_fixed if _kernel_extents is one of the instantiated cubic sizes
+    //(3, 5 and 7) and all iterators are plain float pointers, returns false (and does
+    //nothing) otherwise
+    template <typename ExtentT, typename SrcIterT, typename KernIterT, typename OutIterT>
+    bool dispatch_fixed(SrcIterT _src, OutIterT _dst,
+			const long* _shape, const long* _strides,
+			KernIterT _kernel, ExtentT* _kernel_extents,
+			unsigned _num_threads = 0,
+			thread_pool& _pool = thread_pool::global()){
+
+      typedef std::integral_constant<bool, is_float_pointer<SrcIterT>::value &&
+				     is_float_pointer<KernIterT>::value &&
+				     is_float_pointer<OutIterT>::value> pointers;
+      return dispatch_fixed(_src, _dst, _shape, _strides, _kernel, _kernel_extents, _num_threads, _pool, pointers());
+    }
+
+  };
+};
+
+#endif /* _CPU_FIXED_CONVOLVE_HPP_ */
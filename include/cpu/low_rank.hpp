@@ -0,0 +1,69 @@
+#ifndef _CPU_LOW_RANK_HPP_
+#define _CPU_LOW_RANK_HPP_
+#include <vector>
+#include "image_stack_utils.h"
+#include "kernel_utils.h"
+#include "separable.hpp"
+#include "vectorized_convolve.hpp"
+
+namespace anyfold {
+
+  namespace cpu {
+
+    //runs one separable pass per term and accumulates the terms in the interior of _result
+    inline void convolve_low_rank(image_stack_cref _image,
+				  const std::vector<separable_term>& _terms,
+				  image_stack_ref _result,
+				  separable_scratch& _scratch,
+				  unsigned _num_threads = 0){
+
+      for(unsigned t = 0;t<_terms.size();++t)
+	convolve_separable(_image,
+			   _terms[t].factors_[0], _terms[t].factors_[1], _terms[t].factors_[2],
+			   _result, _scratch, _num_threads, t > 0);
+    }
+
+    inline void convolve_low_rank(image_stack_cref _image,
+				  const std::vector<separable_term>& _terms,
+				  image_stack_ref _result,
+				  unsigned _num_threads = 0){
+
+      separable_scratch scratch;
+      convolve_low_rank(_image, _terms, _result, scratch, _num_threads);
+    }
+
+    //convolves with a sum-of-separable approximation of the kernel whose relative
+    //frobenius error is at most _rel_error; if that takes more than _max_rank terms or the
+    //terms need more taps than the direct loop, vectorized_convolve_3d is used instead;
+    //returns the number of separable terms used (0 for the direct fallback)
+    template <typename ExtentT>
+    unsigned convolve_low_rank_3d(const float* src_begin, ExtentT* src_extents,
+				  const float* kernel_begin, ExtentT* kernel_extents,
+				  float* out_begin,
+				  float _rel_error = 1e-3f,
+				  unsigned _max_rank = 4,
+				  unsigned _num_threads = 0)
+    {
+      std::vector<separable_term> terms;
+      const double error = decompose_low_rank(kernel_begin, kernel_extents, terms, _rel_error, _max_rank);
+
+      const long taps_direct = long(kernel_extents[0])*kernel_extents[1]*kernel_extents[2];
+      const long taps_low_rank = long(terms.size())*(long(kernel_extents[0]) + kernel_extents[1] + kernel_extents[2]);
+
+      if(error > _rel_error || taps_low_rank >= taps_direct){
+	vectorized_convolve_3d(src_begin, src_extents, kernel_begin, kernel_extents, out_begin, _num_threads);
+	return 0;
+      }
+
+      std::vector<ExtentT> image_shape(src_extents,src_extents+3);
+      anyfold::image_stack_cref image(src_begin, image_shape);
+      anyfold::image_stack_ref output(out_begin, image_shape);
+
+      convolve_low_rank(image, terms, output, _num_threads);
+      return terms.size();
+    }
+
+  };
+};
+
+#endif /* _CPU_LOW_RANK_HPP_ */
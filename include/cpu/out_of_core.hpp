@@ -0,0 +1,204 @@
+#ifndef _CPU_OUT_OF_CORE_HPP_
+#define _CPU_OUT_OF_CORE_HPP_
+
+#if defined(__unix__) || defined(__APPLE__)
+#define ANYFOLD_HAS_MMAP 1
+#endif
+
+#ifdef ANYFOLD_HAS_MMAP
+#include <string>
+#include <cstring>
+#include <cerrno>
+#include <sstream>
+#include <stdexcept>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "fixed_convolve.hpp"
+#include "vectorized_convolve.hpp"
+
+namespace anyfold {
+
+  namespace cpu {
+
+    //a whole file mapped into memory, read-only or (created and sized) read-write
+    class mapped_file {
+
+      int descriptor_;
+      std::size_t size_;
+      void* data_;
+
+      static void fail(const std::string& _what, const std::string& _path){
+	std::ostringstream msg;
+	msg << "[anyfold::mapped_file]\t" << _what << " " << _path << " failed: " << std::strerror(errno) << "\n";
+	throw std::runtime_error(msg.str().c_str());
+      }
+
+      mapped_file(const mapped_file&);
+      mapped_file& operator=(const mapped_file&);
+
+    public:
+
+      //maps _path read-only
+      explicit mapped_file(const std::string& _path):
+	descriptor_(-1),
+	size_(0),
+	data_(nullptr)
+      {
+	descriptor_ = ::open(_path.c_str(), O_RDONLY);
+	if(descriptor_ < 0)
+	  fail("open", _path);
+
+	struct stat info;
+	if(::fstat(descriptor_, &info) != 0){
+	  ::close(descriptor_);
+	  fail("fstat", _path);
+	}
+	size_ = info.st_size;
+
+	if(size_){
+	  data_ = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, descriptor_, 0);
+	  if(data_ == MAP_FAILED){
+	    ::close(descriptor_);
+	    fail("mmap", _path);
+	  }
+	}
+      }
+
+      //creates (or truncates) _path with _size bytes of zeros and maps it read-write
+      mapped_file(const std::string& _path, std::size_t _size):
+	descriptor_(-1),
+	size_(_size),
+	data_(nullptr)
+      {
+	descriptor_ = ::open(_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(descriptor_ < 0)
+	  fail("open", _path);
+
+	if(::ftruncate(descriptor_, off_t(size_)) != 0){
+	  ::close(descriptor_);
+	  fail("ftruncate", _path);
+	}
+
+	if(size_){
+	  data_ = ::mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, descriptor_, 0);
+	  if(data_ == MAP_FAILED){
+	    ::close(descriptor_);
+	    fail("mmap", _path);
+	  }
+	}
+      }
+
+      ~mapped_file(){
+	if(data_)
+	  ::munmap(data_, size_);
+	if(descriptor_ >= 0)
+	  ::close(descriptor_);
+      }
+
+      std::size_t size() const {
+	return size_;
+      }
+
+      const char* data() const {
+	return static_cast<const char*>(data_);
+      }
+
+      char* data() {
+	return static_cast<char*>(data_);
+      }
+
+      //madvise on the pages overlapping the bytes [_begin,_end), hints only, so
+      //errors are ignored
+      void advise(std::size_t _begin, std::size_t _end, int _advice) const {
+
+	static const std::size_t page = ::sysconf(_SC_PAGESIZE);
+	_end = std::min(_end, size_);
+	if(!data_ || _begin >= _end)
+	  return;
+
+	const std::size_t first = (_begin/page)*page;
+	::madvise(static_cast<char*>(data_) + first, _end - first, _advice);
+      }
+
+      //starts writeback of the bytes [_begin,_end) without waiting for it
+      void flush(std::size_t _begin, std::size_t _end) const {
+
+	static const std::size_t page = ::sysconf(_SC_PAGESIZE);
+	_end = std::min(_end, size_);
+	if(!data_ || _begin >= _end)
+	  return;
+
+	const std::size_t first = (_begin/page)*page;
+	::msync(static_cast<char*>(data_) + first, _end - first, MS_ASYNC);
+      }
+    };
+
+    //convolves the raw float volume in _src_path (c storage order, no header) into
+    //_dst_path (created, interior voxels only like convolve_3d, the border is zero):
+    //the output is produced in slabs of _slab_planes planes of the first (slowest)
+    //dimension straight from and into the mapped files; the input of the next slab is
+    //prefetched and the pages of both files that are done with are released, so that
+    //only about _slab_planes + kernel_extents[0] planes stay resident; with 0 the slab
+    //holds about 64 MB
+    template <typename ExtentT>
+    void stream_convolve_file(const std::string& _src_path, const std::string& _dst_path,
+			      ExtentT* src_extents,
+			      const float* kernel_begin, ExtentT* kernel_extents,
+			      std::size_t _slab_planes = 0,
+			      unsigned _num_threads = 0)
+    {
+      const long shape[3] = {long(src_extents[0]), long(src_extents[1]), long(src_extents[2])};
+      const long kernel_shape[3] = {long(kernel_extents[0]), long(kernel_extents[1]), long(kernel_extents[2])};
+      const std::size_t plane_bytes = sizeof(float)*shape[1]*shape[2];
+      const std::size_t bytes = plane_bytes*shape[0];
+
+      mapped_file source(_src_path);
+      if(source.size() < bytes){
+	std::ostringstream msg;
+	msg << "[anyfold::stream_convolve_file]\t" << _src_path << " holds " << source.size() << " bytes, "
+	    << shape[0] << "x" << shape[1] << "x" << shape[2] << " floats need " << bytes << "\n";
+	throw std::runtime_error(msg.str().c_str());
+      }
+      mapped_file destination(_dst_path, bytes);
+      if(!bytes)
+	return;
+
+      source.advise(0, bytes, MADV_SEQUENTIAL);
+
+      const long half = kernel_shape[0]/2;
+      const long slab = _slab_planes ? long(_slab_planes) : std::max(1L, long((64 << 20)/plane_bytes));
+      const float* src = reinterpret_cast<const float*>(source.data());
+      float* dst = reinterpret_cast<float*>(destination.data());
+      const long strides[3] = {shape[1]*shape[2], shape[2], 1};
+
+      for(long begin = half;begin<shape[0] - half;begin += slab){
+	const long end = std::min(begin + slab, shape[0] - half);
+
+	//the input of the next slab is read ahead while this one is computed
+	source.advise((end + half)*plane_bytes, (std::min(end + slab, shape[0] - half) + half)*plane_bytes, MADV_WILLNEED);
+
+	//planes [begin-half, end+half) seen as a volume of its own whose interior is the slab
+	const long window[3] = {end - begin + 2*half, shape[1], shape[2]};
+	const float* window_src = src + (begin - half)*strides[0];
+	float* window_dst = dst + (begin - half)*strides[0];
+	if(!dispatch_fixed(window_src, window_dst, window, strides, kernel_begin, kernel_shape, _num_threads))
+	  vectorized_convolve_3d(window_src, window, kernel_begin, kernel_shape, window_dst, _num_threads);
+
+	//input planes below the next window and the finished output go
+	destination.flush(begin*plane_bytes, end*plane_bytes);
+	destination.advise(begin*plane_bytes, end*plane_bytes, MADV_DONTNEED);
+	source.advise((begin - half)*plane_bytes, (end - half)*plane_bytes, MADV_DONTNEED);
+      }
+
+      destination.flush(0, bytes);
+    }
+
+  };
+};
+
+#endif /* ANYFOLD_HAS_MMAP */
+
+#endif /* _CPU_OUT_OF_CORE_HPP_ */
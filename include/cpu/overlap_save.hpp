@@ -0,0 +1,192 @@
+#ifndef _CPU_OVERLAP_SAVE_HPP_
+#define _CPU_OVERLAP_SAVE_HPP_
+#include <vector>
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+#include "image_stack_utils.h"
+#include "padd_utils.h"
+#include "fft.hpp"
+#include "fft_convolve.hpp"
+
+namespace anyfold {
+
+  namespace cpu {
+
+    //bytes the overlap-save engine needs for a block of the given fft extents:
+    //the block workspace and the kernel spectrum, both in the padded in-place layout
+    inline std::size_t overlap_save_footprint(const std::vector<long>& _block){
+
+      std::vector<long> padded(3);
+      adapt_extents_for_fftw_inplace(storage(boost::c_storage_order()), _block, padded);
+      return 2*sizeof(float)*std::size_t(padded[0])*padded[1]*padded[2];
+    }
+
+    //largest fft friendly block extents (at most what the whole volume needs) whose
+    //footprint fits into _memory_budget bytes, blocks are shrunk along the axis with the
+    //most output voxels per block; throws if not even a block of kernel size fits
+    template <typename ExtentT>
+    std::vector<long> overlap_save_block_shape(ExtentT* _image_extents, ExtentT* _kernel_extents,
+					      std::size_t _memory_budget){
+
+      std::vector<long> block(3);
+      for(int d = 0;d<3;++d)
+	block[d] = next_fast_fft_size(long(_image_extents[d]));
+
+      while(overlap_save_footprint(block) > _memory_budget){
+
+	int axis = -1;
+	for(int d = 0;d<3;++d){
+	  if(block[d] <= long(_kernel_extents[d]))
+	    continue;
+	  if(axis < 0 || block[d] - _kernel_extents[d] > block[axis] - _kernel_extents[axis])
+	    axis = d;
+	}
+
+	if(axis < 0){
+	  std::ostringstream msg;
+	  msg << "[anyfold::overlap_save_block_shape]\tmemory budget of " << _memory_budget
+	      << " bytes is too small for kernel " << _kernel_extents[0] << "x" << _kernel_extents[1] << "x" << _kernel_extents[2] << "\n";
+	  throw std::runtime_error(msg.str().c_str());
+	}
+
+	block[axis] = std::max(long(_kernel_extents[axis]), next_fast_fft_size((3*block[axis])/4));
+      }
+
+      return block;
+    }
+
+    //the shape dependent part of overlap_save_convolve_3d (block shape, fft plan, kernel
+    //spectrum and workspace), set up once to convolve any number of images of the same
+    //extents; the workspace is allocated by the first convolve
+    class overlap_save_convolution {
+
+      long shape_[3];
+      long half_[3];
+      std::vector<long> block_;
+      long valid_[3];
+      std::shared_ptr<const fft_plan_3d> plan_;
+      std::shared_ptr<const fft_buffer> kernel_;
+      fft_buffer workspace_;
+      float scale_;
+
+      overlap_save_convolution& operator=(const overlap_save_convolution&);
+
+    public:
+
+      //throws if _memory_budget doesn't hold a block of the kernel's extents
+      template <typename ExtentT>
+      overlap_save_convolution(ExtentT* src_extents,
+			       const float* kernel_begin, ExtentT* kernel_extents,
+			       std::size_t _memory_budget,
+			       unsigned _num_threads = 0):
+	scale_(1)
+      {
+	for(int d = 0;d<3;++d){
+	  shape_[d] = src_extents[d];
+	  half_[d] = long(kernel_extents[d])/2;
+	  if(shape_[d] <= 2*half_[d])
+	    return;
+	}
+
+	block_ = overlap_save_block_shape(src_extents, kernel_extents, _memory_budget);
+	plan_ = fft_plan_3d::get(block_, _num_threads);
+
+	//the kernel spectrum is the same for every block
+	std::shared_ptr<fft_buffer> kernel = std::make_shared<fft_buffer>();
+	kernel_spectrum(kernel_begin, kernel_extents, *plan_, *kernel);
+	kernel_ = kernel;
+
+	scale_ = 1.f/float(block_[0]*block_[1]*block_[2]);
+	//a block of at least kernel extent (see overlap_save_block_shape) yields at least
+	//one output voxel per axis, also for even kernels where 2*half is the extent
+	for(int d = 0;d<3;++d)
+	  valid_[d] = block_[d] - long(kernel_extents[d]) + 1;
+      }
+
+      //shares block shape and kernel spectrum of _other, but has a workspace of its own
+      //and transforms with _num_threads threads, so both can convolve at the same time
+      overlap_save_convolution(const overlap_save_convolution& _other, unsigned _num_threads):
+	block_(_other.block_),
+	kernel_(_other.kernel_),
+	scale_(_other.scale_)
+      {
+	std::copy(_other.shape_, _other.shape_ + 3, shape_);
+	std::copy(_other.half_, _other.half_ + 3, half_);
+	std::copy(_other.valid_, _other.valid_ + 3, valid_);
+	if(_other.plan_)
+	  plan_ = fft_plan_3d::get(block_, _num_threads);
+      }
+
+      //writes the interior of the convolution of src_begin to out_begin, does nothing
+      //for images without an interior
+      void convolve(const float* src_begin, float* out_begin){
+
+	if(!plan_)
+	  return;
+
+	const std::vector<long>& padded = plan_->padded_extents();
+	workspace_.resize(plan_->padded_size());
+	long origin[3];
+
+	for(origin[0] = half_[0];origin[0]<shape_[0] - half_[0];origin[0] += valid_[0])
+	  for(origin[1] = half_[1];origin[1]<shape_[1] - half_[1];origin[1] += valid_[1])
+	    for(origin[2] = half_[2];origin[2]<shape_[2] - half_[2];origin[2] += valid_[2]){
+
+	      //input block starts half a kernel before the first output voxel, voxels
+	      //outside the image are zero
+	      std::fill(workspace_.data(), workspace_.data() + workspace_.size(), 0.f);
+	      const long z_first = std::max(0L, origin[2] - half_[2]);
+	      const long z_last = std::min(shape_[2], origin[2] - half_[2] + block_[2]);
+	      for(long x = 0;x<block_[0];++x){
+		const long gx = origin[0] - half_[0] + x;
+		if(gx >= shape_[0])
+		  break;
+		for(long y = 0;y<block_[1];++y){
+		  const long gy = origin[1] - half_[1] + y;
+		  if(gy >= shape_[1])
+		    break;
+		  const float* row = src_begin + (gx*shape_[1] + gy)*shape_[2];
+		  std::copy(row + z_first, row + z_last,
+			    workspace_.data() + (x*padded[1] + y)*padded[2] + (z_first - (origin[2] - half_[2])));
+		}
+	      }
+
+	      plan_->forward(workspace_.data());
+	      multiply_spectra(workspace_.data(), kernel_->data(), plan_->spectrum_size(), scale_);
+	      plan_->backward(workspace_.data());
+
+	      const long count[3] = {std::min(valid_[0], shape_[0] - half_[0] - origin[0]),
+				     std::min(valid_[1], shape_[1] - half_[1] - origin[1]),
+				     std::min(valid_[2], shape_[2] - half_[2] - origin[2])};
+	      for(long x = 0;x<count[0];++x)
+		for(long y = 0;y<count[1];++y){
+		  const float* row = workspace_.data() + ((x + half_[0])*padded[1] + y + half_[1])*padded[2] + half_[2];
+		  std::copy(row, row + count[2],
+			    out_begin + ((origin[0] + x)*shape_[1] + origin[1] + y)*shape_[2] + origin[2]);
+		}
+	    }
+      }
+    };
+
+    //overlap-save convolution: the interior of the output is cut into blocks whose input
+    //(plus a halo of half a kernel on each side) fits an fft of the extents given by
+    //overlap_save_block_shape; the kernel is transformed once for that block shape and the
+    //blocks are streamed through a single workspace, so the memory used on top of
+    //source and destination is bounded by _memory_budget independent of the image size;
+    //like convolve_3d only the interior voxels of out_begin are written
+    template <typename ExtentT>
+    void overlap_save_convolve_3d(const float* src_begin, ExtentT* src_extents,
+				  const float* kernel_begin, ExtentT* kernel_extents,
+				  float* out_begin,
+				  std::size_t _memory_budget,
+				  unsigned _num_threads = 0)
+    {
+      overlap_save_convolution(src_extents, kernel_begin, kernel_extents,
+			       _memory_budget, _num_threads).convolve(src_begin, out_begin);
+    }
+
+  };
+};
+
+#endif /* _CPU_OVERLAP_SAVE_HPP_ */
@@ -0,0 +1,150 @@
+#ifndef _CPU_PLANE_STREAM_HPP_
+#define _CPU_PLANE_STREAM_HPP_
+#include <vector>
+#include <algorithm>
+#include "cpu_features.hpp"
+#include "thread_pool.hpp"
+#include "scratch_pool.hpp"
+#include "convert.hpp"
+#include "vectorized_convolve.hpp"
+
+namespace anyfold {
+
+  namespace cpu {
+
+    //stateful convolver for volumes that arrive one plane (of the first, slowest
+    //dimension) at a time: every pushed plane is kept in a ring of kernel_extents[0]
+    //planes and the output plane latency() planes behind the newest one is computed
+    //as soon as that plane arrived; the result is the same as the one of
+    //vectorized_convolve_3d on the whole stack (interior voxels only, the first
+    //kernel_extents[0]/2 planes are never emitted, for an even kernel_extents[0] the
+    //last emitted plane is one that vectorized_convolve_3d leaves untouched) and the
+    //memory is bounded by 2*kernel_extents[0] planes
+    class plane_stream {
+
+      long shape_[2];
+      long kernel_shape_[3];
+      std::vector<float> flipped_;
+      //every plane is stored twice, kernel_shape_[0] slots apart, so that the newest
+      //kernel_shape_[0] planes are always contiguous
+      scratch_buffer<float> ring_;
+      long pushed_;
+      unsigned num_threads_;
+      instruction_set isa_;
+      line_kernel line_;
+
+    public:
+
+      template <typename ExtentT>
+      plane_stream(ExtentT* _plane_extents,
+		   const float* _kernel, ExtentT* _kernel_extents,
+		   unsigned _num_threads = 0,
+		   instruction_set _isa = best_instruction_set()):
+	flipped_(flip_kernel(_kernel, _kernel_extents)),
+	pushed_(0),
+	num_threads_(_num_threads),
+	isa_(_isa),
+	line_(select_line_kernel(_isa))
+      {
+	shape_[0] = _plane_extents[0];
+	shape_[1] = _plane_extents[1];
+	for(int d = 0;d<3;++d)
+	  kernel_shape_[d] = _kernel_extents[d];
+	ring_.resize(2*kernel_shape_[0]*plane_size());
+      }
+
+      std::size_t plane_size() const {
+	return shape_[0]*shape_[1];
+      }
+
+      //number of planes an output plane lags behind the input, the kernel reaches
+      //kernel_extents[0]/2 planes back and the rest forward like in convolve_3d
+      long latency() const {
+	return kernel_shape_[0] - 1 - kernel_shape_[0]/2;
+      }
+
+      long pushed() const {
+	return pushed_;
+      }
+
+      //number of output planes produced so far, the last one has the plane index
+      //emitted() - 1 + kernel_extents[0]/2 = pushed() - 1 - latency() in the stack
+      long emitted() const {
+	return std::max(0L, pushed_ - kernel_shape_[0] + 1);
+      }
+
+      void reset(){
+	pushed_ = 0;
+      }
+
+      //copies _plane into the ring (converted to float if it is stored as float16 or
+      //bfloat16); returns true and writes the interior of the next output plane to
+      //_output once kernel_extents[0] planes have been pushed, a null _output skips
+      //that plane
+      template <typename T>
+      bool push(const T* _plane, float* _output){
+
+	const long slot = pushed_ % kernel_shape_[0];
+	float* first = &ring_[slot*plane_size()];
+	load_samples(_plane, first, plane_size(), isa_);
+	std::copy(first, first + plane_size(), &ring_[(slot + kernel_shape_[0])*plane_size()]);
+	++pushed_;
+
+	if(pushed_ < kernel_shape_[0])
+	  return false;
+
+	const long half[2] = {kernel_shape_[1]/2, kernel_shape_[2]/2};
+	const long length = shape_[1] - 2*half[1];
+	if(!_output || length <= 0 || shape_[0] <= 2*half[0])
+	  return true;
+
+	line_geometry geometry;
+	geometry.kernel_ = &flipped_[0];
+	std::copy(kernel_shape_, kernel_shape_ + 3, geometry.kernel_shape_);
+	geometry.line_stride_ = shape_[1];
+	geometry.plane_stride_ = plane_size();
+
+	//the oldest plane of the window sits right after the newest one
+	const float* window = &ring_[((slot + 1) % kernel_shape_[0])*plane_size()];
+	thread_pool::global().parallel_for(half[0], shape_[0] - half[0],
+					   [&](long _y){
+					     line_(window + (_y - half[0])*shape_[1],
+						   _output + _y*shape_[1] + half[1],
+						   length, geometry);
+					   },
+					   num_threads_);
+	return true;
+      }
+    };
+
+    //convolves the stack at image_begin (c storage order) in place: the interior
+    //voxels (see vectorized_convolve_3d) are overwritten by the result, all others keep
+    //their input values; the planes are fed through a plane_stream in order, so each
+    //output plane is written only after the input planes it needs were copied to the
+    //ring, and besides the stack only 2*kernel_extents[0] planes are held
+    template <typename ExtentT>
+    void convolve_in_place_3d(float* image_begin, ExtentT* image_extents,
+			      const float* kernel_begin, ExtentT* kernel_extents,
+			      unsigned _num_threads = 0,
+			      instruction_set _isa = best_instruction_set())
+    {
+      const long planes = image_extents[0];
+      if(!planes || !image_extents[1] || !image_extents[2])
+	return;
+
+      plane_stream stream(image_extents + 1, kernel_begin, kernel_extents, _num_threads, _isa);
+      const std::size_t size = stream.plane_size();
+      const long last = planes - long(kernel_extents[0])/2;
+      for(long x = 0;x<planes;++x){
+	//nothing is written before the first latency() planes are in, nor behind the
+	//interior (an even kernel would emit one more plane)
+	const long index = x - stream.latency();
+	float* output = (index < 0 || index >= last) ? nullptr : image_begin + index*size;
+	stream.push(image_begin + x*size, output);
+      }
+    }
+
+  };
+};
+
+#endif /* _CPU_PLANE_STREAM_HPP_ */
@@ -0,0 +1,327 @@
+#ifndef _CPU_SCRATCH_POOL_HPP_
+#define _CPU_SCRATCH_POOL_HPP_
+#include <map>
+#include <list>
+#include <vector>
+#include <mutex>
+#include <iterator>
+#include <cstdlib>
+#include <new>
+#include <type_traits>
+#include <algorithm>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+namespace anyfold {
+
+  namespace cpu {
+
+    //cache of aligned memory blocks for the temporaries of the backends (padded images,
+    //fft workspaces, intermediate volumes, ring buffers): released blocks are kept and
+    //handed out again to requests of the same rounded size, so repeated calls on images
+    //of one shape neither go to the system allocator nor page fault on fresh memory;
+    //the cache is bounded (by default by the largest bytes_in_use() so far, the working
+    //set of the biggest call), the blocks released longest ago are freed first, so
+    //blocks of shapes no longer used don't pile up; blocks are 64 byte aligned, with
+    //huge pages enabled blocks of at least 2 MB are aligned to 2 MB and advised to be
+    //backed by transparent huge pages (linux only)
+    class scratch_pool {
+
+    public:
+
+      //set_cache_limit value of the default bound
+      static const std::size_t automatic_limit = std::size_t(-1);
+
+    private:
+
+      typedef std::list<std::pair<std::size_t, void*> > block_list;
+
+      mutable std::mutex mutex_;
+      //cached blocks, released longest ago first
+      block_list free_;
+      std::map<void*, std::size_t> live_;
+      std::size_t in_use_;
+      std::size_t peak_;
+      std::size_t high_water_;
+      std::size_t cached_;
+      std::size_t cache_limit_;
+      bool huge_pages_;
+
+      static const std::size_t alignment = 64;
+      static const std::size_t huge_page = std::size_t(2) << 20;
+
+      scratch_pool(const scratch_pool&);
+      scratch_pool& operator=(const scratch_pool&);
+
+      std::size_t rounded(std::size_t _bytes) const {
+	const std::size_t step = (huge_pages_ && _bytes >= huge_page) ? huge_page : alignment;
+	return ((_bytes + step - 1)/step)*step;
+      }
+
+      void* allocate(std::size_t _bytes) const {
+	const std::size_t align = (huge_pages_ && _bytes >= huge_page) ? huge_page : alignment;
+	void* ptr = 0;
+	if(posix_memalign(&ptr, align, _bytes) != 0)
+	  return 0;
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+	if(align == huge_page)
+	  ::madvise(ptr, _bytes, MADV_HUGEPAGE);
+#endif
+	return ptr;
+      }
+
+      std::size_t limit() const {
+	return cache_limit_ == automatic_limit ? high_water_ : cache_limit_;
+      }
+
+      //drops the oldest blocks until _bytes more fit below the limit, the caller frees
+      //the returned blocks without holding the lock
+      std::vector<void*> evict(std::size_t _bytes){
+	std::vector<void*> evicted;
+	while(!free_.empty() && cached_ + _bytes > limit()){
+	  evicted.push_back(free_.front().second);
+	  cached_ -= free_.front().first;
+	  free_.pop_front();
+	}
+	return evicted;
+      }
+
+      static void free_blocks(const std::vector<void*>& _blocks){
+	for(std::size_t i = 0;i<_blocks.size();++i)
+	  free(_blocks[i]);
+      }
+
+    public:
+
+      scratch_pool():
+	in_use_(0),
+	peak_(0),
+	high_water_(0),
+	cached_(0),
+	cache_limit_(automatic_limit),
+	huge_pages_(false)
+      {}
+
+      ~scratch_pool(){
+	trim();
+      }
+
+      //the pool all scratch_buffers use by default, never destroyed so that buffers
+      //held by static objects can still be released at exit
+      static scratch_pool& global(){
+	static scratch_pool* pool = new scratch_pool;
+	return *pool;
+      }
+
+      //a block of at least _bytes bytes, uninitialized
+      void* acquire(std::size_t _bytes){
+
+	if(!_bytes)
+	  return 0;
+
+	std::unique_lock<std::mutex> lock(mutex_);
+	const std::size_t size = rounded(_bytes);
+	void* ptr = 0;
+
+	//the most recently released block of that size
+	block_list::reverse_iterator cached = free_.rbegin();
+	while(cached != free_.rend() && cached->first != size)
+	  ++cached;
+	if(cached != free_.rend()){
+	  ptr = cached->second;
+	  free_.erase(std::next(cached).base());
+	  cached_ -= size;
+	}
+	else {
+	  lock.unlock();
+	  ptr = allocate(size);
+	  if(!ptr){
+	    //the cache may be what keeps the system from serving the request
+	    trim();
+	    ptr = allocate(size);
+	  }
+	  if(!ptr)
+	    throw std::bad_alloc();
+	  lock.lock();
+	}
+
+	live_[ptr] = size;
+	in_use_ += size;
+	peak_ = std::max(peak_, in_use_);
+	high_water_ = std::max(high_water_, in_use_);
+	return ptr;
+      }
+
+      //hands back a block obtained by acquire
+      void release(void* _ptr){
+
+	if(!_ptr)
+	  return;
+
+	std::unique_lock<std::mutex> lock(mutex_);
+	std::map<void*, std::size_t>::iterator block = live_.find(_ptr);
+	if(block == live_.end())
+	  return;
+	const std::size_t size = block->second;
+	live_.erase(block);
+	in_use_ -= size;
+	std::vector<void*> evicted;
+	if(size > limit())
+	  evicted.push_back(_ptr);
+	else {
+	  evicted = evict(size);
+	  free_.push_back(std::make_pair(size, _ptr));
+	  cached_ += size;
+	}
+	lock.unlock();
+	free_blocks(evicted);
+      }
+
+      //returns all cached blocks to the system
+      void trim(){
+	block_list blocks;
+	{
+	  std::lock_guard<std::mutex> lock(mutex_);
+	  blocks.swap(free_);
+	  cached_ = 0;
+	}
+	for(block_list::iterator it = blocks.begin();it!=blocks.end();++it)
+	  free(it->second);
+      }
+
+      //bytes handed out and not yet released
+      std::size_t bytes_in_use() const {
+	std::lock_guard<std::mutex> lock(mutex_);
+	return in_use_;
+      }
+
+      //largest bytes_in_use() since construction or the last reset_peak()
+      std::size_t peak_bytes() const {
+	std::lock_guard<std::mutex> lock(mutex_);
+	return peak_;
+      }
+
+      //bytes of released blocks kept for reuse
+      std::size_t cached_bytes() const {
+	std::lock_guard<std::mutex> lock(mutex_);
+	return cached_;
+      }
+
+      void reset_peak(){
+	std::lock_guard<std::mutex> lock(mutex_);
+	peak_ = in_use_;
+      }
+
+      //at most _bytes of released blocks are kept (automatic_limit: the largest
+      //bytes_in_use() so far), the oldest are freed first
+      void set_cache_limit(std::size_t _bytes){
+	std::vector<void*> evicted;
+	{
+	  std::lock_guard<std::mutex> lock(mutex_);
+	  cache_limit_ = _bytes;
+	  evicted = evict(0);
+	}
+	free_blocks(evicted);
+      }
+
+      std::size_t cache_limit() const {
+	std::lock_guard<std::mutex> lock(mutex_);
+	return limit();
+      }
+
+      //only affects blocks allocated afterwards, cached blocks are dropped
+      void set_huge_pages(bool _enable){
+	{
+	  std::lock_guard<std::mutex> lock(mutex_);
+	  if(huge_pages_ == _enable)
+	    return;
+	  huge_pages_ = _enable;
+	}
+	trim();
+      }
+
+      bool huge_pages() const {
+	std::lock_guard<std::mutex> lock(mutex_);
+	return huge_pages_;
+      }
+    };
+
+    //_size uninitialized elements of a trivial type taken from a scratch_pool and given
+    //back on destruction or resize
+    template <typename T>
+    class scratch_buffer {
+
+      static_assert(std::is_trivial<T>::value, "scratch_buffer holds trivial types only");
+
+      T* data_;
+      std::size_t size_;
+      scratch_pool* pool_;
+
+      scratch_buffer(const scratch_buffer&);
+      scratch_buffer& operator=(const scratch_buffer&);
+
+      void release(){
+	pool_->release(data_);
+	data_ = 0;
+	size_ = 0;
+      }
+
+    public:
+
+      explicit scratch_buffer(std::size_t _size = 0, scratch_pool& _pool = scratch_pool::global()):
+	data_(0),
+	size_(0),
+	pool_(&_pool)
+      {
+	resize(_size);
+      }
+
+      scratch_buffer(scratch_buffer&& _other):
+	data_(_other.data_),
+	size_(_other.size_),
+	pool_(_other.pool_)
+      {
+	_other.data_ = 0;
+	_other.size_ = 0;
+      }
+
+      scratch_buffer& operator=(scratch_buffer&& _other){
+	if(this != &_other){
+	  release();
+	  data_ = _other.data_;
+	  size_ = _other.size_;
+	  pool_ = _other.pool_;
+	  _other.data_ = 0;
+	  _other.size_ = 0;
+	}
+	return *this;
+      }
+
+      ~scratch_buffer(){
+	release();
+      }
+
+      //the contents are not kept
+      void resize(std::size_t _size){
+	if(_size == size_)
+	  return;
+	release();
+	data_ = static_cast<T*>(pool_->acquire(sizeof(T)*_size));
+	size_ = _size;
+      }
+
+      T* data() { return data_; }
+      const T* data() const { return data_; }
+      std::size_t size() const { return size_; }
+      bool empty() const { return size_ == 0; }
+
+      T& operator[](std::size_t _index) { return data_[_index]; }
+      const T& operator[](std::size_t _index) const { return data_[_index]; }
+    };
+
+  };
+};
+
+#endif /* _CPU_SCRATCH_POOL_HPP_ */
@@ -0,0 +1,136 @@
+#ifndef _CPU_SEPARABLE_HPP_
+#define _CPU_SEPARABLE_HPP_
+#include <vector>
+#include <algorithm>
+#include "image_stack_utils.h"
+#include "kernel_utils.h"
+#include "thread_pool.hpp"
+#include "scratch_pool.hpp"
+
+namespace anyfold {
+
+  namespace cpu {
+
+    //1D convolution of the c-ordered volume _src with the (already flipped) _weights along
+    //_axis, only the voxels inside [_begin,_end) are written to _dst (or added to it if
+    //_accumulate is set); every output line is accumulated tap by tap so that the
+    //innermost loop runs over contiguous memory
+    inline void convolve_axis(const float* _src, float* _dst, const long* _shape,
+			      int _axis, const std::vector<float>& _weights,
+			      const long* _begin, const long* _end,
+			      unsigned _num_threads = 0,
+			      bool _accumulate = false){
+
+      const long strides[3] = {_shape[1]*_shape[2], _shape[2], 1};
+      const long half = long(_weights.size())/2;
+      const long length = _end[2] - _begin[2];
+      if(length <= 0 || _end[1] <= _begin[1])
+	return;
+
+      thread_pool::global().parallel_for(_begin[0], _end[0],
+					 [&](long _x){
+					   for(long y = _begin[1];y<_end[1];++y){
+					     const long line = _x*strides[0] + y*strides[1] + _begin[2];
+					     float* dst = _dst + line;
+					     if(!_accumulate)
+					       std::fill(dst, dst + length, 0.f);
+					     for(long k = 0;k<long(_weights.size());++k){
+					       const float weight = _weights[k];
+					       const float* src = _src + line + (k - half)*strides[_axis];
+					       for(long z = 0;z<length;++z)
+						 dst[z] += weight*src[z];
+					     }
+					   }
+					 },
+					 _num_threads);
+    }
+
+    //intermediate volumes of the three passes, kept by callers that convolve many
+    //images of the same extents to not allocate them every time
+    struct separable_scratch {
+      scratch_buffer<float> first_;
+      scratch_buffer<float> second_;
+    };
+
+    //convolves the interior of _image (defined by the factor lengths) with the separable
+    //kernel _k0 x _k1 x _k2 (one factor per boost dimension) by three 1D passes,
+    //voxels outside of the interior are not touched in _result; with _accumulate the
+    //interior is added to _result instead of overwriting it
+    inline void convolve_separable(image_stack_cref _image,
+				   const std::vector<float>& _k0,
+				   const std::vector<float>& _k1,
+				   const std::vector<float>& _k2,
+				   image_stack_ref _result,
+				   separable_scratch& _scratch,
+				   unsigned _num_threads = 0,
+				   bool _accumulate = false){
+
+      if(!_image.num_elements())
+	return;
+
+      const long shape[3] = {long(_image.shape()[0]), long(_image.shape()[1]), long(_image.shape()[2])};
+      const std::vector<float>* factors[3] = {&_k0, &_k1, &_k2};
+
+      long half[3];
+      std::vector<float> flipped[3];
+      for(int d = 0;d<3;++d){
+	half[d] = long(factors[d]->size())/2;
+	flipped[d].assign(factors[d]->rbegin(), factors[d]->rend());
+	if(shape[d] <= 2*half[d])
+	  return;
+      }
+
+      _scratch.first_.resize(_image.num_elements());
+      _scratch.second_.resize(_image.num_elements());
+      float* first = &_scratch.first_[0];
+      float* second = &_scratch.second_[0];
+
+      //the unit-stride axis first over the whole plane, then shrink the region axis by axis
+      long begin[3] = {0, 0, half[2]};
+      long end[3] = {shape[0], shape[1], shape[2] - half[2]};
+      convolve_axis(_image.data(), first, shape, 2, flipped[2], begin, end, _num_threads);
+
+      begin[1] = half[1];
+      end[1] = shape[1] - half[1];
+      convolve_axis(first, second, shape, 1, flipped[1], begin, end, _num_threads);
+
+      begin[0] = half[0];
+      end[0] = shape[0] - half[0];
+      convolve_axis(second, _result.data(), shape, 0, flipped[0], begin, end, _num_threads, _accumulate);
+    }
+
+    inline void convolve_separable(image_stack_cref _image,
+				   const std::vector<float>& _k0,
+				   const std::vector<float>& _k1,
+				   const std::vector<float>& _k2,
+				   image_stack_ref _result,
+				   unsigned _num_threads = 0,
+				   bool _accumulate = false){
+
+      separable_scratch scratch;
+      convolve_separable(_image, _k0, _k1, _k2, _result, scratch, _num_threads, _accumulate);
+    }
+
+    template <typename ExtentT, typename SrcIterT, typename KernIterT, typename OutIterT>
+    void convolve_separable_3d(SrcIterT src_begin, ExtentT* src_extents,
+			       KernIterT kernel0_begin, KernIterT kernel1_begin, KernIterT kernel2_begin,
+			       ExtentT* kernel_extents,
+			       OutIterT out_begin,
+			       unsigned _num_threads = 0)
+    {
+      std::vector<ExtentT> image_shape(src_extents,src_extents+3);
+
+      anyfold::image_stack_cref image(src_begin, image_shape);
+      anyfold::image_stack_ref output(out_begin, image_shape);
+
+      std::vector<float> k0(kernel0_begin, kernel0_begin + kernel_extents[0]);
+      std::vector<float> k1(kernel1_begin, kernel1_begin + kernel_extents[1]);
+      std::vector<float> k2(kernel2_begin, kernel2_begin + kernel_extents[2]);
+
+      convolve_separable(image, k0, k1, k2, output, _num_threads);
+    }
+
+  };
+};
+
+#endif /* _CPU_SEPARABLE_HPP_ */
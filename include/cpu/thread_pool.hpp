@@ -0,0 +1,251 @@
+#ifndef _CPU_THREAD_POOL_HPP_
+#define _CPU_THREAD_POOL_HPP_
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <memory>
+#include <atomic>
+
+namespace anyfold {
+
+  namespace cpu {
+
+    //persistent pool of worker threads that executes index ranges with work stealing:
+    //the range is split into one contiguous chunk per participating thread, every thread
+    //consumes its own chunk from the front and, once it runs dry, steals half of the
+    //remaining work from the back of another thread's chunk
+    class thread_pool {
+
+      struct chunk {
+	std::mutex mutex_;
+	long begin_;
+	long end_;
+
+	chunk():
+	  mutex_(),
+	  begin_(0),
+	  end_(0)
+	{}
+
+	bool pop_front(long& _index){
+	  std::lock_guard<std::mutex> lock(mutex_);
+	  if(begin_ >= end_)
+	    return false;
+	  _index = begin_++;
+	  return true;
+	}
+
+	bool steal_back(long& _begin, long& _end){
+	  std::lock_guard<std::mutex> lock(mutex_);
+	  long remaining = end_ - begin_;
+	  if(remaining <= 0)
+	    return false;
+	  long stolen = (remaining + 1)/2;
+	  _end = end_;
+	  _begin = end_ - stolen;
+	  end_ = _begin;
+	  return true;
+	}
+
+	void assign(long _begin, long _end){
+	  std::lock_guard<std::mutex> lock(mutex_);
+	  begin_ = _begin;
+	  end_ = _end;
+	}
+      };
+
+      struct job {
+	std::function<void(long)> body_;
+	std::vector<std::unique_ptr<chunk> > chunks_;
+	unsigned participants_;
+	unsigned running_;
+	std::exception_ptr error_;
+      };
+
+    public:
+
+      explicit thread_pool(unsigned _num_threads = 0):
+	workers_(),
+	mutex_(),
+	submit_mutex_(),
+	wake_(),
+	done_(),
+	current_(0),
+	generation_(0),
+	shutdown_(false)
+      {
+	if(!_num_threads)
+	  _num_threads = hardware_threads();
+
+	//the thread calling parallel_for is participant 0, so one thread less is spawned
+	for(unsigned i = 1;i<_num_threads;++i)
+	  workers_.push_back(std::thread(&thread_pool::worker_loop, this, i));
+      }
+
+      ~thread_pool(){
+	{
+	  std::lock_guard<std::mutex> lock(mutex_);
+	  shutdown_ = true;
+	}
+	wake_.notify_all();
+	for(unsigned i = 0;i<workers_.size();++i)
+	  workers_[i].join();
+      }
+
+      unsigned size() const {
+	return workers_.size() + 1;
+      }
+
+      static unsigned hardware_threads(){
+	unsigned value = std::thread::hardware_concurrency();
+	return value ? value : 1;
+      }
+
+      //process wide pool sized to the number of hardware threads
+      static thread_pool& global(){
+	static thread_pool pool;
+	return pool;
+      }
+
+      //calls _func(i) for every i in [_begin,_end) using at most _num_threads threads
+      //(0 means all threads of the pool); returns when all indices have been processed
+      template <typename FuncT>
+      void parallel_for(long _begin, long _end, FuncT _func, unsigned _num_threads = 0){
+
+	if(_end <= _begin)
+	  return;
+
+	unsigned participants = (!_num_threads || _num_threads > size()) ? size() : _num_threads;
+	if(long(participants) > _end - _begin)
+	  participants = _end - _begin;
+
+	//nested calls from within a worker are executed serially to avoid dead locks
+	if(participants < 2 || inside_worker()){
+	  for(long i = _begin;i<_end;++i)
+	    _func(i);
+	  return;
+	}
+
+	std::lock_guard<std::mutex> submit_lock(submit_mutex_);
+
+	job current;
+	current.body_ = _func;
+	current.participants_ = participants;
+	current.running_ = participants;
+
+	const long length = _end - _begin;
+	for(unsigned p = 0;p<participants;++p){
+	  current.chunks_.push_back(std::unique_ptr<chunk>(new chunk()));
+	  current.chunks_.back()->assign(_begin + (length*p)/participants,
+					 _begin + (length*(p+1))/participants);
+	}
+
+	{
+	  std::lock_guard<std::mutex> lock(mutex_);
+	  current_ = &current;
+	  ++generation_;
+	}
+	wake_.notify_all();
+
+	run(current, 0);
+
+	std::unique_lock<std::mutex> lock(mutex_);
+	done_.wait(lock, [&current](){ return current.running_ == 0; });
+	current_ = 0;
+	lock.unlock();
+
+	if(current.error_)
+	  std::rethrow_exception(current.error_);
+      }
+
+    private:
+
+      thread_pool(const thread_pool&);
+      thread_pool& operator=(const thread_pool&);
+
+      static bool& inside_worker(){
+	static thread_local bool value = false;
+	return value;
+      }
+
+      void run(job& _job, unsigned _id){
+
+	bool& flag = inside_worker();
+	const bool previous = flag;
+	flag = true;
+
+	try {
+	  chunk& own = *_job.chunks_[_id];
+	  long index = 0;
+	  long stolen_begin = 0;
+	  long stolen_end = 0;
+
+	  while(true){
+	    while(own.pop_front(index))
+	      _job.body_(index);
+
+	    bool found = false;
+	    for(unsigned offset = 1;offset<_job.participants_ && !found;++offset){
+	      chunk& victim = *_job.chunks_[(_id + offset) % _job.participants_];
+	      found = victim.steal_back(stolen_begin, stolen_end);
+	    }
+
+	    if(!found)
+	      break;
+
+	    own.assign(stolen_begin, stolen_end);
+	  }
+	}
+	catch(...){
+	  std::lock_guard<std::mutex> lock(mutex_);
+	  if(!_job.error_)
+	    _job.error_ = std::current_exception();
+	  //drain the remaining work so that the other participants terminate quickly
+	  for(unsigned p = 0;p<_job.participants_;++p)
+	    _job.chunks_[p]->assign(0,0);
+	}
+
+	flag = previous;
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	if(--_job.running_ == 0)
+	  done_.notify_all();
+      }
+
+      void worker_loop(unsigned _id){
+
+	unsigned long seen = 0;
+
+	while(true){
+	  job* current = 0;
+	  {
+	    std::unique_lock<std::mutex> lock(mutex_);
+	    wake_.wait(lock, [this, seen](){ return shutdown_ || generation_ != seen; });
+	    if(shutdown_)
+	      return;
+	    seen = generation_;
+	    current = current_;
+	  }
+
+	  if(current && _id < current->participants_)
+	    run(*current, _id);
+	}
+      }
+
+      std::vector<std::thread> workers_;
+      std::mutex mutex_;
+      std::mutex submit_mutex_;
+      std::condition_variable wake_;
+      std::condition_variable done_;
+      job* current_;
+      unsigned long generation_;
+      bool shutdown_;
+    };
+
+  };
+};
+
+#endif /* _CPU_THREAD_POOL_HPP_ */
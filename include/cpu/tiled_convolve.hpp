@@ -0,0 +1,131 @@
+#ifndef _CPU_TILED_CONVOLVE_HPP_
+#define _CPU_TILED_CONVOLVE_HPP_
+#include <vector>
+#include <algorithm>
+#include "cpu_features.hpp"
+#include "thread_pool.hpp"
+#include "vectorized_convolve.hpp"
+
+namespace anyfold {
+
+  namespace cpu {
+
+    //output tile extents (c storage order) for the direct convolution of an image whose
+    //interior has the extents _interior: rows are cut so that the input rows of one kernel
+    //plane stay in half of l1 while the next output row of the tile reuses all but one of
+    //them, then as many rows and planes as keep the input of the whole tile (tile plus
+    //halo) in half of l2 while the tile is walked in storage order
+    template <typename ExtentT>
+    std::vector<long> choose_tile_shape(const long* _interior, ExtentT* _kernel_extents,
+					const cache_sizes& _cache = detected_cache_sizes()){
+
+      const long floats_l1 = long(_cache.l1_/(2*sizeof(float)));
+      const long floats_l2 = long(_cache.l2_/(2*sizeof(float)));
+      const long rows = long(_kernel_extents[0])*_kernel_extents[1];
+
+      std::vector<long> tile(3);
+
+      //a multiple of the widest vector, but not too short to amortize the line setup
+      const long row_l1 = floats_l1/_kernel_extents[1] - _kernel_extents[2] + 1;
+      const long row_l2 = floats_l2/rows - _kernel_extents[2] + 1;
+      tile[2] = std::max(64L, (std::min(row_l1, row_l2)/16)*16);
+      tile[2] = std::min(tile[2], _interior[2]);
+
+      const long input_row = tile[2] + _kernel_extents[2] - 1;
+      tile[0] = tile[1] = 1;
+      bool grown = true;
+      while(grown){
+	grown = false;
+	for(int d = 1;d>=0;--d){
+	  if(tile[d] >= _interior[d])
+	    continue;
+	  std::vector<long> next(tile);
+	  ++next[d];
+	  if((next[0] + _kernel_extents[0] - 1)*(next[1] + _kernel_extents[1] - 1)*input_row > floats_l2)
+	    continue;
+	  tile = next;
+	  grown = true;
+	}
+      }
+
+      return tile;
+    }
+
+    //walks the interior of the c-ordered volume src_begin tile by tile and runs _line
+    //over the rows of every tile, _geometry holds the flipped kernel and the strides of
+    //the volume; the tiles are distributed over _num_threads threads
+    template <typename ExtentT>
+    void convolve_tiles(const float* src_begin, ExtentT* src_extents,
+			const line_geometry& _geometry, line_kernel _line,
+			const std::vector<long>& _tile,
+			float* out_begin,
+			unsigned _num_threads = 0)
+    {
+      const long half[3] = {_geometry.kernel_shape_[0]/2, _geometry.kernel_shape_[1]/2, _geometry.kernel_shape_[2]/2};
+      long interior[3];
+      long tiles[3];
+      for(int d = 0;d<3;++d){
+	interior[d] = long(src_extents[d]) - 2*half[d];
+	if(interior[d] <= 0)
+	  return;
+	tiles[d] = (interior[d] + _tile[d] - 1)/_tile[d];
+      }
+
+      thread_pool::global().parallel_for(0, tiles[0]*tiles[1]*tiles[2],
+					 [&](long _index){
+					   const long t[3] = {_index/(tiles[1]*tiles[2]), (_index/tiles[2]) % tiles[1], _index % tiles[2]};
+					   long begin[3];
+					   long end[3];
+					   for(int d = 0;d<3;++d){
+					     begin[d] = half[d] + t[d]*_tile[d];
+					     end[d] = std::min(begin[d] + _tile[d], half[d] + interior[d]);
+					   }
+
+					   for(long x = begin[0];x<end[0];++x)
+					     for(long y = begin[1];y<end[1];++y){
+					       const float* src = src_begin + (x-half[0])*_geometry.plane_stride_ + (y-half[1])*_geometry.line_stride_ + begin[2] - half[2];
+					       float* dst = out_begin + x*_geometry.plane_stride_ + y*_geometry.line_stride_ + begin[2];
+					       _line(src, dst, end[2] - begin[2], _geometry);
+					     }
+					 },
+					 _num_threads);
+    }
+
+    //same result as vectorized_convolve_3d, but the interior of the output is walked
+    //tile by tile (tile extents from choose_tile_shape unless _tile is given), so
+    //that every input voxel is loaded from main memory about once instead of once per
+    //kernel plane; the tiles are distributed over _num_threads threads
+    template <typename ExtentT>
+    void tiled_convolve_3d(const float* src_begin, ExtentT* src_extents,
+			   const float* kernel_begin, ExtentT* kernel_extents,
+			   float* out_begin,
+			   unsigned _num_threads = 0,
+			   std::vector<long> _tile = std::vector<long>(),
+			   instruction_set _isa = best_instruction_set())
+    {
+      long interior[3];
+      for(int d = 0;d<3;++d){
+	interior[d] = long(src_extents[d]) - 2*(long(kernel_extents[d])/2);
+	if(interior[d] <= 0)
+	  return;
+      }
+
+      if(_tile.size() != 3)
+	_tile = choose_tile_shape(interior, kernel_extents);
+
+      const std::vector<float> flipped = flip_kernel(kernel_begin, kernel_extents);
+
+      line_geometry geometry;
+      geometry.kernel_ = &flipped[0];
+      for(int d = 0;d<3;++d)
+	geometry.kernel_shape_[d] = kernel_extents[d];
+      geometry.line_stride_ = src_extents[2];
+      geometry.plane_stride_ = long(src_extents[1])*src_extents[2];
+
+      convolve_tiles(src_begin, src_extents, geometry, select_line_kernel(_isa), _tile, out_begin, _num_threads);
+    }
+
+  };
+};
+
+#endif /* _CPU_TILED_CONVOLVE_HPP_ */
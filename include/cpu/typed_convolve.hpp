@@ -0,0 +1,70 @@
+#ifndef _CPU_TYPED_CONVOLVE_HPP_
+#define _CPU_TYPED_CONVOLVE_HPP_
+#include "sample_utils.h"
+#include "cpu_features.hpp"
+#include "thread_pool.hpp"
+#include "scratch_pool.hpp"
+#include "convert.hpp"
+#include "plane_stream.hpp"
+
+namespace anyfold {
+
+  namespace cpu {
+
+    //vectorized_convolve_3d for images stored as float16, bfloat16, uint8 or uint16
+    //(or float) on input and output, the convolution is accumulated in float: the
+    //input planes are converted once while they enter the ring of a plane_stream,
+    //every output plane is computed in float, mapped by _scaling and converted
+    //(saturated for integers) row by row when it is stored, so the image is read and
+    //written at its storage width and only kernel_extents[0] planes exist as float;
+    //interior voxels only like vectorized_convolve_3d
+    template <typename InT, typename OutT, typename ExtentT>
+    void typed_convolve_3d(const InT* src_begin, ExtentT* src_extents,
+			   const float* kernel_begin, ExtentT* kernel_extents,
+			   OutT* out_begin,
+			   const sample_scaling& _scaling,
+			   unsigned _num_threads = 0,
+			   instruction_set _isa = best_instruction_set())
+    {
+      const long shape[3] = {long(src_extents[0]), long(src_extents[1]), long(src_extents[2])};
+      const long half[3] = {long(kernel_extents[0])/2, long(kernel_extents[1])/2, long(kernel_extents[2])/2};
+      if(shape[0] <= 2*half[0] || shape[1] <= 2*half[1] || shape[2] <= 2*half[2])
+	return;
+
+      plane_stream stream(src_extents + 1, kernel_begin, kernel_extents, _num_threads, _isa);
+      const std::size_t size = stream.plane_size();
+      scratch_buffer<float> plane(size);
+
+      for(long x = 0;x<shape[0];++x){
+	//an even kernel emits one plane behind the interior, it is skipped
+	const long index = x - stream.latency();
+	const bool interior = index >= half[0] && index < shape[0] - half[0];
+	if(!stream.push(src_begin + x*size, interior ? plane.data() : nullptr) || !interior)
+	  continue;
+
+	OutT* output = out_begin + index*size;
+	thread_pool::global().parallel_for(half[1], shape[1] - half[1],
+					   [&](long _y){
+					     const long offset = _y*shape[2] + half[2];
+					     _scaling.apply(plane.data() + offset, shape[2] - 2*half[2]);
+					     store_samples(plane.data() + offset, output + offset, shape[2] - 2*half[2], _isa);
+					   },
+					   _num_threads);
+      }
+    }
+
+    template <typename InT, typename OutT, typename ExtentT>
+    void typed_convolve_3d(const InT* src_begin, ExtentT* src_extents,
+			   const float* kernel_begin, ExtentT* kernel_extents,
+			   OutT* out_begin,
+			   unsigned _num_threads = 0,
+			   instruction_set _isa = best_instruction_set())
+    {
+      typed_convolve_3d(src_begin, src_extents, kernel_begin, kernel_extents, out_begin,
+			sample_scaling(), _num_threads, _isa);
+    }
+
+  };
+};
+
+#endif /* _CPU_TYPED_CONVOLVE_HPP_ */
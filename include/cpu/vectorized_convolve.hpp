@@ -0,0 +1,236 @@
+#ifndef _CPU_VECTORIZED_CONVOLVE_HPP_
+#define _CPU_VECTORIZED_CONVOLVE_HPP_
+#include <vector>
+#include <sstream>
+#include <stdexcept>
+#include "cpu_features.hpp"
+#include "thread_pool.hpp"
+
+#ifdef ANYFOLD_X86_SIMD
+#include <immintrin.h>
+#endif
+
+namespace anyfold {
+
+  namespace cpu {
+
+    //geometry of a c-ordered volume and of the flipped kernel it is convolved with,
+    //the kernel taps are stored contiguously so that they can be broadcast one by one
+    struct line_geometry {
+      const float* kernel_;
+      long kernel_shape_[3];
+      long line_stride_;
+      long plane_stride_;
+    };
+
+    //_src points to the first input voxel touched by the first output voxel _dst,
+    //_length consecutive output voxels along the unit-stride axis are computed
+    typedef void (*line_kernel)(const float* _src, float* _dst, long _length, const line_geometry& _geometry);
+
+    inline void convolve_line_scalar(const float* _src, float* _dst, long _length, const line_geometry& _g){
+
+      for(long i = 0;i<_length;++i){
+	const float* tap = _g.kernel_;
+	float value = 0;
+	for(long a = 0;a<_g.kernel_shape_[0];++a){
+	  for(long b = 0;b<_g.kernel_shape_[1];++b){
+	    const float* row = _src + a*_g.plane_stride_ + b*_g.line_stride_ + i;
+	    for(long c = 0;c<_g.kernel_shape_[2];++c)
+	      value += *(tap++) * row[c];
+	  }
+	}
+	_dst[i] = value;
+      }
+    }
+
+#ifdef ANYFOLD_X86_SIMD
+
+    __attribute__((target("avx2,fma")))
+    inline void convolve_line_avx2(const float* _src, float* _dst, long _length, const line_geometry& _g){
+
+      const long width = 8;
+      long i = 0;
+
+      //4 independent accumulators hide the fma latency
+      for(;i + 4*width<=_length;i += 4*width){
+	__m256 acc0 = _mm256_setzero_ps();
+	__m256 acc1 = _mm256_setzero_ps();
+	__m256 acc2 = _mm256_setzero_ps();
+	__m256 acc3 = _mm256_setzero_ps();
+	const float* tap = _g.kernel_;
+	for(long a = 0;a<_g.kernel_shape_[0];++a){
+	  for(long b = 0;b<_g.kernel_shape_[1];++b){
+	    const float* row = _src + a*_g.plane_stride_ + b*_g.line_stride_ + i;
+	    for(long c = 0;c<_g.kernel_shape_[2];++c){
+	      const __m256 weight = _mm256_broadcast_ss(tap++);
+	      acc0 = _mm256_fmadd_ps(weight, _mm256_loadu_ps(row + c), acc0);
+	      acc1 = _mm256_fmadd_ps(weight, _mm256_loadu_ps(row + c + width), acc1);
+	      acc2 = _mm256_fmadd_ps(weight, _mm256_loadu_ps(row + c + 2*width), acc2);
+	      acc3 = _mm256_fmadd_ps(weight, _mm256_loadu_ps(row + c + 3*width), acc3);
+	    }
+	  }
+	}
+	_mm256_storeu_ps(_dst + i, acc0);
+	_mm256_storeu_ps(_dst + i + width, acc1);
+	_mm256_storeu_ps(_dst + i + 2*width, acc2);
+	_mm256_storeu_ps(_dst + i + 3*width, acc3);
+      }
+
+      for(;i + width<=_length;i += width){
+	__m256 acc = _mm256_setzero_ps();
+	const float* tap = _g.kernel_;
+	for(long a = 0;a<_g.kernel_shape_[0];++a){
+	  for(long b = 0;b<_g.kernel_shape_[1];++b){
+	    const float* row = _src + a*_g.plane_stride_ + b*_g.line_stride_ + i;
+	    for(long c = 0;c<_g.kernel_shape_[2];++c)
+	      acc = _mm256_fmadd_ps(_mm256_broadcast_ss(tap++), _mm256_loadu_ps(row + c), acc);
+	  }
+	}
+	_mm256_storeu_ps(_dst + i, acc);
+      }
+
+      convolve_line_scalar(_src + i, _dst + i, _length - i, _g);
+    }
+
+    __attribute__((target("avx512f")))
+    inline void convolve_line_avx512(const float* _src, float* _dst, long _length, const line_geometry& _g){
+
+      const long width = 16;
+      long i = 0;
+
+      for(;i + 4*width<=_length;i += 4*width){
+	__m512 acc0 = _mm512_setzero_ps();
+	__m512 acc1 = _mm512_setzero_ps();
+	__m512 acc2 = _mm512_setzero_ps();
+	__m512 acc3 = _mm512_setzero_ps();
+	const float* tap = _g.kernel_;
+	for(long a = 0;a<_g.kernel_shape_[0];++a){
+	  for(long b = 0;b<_g.kernel_shape_[1];++b){
+	    const float* row = _src + a*_g.plane_stride_ + b*_g.line_stride_ + i;
+	    for(long c = 0;c<_g.kernel_shape_[2];++c){
+	      const __m512 weight = _mm512_set1_ps(*(tap++));
+	      acc0 = _mm512_fmadd_ps(weight, _mm512_loadu_ps(row + c), acc0);
+	      acc1 = _mm512_fmadd_ps(weight, _mm512_loadu_ps(row + c + width), acc1);
+	      acc2 = _mm512_fmadd_ps(weight, _mm512_loadu_ps(row + c + 2*width), acc2);
+	      acc3 = _mm512_fmadd_ps(weight, _mm512_loadu_ps(row + c + 3*width), acc3);
+	    }
+	  }
+	}
+	_mm512_storeu_ps(_dst + i, acc0);
+	_mm512_storeu_ps(_dst + i + width, acc1);
+	_mm512_storeu_ps(_dst + i + 2*width, acc2);
+	_mm512_storeu_ps(_dst + i + 3*width, acc3);
+      }
+
+      for(;i + width<=_length;i += width){
+	__m512 acc = _mm512_setzero_ps();
+	const float* tap = _g.kernel_;
+	for(long a = 0;a<_g.kernel_shape_[0];++a){
+	  for(long b = 0;b<_g.kernel_shape_[1];++b){
+	    const float* row = _src + a*_g.plane_stride_ + b*_g.line_stride_ + i;
+	    for(long c = 0;c<_g.kernel_shape_[2];++c)
+	      acc = _mm512_fmadd_ps(_mm512_set1_ps(*(tap++)), _mm512_loadu_ps(row + c), acc);
+	  }
+	}
+	_mm512_storeu_ps(_dst + i, acc);
+      }
+
+      //the remainder is done with masked loads instead of falling back to scalar code
+      if(i < _length){
+	const __mmask16 mask = __mmask16((1u << (_length - i)) - 1u);
+	__m512 acc = _mm512_setzero_ps();
+	const float* tap = _g.kernel_;
+	for(long a = 0;a<_g.kernel_shape_[0];++a){
+	  for(long b = 0;b<_g.kernel_shape_[1];++b){
+	    const float* row = _src + a*_g.plane_stride_ + b*_g.line_stride_ + i;
+	    for(long c = 0;c<_g.kernel_shape_[2];++c)
+	      acc = _mm512_fmadd_ps(_mm512_set1_ps(*(tap++)), _mm512_maskz_loadu_ps(mask, row + c), acc);
+	  }
+	}
+	_mm512_mask_storeu_ps(_dst + i, mask, acc);
+      }
+    }
+
+#endif
+
+    inline line_kernel select_line_kernel(instruction_set _isa){
+
+      if(!supported(_isa)){
+	std::ostringstream msg;
+	msg << "[anyfold::select_line_kernel]\tinstruction set " << name(_isa) << " NOT SUPPORTED by this cpu\n";
+	throw std::runtime_error(msg.str().c_str());
+      }
+
+#ifdef ANYFOLD_X86_SIMD
+      if(_isa == instruction_set::avx512)
+	return convolve_line_avx512;
+      if(_isa == instruction_set::avx2)
+	return convolve_line_avx2;
+#endif
+      return convolve_line_scalar;
+    }
+
+    //reverses the kernel so that the inner loops can run forward over input and taps alike
+    template <typename KernIterT, typename ExtentT>
+    std::vector<float> flip_kernel(KernIterT _kernel, const ExtentT* _extents){
+
+      const long size = long(_extents[0])*_extents[1]*_extents[2];
+      std::vector<float> value(size);
+      for(long i = 0;i<size;++i)
+	value[i] = _kernel[size-1-i];
+      return value;
+    }
+
+    //runs _line over every interior row of the c-ordered volume src_begin, _geometry
+    //holds the flipped kernel and the strides of the volume; planes of the first
+    //dimension are distributed over _num_threads threads
+    template <typename ExtentT>
+    void convolve_lines(const float* src_begin, ExtentT* src_extents,
+			const line_geometry& _geometry, line_kernel _line,
+			float* out_begin,
+			unsigned _num_threads = 0)
+    {
+      const long half[3] = {_geometry.kernel_shape_[0]/2, _geometry.kernel_shape_[1]/2, _geometry.kernel_shape_[2]/2};
+      const long length = long(src_extents[2]) - 2*half[2];
+      if(length <= 0 || long(src_extents[1]) <= 2*half[1])
+	return;
+
+      thread_pool::global().parallel_for(half[0], long(src_extents[0]) - half[0],
+					 [&](long _x){
+					   for(long y = half[1];y<long(src_extents[1]) - half[1];++y){
+					     const float* src = src_begin + (_x-half[0])*_geometry.plane_stride_ + (y-half[1])*_geometry.line_stride_;
+					     float* dst = out_begin + _x*_geometry.plane_stride_ + y*_geometry.line_stride_ + half[2];
+					     _line(src, dst, length, _geometry);
+					   }
+					 },
+					 _num_threads);
+    }
+
+    //same result as convolve_3d (interior voxels only, c storage order), but
+    //_length output voxels along the unit-stride (last) axis are computed at once with
+    //the widest instruction set available at runtime, planes of the first dimension are
+    //distributed over _num_threads threads (0 means all threads of the global pool, like
+    //everywhere in anyfold::cpu)
+    template <typename ExtentT>
+    void vectorized_convolve_3d(const float* src_begin, ExtentT* src_extents,
+				const float* kernel_begin, ExtentT* kernel_extents,
+				float* out_begin,
+				unsigned _num_threads = 0,
+				instruction_set _isa = best_instruction_set())
+    {
+      const std::vector<float> flipped = flip_kernel(kernel_begin, kernel_extents);
+
+      line_geometry geometry;
+      geometry.kernel_ = &flipped[0];
+      for(int d = 0;d<3;++d)
+	geometry.kernel_shape_[d] = kernel_extents[d];
+      geometry.line_stride_ = src_extents[2];
+      geometry.plane_stride_ = long(src_extents[1])*src_extents[2];
+
+      convolve_lines(src_begin, src_extents, geometry, select_line_kernel(_isa), out_begin, _num_threads);
+    }
+
+  };
+};
+
+#endif /* _CPU_VECTORIZED_CONVOLVE_HPP_ */
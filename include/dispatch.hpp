@@ -0,0 +1,693 @@
+#ifndef _ANYFOLD_DISPATCH_HPP_
+#define _ANYFOLD_DISPATCH_HPP_
+#include <vector>
+#include <string>
+#include <cmath>
+#include <cstdlib>
+#include <chrono>
+#include <fstream>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <algorithm>
+#include <utility>
+
+#include "image_stack_utils.h"
+#include "kernel_utils.h"
+#include "cpu/convolve.hpp"
+#include "cpu/vectorized_convolve.hpp"
+#include "cpu/tiled_convolve.hpp"
+#include "cpu/low_rank.hpp"
+#include "cpu/fft_convolve.hpp"
+#include "cpu/overlap_save.hpp"
+#include "cpu/filter_bank.hpp"
+
+#ifdef HAS_OPENCL
+#include "opencl/convolve.hpp"
+#endif
+
+namespace anyfold {
+
+  enum class backend {
+    automatic = 0,
+    cpu_direct,
+    cpu_vectorized,
+    cpu_tiled,
+    cpu_separable,
+    cpu_low_rank,
+    cpu_fft,
+    cpu_overlap_save,
+    opencl_buffer,
+    opencl_buffer_local_mem,
+    opencl_image,
+    opencl_image_local_mem,
+    opencl_separable
+  };
+
+  static const backend all_backends[] = {backend::cpu_direct, backend::cpu_vectorized, backend::cpu_tiled,
+					 backend::cpu_separable, backend::cpu_low_rank,
+					 backend::cpu_fft, backend::cpu_overlap_save,
+					 backend::opencl_buffer, backend::opencl_buffer_local_mem,
+					 backend::opencl_image, backend::opencl_image_local_mem,
+					 backend::opencl_separable};
+
+  inline const char* name(backend _backend){
+    switch(_backend){
+    case backend::cpu_direct: return "cpu_direct";
+    case backend::cpu_vectorized: return "cpu_vectorized";
+    case backend::cpu_tiled: return "cpu_tiled";
+    case backend::cpu_separable: return "cpu_separable";
+    case backend::cpu_low_rank: return "cpu_low_rank";
+    case backend::cpu_fft: return "cpu_fft";
+    case backend::cpu_overlap_save: return "cpu_overlap_save";
+    case backend::opencl_buffer: return "opencl_buffer";
+    case backend::opencl_buffer_local_mem: return "opencl_buffer_local_mem";
+    case backend::opencl_image: return "opencl_image";
+    case backend::opencl_image_local_mem: return "opencl_image_local_mem";
+    case backend::opencl_separable: return "opencl_separable";
+    default: return "automatic";
+    }
+  }
+
+  //true if the library was built with OpenCL and any platform offers an available
+  //device (opencl::Runtime picks one of them, see Runtime::findDevice)
+  inline bool opencl_available(){
+#ifdef HAS_OPENCL
+    static const bool value = [](){
+      const std::vector<opencl::DeviceInfo> devices = opencl::Runtime::listDevices();
+      return std::any_of(devices.begin(), devices.end(),
+			 [](const opencl::DeviceInfo& _device){ return _device.available; });
+    }();
+    return value;
+#else
+    return false;
+#endif
+  }
+
+  //run time estimates of the backends in seconds per unit of work on one thread;
+  //the defaults are rough numbers for a current x86 core, calibrate() replaces them
+  //with measurements of the host that can be saved to and loaded from disk
+  struct cost_model {
+
+    double direct_tap_;			//per interior voxel and kernel tap
+    double vectorized_tap_;
+    double tiled_tap_;
+    double separable_tap_;		//per voxel and 1D tap of one pass
+    double fft_point_;			//per padded voxel and log2 of the padded volume
+    double opencl_overhead_;		//buffers, kernel launch and sync per call (the context
+					//and the programs are shared, see opencl::Runtime)
+    double opencl_byte_;		//host <-> device transfer
+    double opencl_buffer_tap_;
+    double opencl_buffer_local_mem_tap_;
+    double opencl_image_tap_;
+    double opencl_image_local_mem_tap_;
+    double opencl_separable_tap_;
+
+    cost_model():
+      direct_tap_(1e-9),
+      vectorized_tap_(1.5e-10),
+      tiled_tap_(1.4e-10),
+      separable_tap_(5e-10),
+      fft_point_(5e-9),
+      opencl_overhead_(1e-3),
+      opencl_byte_(1e-9),
+      opencl_buffer_tap_(2e-11),
+      opencl_buffer_local_mem_tap_(1.5e-11),
+      opencl_image_tap_(2e-11),
+      opencl_image_local_mem_tap_(1.5e-11),
+      opencl_separable_tap_(2e-11)
+    {}
+
+    std::vector<std::pair<std::string, double*> > fields(){
+      std::vector<std::pair<std::string, double*> > value;
+      value.push_back(std::make_pair("direct_tap", &direct_tap_));
+      value.push_back(std::make_pair("vectorized_tap", &vectorized_tap_));
+      value.push_back(std::make_pair("tiled_tap", &tiled_tap_));
+      value.push_back(std::make_pair("separable_tap", &separable_tap_));
+      value.push_back(std::make_pair("fft_point", &fft_point_));
+      value.push_back(std::make_pair("opencl_overhead", &opencl_overhead_));
+      value.push_back(std::make_pair("opencl_byte", &opencl_byte_));
+      value.push_back(std::make_pair("opencl_buffer_tap", &opencl_buffer_tap_));
+      value.push_back(std::make_pair("opencl_buffer_local_mem_tap", &opencl_buffer_local_mem_tap_));
+      value.push_back(std::make_pair("opencl_image_tap", &opencl_image_tap_));
+      value.push_back(std::make_pair("opencl_image_local_mem_tap", &opencl_image_local_mem_tap_));
+      value.push_back(std::make_pair("opencl_separable_tap", &opencl_separable_tap_));
+      return value;
+    }
+
+    //one "name value" pair per line
+    void save(const std::string& _path) const {
+
+      std::ofstream out(_path.c_str());
+      if(!out){
+	std::ostringstream msg;
+	msg << "[anyfold::cost_model::save]\tunable to write " << _path << "\n";
+	throw std::runtime_error(msg.str().c_str());
+      }
+
+      out.precision(6);
+      cost_model copy(*this);
+      std::vector<std::pair<std::string, double*> > values = copy.fields();
+      for(unsigned i = 0;i<values.size();++i)
+	out << values[i].first << " " << std::scientific << *values[i].second << "\n";
+    }
+
+    //returns false if _path can't be read, unknown names are skipped and missing
+    //ones keep their current value
+    bool load(const std::string& _path){
+
+      std::ifstream in(_path.c_str());
+      if(!in)
+	return false;
+
+      std::vector<std::pair<std::string, double*> > values = fields();
+      std::string key;
+      double number = 0;
+      while(in >> key >> number)
+	for(unsigned i = 0;i<values.size();++i)
+	  if(values[i].first == key)
+	    *values[i].second = number;
+
+      return true;
+    }
+
+    //$ANYFOLD_CALIBRATION if set, ~/.anyfold_calibration otherwise
+    static std::string default_path(){
+
+      const char* path = std::getenv("ANYFOLD_CALIBRATION");
+      if(path && *path)
+	return path;
+      const char* home = std::getenv("HOME");
+      return std::string(home ? home : ".") + "/.anyfold_calibration";
+    }
+
+    //the calibration saved at default_path() or the built-in defaults
+    static const cost_model& global(){
+      static const cost_model value = [](){
+	cost_model model;
+	model.load(default_path());
+	return model;
+      }();
+      return value;
+    }
+  };
+
+  struct convolve_options {
+
+    backend backend_;			//automatic lets the cost model decide
+    unsigned num_threads_;		//0 uses all threads of the global pool
+    std::size_t memory_budget_;		//bytes of fft workspace, 0 for no limit
+    float low_rank_error_;
+    unsigned max_rank_;
+    bool allow_opencl_;
+    std::ostream* log_;			//the estimates and the decision are written here if set
+    const cost_model* model_;		//cost_model::global() if not set
+
+    convolve_options():
+      backend_(backend::automatic),
+      num_threads_(0),
+      memory_budget_(0),
+      low_rank_error_(1e-3f),
+      max_rank_(4),
+      allow_opencl_(true),
+      log_(nullptr),
+      model_(nullptr)
+    {}
+  };
+
+  struct backend_estimate {
+    backend backend_;
+    double seconds_;
+  };
+
+  //what the estimates found out about a kernel, convolve reuses it to not decompose twice
+  struct kernel_analysis {
+    bool separable_;
+    std::vector<float> factors_[3];
+    std::vector<separable_term> terms_;
+  };
+
+  //threads the estimates assume for _options
+  inline double estimate_threads(const convolve_options& _options){
+    const unsigned hardware = cpu::thread_pool::global().size();
+    return (_options.num_threads_ && _options.num_threads_ < hardware) ? _options.num_threads_ : hardware;
+  }
+
+  //estimated run time of cpu_low_rank with _rank terms
+  template <typename ExtentT>
+  double low_rank_seconds(ExtentT* _image_extents, ExtentT* _kernel_extents, std::size_t _rank,
+			  const convolve_options& _options){
+    const cost_model& model = _options.model_ ? *_options.model_ : cost_model::global();
+    double voxels = 1;
+    double taps_1d = 0;
+    for(int d = 0;d<3;++d){
+      voxels *= _image_extents[d];
+      taps_1d += _kernel_extents[d];
+    }
+    return model.separable_tap_*voxels*taps_1d*_rank/estimate_threads(_options);
+  }
+
+  //estimated run time of every backend that can handle the problem, cheapest first
+  template <typename ExtentT>
+  std::vector<backend_estimate> estimate_costs(ExtentT* _image_extents, ExtentT* _kernel_extents,
+					       const kernel_analysis& _analysis,
+					       const convolve_options& _options){
+
+    const cost_model& model = _options.model_ ? *_options.model_ : cost_model::global();
+    const double threads = estimate_threads(_options);
+
+    double voxels = 1;
+    double interior = 1;
+    double taps = 1;
+    double taps_1d = 0;
+    for(int d = 0;d<3;++d){
+      voxels *= _image_extents[d];
+      interior *= std::max<long>(0, long(_image_extents[d]) - 2*(long(_kernel_extents[d])/2));
+      taps *= _kernel_extents[d];
+      taps_1d += _kernel_extents[d];
+    }
+    const double bytes = 2*sizeof(float)*voxels + sizeof(float)*taps;
+
+    std::vector<backend_estimate> value;
+    backend_estimate estimate;
+
+    estimate.backend_ = backend::cpu_direct;
+    estimate.seconds_ = model.direct_tap_*interior*taps/threads;
+    value.push_back(estimate);
+
+    estimate.backend_ = backend::cpu_vectorized;
+    estimate.seconds_ = model.vectorized_tap_*interior*taps/threads;
+    value.push_back(estimate);
+
+    estimate.backend_ = backend::cpu_tiled;
+    estimate.seconds_ = model.tiled_tap_*interior*taps/threads;
+    value.push_back(estimate);
+
+    if(_analysis.separable_){
+      estimate.backend_ = backend::cpu_separable;
+      estimate.seconds_ = model.separable_tap_*voxels*taps_1d/threads;
+      value.push_back(estimate);
+    }
+
+    if(!_analysis.terms_.empty()){
+      estimate.backend_ = backend::cpu_low_rank;
+      estimate.seconds_ = low_rank_seconds(_image_extents, _kernel_extents, _analysis.terms_.size(), _options);
+      value.push_back(estimate);
+    }
+
+    zero_padd<image_stack> padding = cpu::fft_padding(_image_extents, _kernel_extents);
+    const std::vector<long> padded(padding.extents(), padding.extents() + 3);
+    if(!_options.memory_budget_ || cpu::overlap_save_footprint(padded) <= _options.memory_budget_){
+      const double points = double(padded[0])*padded[1]*padded[2];
+      estimate.backend_ = backend::cpu_fft;
+      estimate.seconds_ = model.fft_point_*points*std::log2(points)/threads;
+      value.push_back(estimate);
+    }
+
+    if(_options.memory_budget_){
+      try {
+	const std::vector<long> block = cpu::overlap_save_block_shape(_image_extents, _kernel_extents, _options.memory_budget_);
+	double blocks = 1;
+	for(int d = 0;d<3;++d){
+	  const long inner = long(_image_extents[d]) - 2*(long(_kernel_extents[d])/2);
+	  const long valid = block[d] - long(_kernel_extents[d]) + 1;
+	  blocks *= std::max(1L, (inner + valid - 1)/valid);
+	}
+	const double points = double(block[0])*block[1]*block[2];
+	estimate.backend_ = backend::cpu_overlap_save;
+	estimate.seconds_ = blocks*model.fft_point_*points*std::log2(std::max(2., points))/threads;
+	value.push_back(estimate);
+      }
+      catch(std::runtime_error&){
+	//the budget is too small for even one block
+      }
+    }
+
+    if(_options.allow_opencl_ && opencl_available()){
+      const double transfer = model.opencl_overhead_ + model.opencl_byte_*bytes;
+      const std::pair<backend, double> direct[] = {std::make_pair(backend::opencl_buffer, model.opencl_buffer_tap_),
+						   std::make_pair(backend::opencl_buffer_local_mem, model.opencl_buffer_local_mem_tap_),
+						   std::make_pair(backend::opencl_image, model.opencl_image_tap_),
+						   std::make_pair(backend::opencl_image_local_mem, model.opencl_image_local_mem_tap_)};
+      for(unsigned i = 0;i<4;++i){
+	estimate.backend_ = direct[i].first;
+	estimate.seconds_ = transfer + direct[i].second*interior*taps;
+	value.push_back(estimate);
+      }
+
+      if(_analysis.separable_){
+	estimate.backend_ = backend::opencl_separable;
+	estimate.seconds_ = transfer + model.opencl_separable_tap_*voxels*taps_1d;
+	value.push_back(estimate);
+      }
+    }
+
+    std::stable_sort(value.begin(), value.end(),
+		     [](const backend_estimate& _a, const backend_estimate& _b){ return _a.seconds_ < _b.seconds_; });
+    return value;
+  }
+
+  //the part of the kernel analysis the backend choice for images of _image_extents
+  //can use: nothing for a requested backend that takes the kernel as it is, the
+  //separable factors for the separable backends, and the low rank decomposition
+  //(alternating least squares, by far the most expensive step) only if cpu_low_rank
+  //is requested or even rank 2 would be cheaper than every other estimate
+  template <typename ExtentT>
+  void analyse_kernel(ExtentT* _image_extents, const float* _kernel, ExtentT* _kernel_extents,
+		      const convolve_options& _options,
+		      kernel_analysis& _analysis){
+
+    _analysis.separable_ = false;
+    _analysis.terms_.clear();
+
+    const backend requested = _options.backend_;
+    if(requested != backend::automatic && requested != backend::cpu_separable &&
+       requested != backend::cpu_low_rank && requested != backend::opencl_separable)
+      return;
+
+    _analysis.separable_ = factorize_separable(_kernel, _kernel_extents, _analysis.factors_);
+    if(_analysis.separable_ || _options.max_rank_ < 2 ||
+       (requested != backend::automatic && requested != backend::cpu_low_rank))
+      return;
+
+    //only a decomposition that beats the direct tap count is of any use
+    const long taps_direct = long(_kernel_extents[0])*_kernel_extents[1]*_kernel_extents[2];
+    const long taps_term = long(_kernel_extents[0]) + _kernel_extents[1] + _kernel_extents[2];
+    const unsigned max_rank = std::min<long>(_options.max_rank_, (taps_direct - 1)/taps_term);
+    if(max_rank < 2)
+      return;
+
+    if(requested == backend::automatic){
+      const std::vector<backend_estimate> others = estimate_costs(_image_extents, _kernel_extents, _analysis, _options);
+      if(others.front().seconds_ <= low_rank_seconds(_image_extents, _kernel_extents, 2, _options))
+	return;
+    }
+
+    const double error = decompose_low_rank(_kernel, _kernel_extents, _analysis.terms_,
+					    _options.low_rank_error_, max_rank);
+    if(error > _options.low_rank_error_)
+      _analysis.terms_.clear();
+  }
+
+  namespace detail {
+
+    template <typename ExtentT>
+    void run_backend(backend _backend,
+		     const float* src_begin, ExtentT* src_extents,
+		     const float* kernel_begin, ExtentT* kernel_extents,
+		     float* out_begin,
+		     const kernel_analysis& _analysis,
+		     const convolve_options& _options,
+		     unsigned _num_threads){
+
+      std::vector<ExtentT> image_shape(src_extents,src_extents+3);
+      std::vector<ExtentT> kernel_shape(kernel_extents,kernel_extents+3);
+      anyfold::image_stack_cref image(src_begin, image_shape);
+      anyfold::image_stack_cref kernel(kernel_begin, kernel_shape);
+      anyfold::image_stack_ref output(out_begin, image_shape);
+
+      switch(_backend){
+      case backend::cpu_direct:
+	cpu::parallel_convolve_3d(src_begin, src_extents, kernel_begin, kernel_extents, out_begin, _num_threads);
+	return;
+      case backend::cpu_vectorized:
+	cpu::vectorized_convolve_3d(src_begin, src_extents, kernel_begin, kernel_extents, out_begin, _num_threads);
+	return;
+      case backend::cpu_tiled:
+	cpu::tiled_convolve_3d(src_begin, src_extents, kernel_begin, kernel_extents, out_begin, _num_threads);
+	return;
+      case backend::cpu_separable:
+	cpu::convolve_separable(image, _analysis.factors_[0], _analysis.factors_[1], _analysis.factors_[2], output, _num_threads);
+	return;
+      case backend::cpu_low_rank:
+	cpu::convolve_low_rank(image, _analysis.terms_, output, _num_threads);
+	return;
+      case backend::cpu_fft:
+	cpu::fft_convolve_3d(src_begin, src_extents, kernel_begin, kernel_extents, out_begin, _num_threads);
+	return;
+      case backend::cpu_overlap_save:
+	cpu::overlap_save_convolve_3d(src_begin, src_extents, kernel_begin, kernel_extents, out_begin,
+				      _options.memory_budget_, _num_threads);
+	return;
+      default:
+	break;
+      }
+
+#ifdef HAS_OPENCL
+      std::vector<int> offsets(3);
+      for (unsigned i = 0; i < offsets.size(); ++i)
+	offsets[i] = kernel_extents[i]/2;
+
+      switch(_backend){
+      case backend::opencl_buffer:
+	opencl::convolveBuffer(image, kernel, output, offsets);
+	return;
+      case backend::opencl_buffer_local_mem:
+	opencl::convolveBufferLocalMem(image, kernel, output, offsets);
+	return;
+      case backend::opencl_image:
+	opencl::convolveImage(image, kernel, output, offsets);
+	return;
+      case backend::opencl_image_local_mem:
+	opencl::convolveImageLocalMem(image, kernel, output, offsets);
+	return;
+      case backend::opencl_separable:
+	opencl::convolveSeparable(image, _analysis.factors_, output);
+	return;
+      default:
+	break;
+      }
+#endif
+    }
+
+  };
+
+  namespace detail {
+
+    //the cheapest estimate or _options.backend_ if that isn't automatic (throws if the
+    //requested backend isn't among the estimates); writes the estimates and the
+    //decision to _options.log_ if set
+    template <typename ExtentT>
+    backend choose_backend(ExtentT* src_extents, ExtentT* kernel_extents,
+			   const kernel_analysis& _analysis,
+			   const convolve_options& _options,
+			   const char* _caller){
+
+      const std::vector<backend_estimate> estimates = estimate_costs(src_extents, kernel_extents, _analysis, _options);
+
+      backend chosen = _options.backend_;
+      if(chosen == backend::automatic)
+	chosen = estimates.front().backend_;
+      else if(std::find_if(estimates.begin(), estimates.end(),
+			   [chosen](const backend_estimate& _e){ return _e.backend_ == chosen; }) == estimates.end()){
+	std::ostringstream msg;
+	msg << "[anyfold::" << _caller << "]\tbackend " << name(chosen) << " can't handle this kernel or isn't available\n";
+	throw std::runtime_error(msg.str().c_str());
+      }
+
+      if(_options.log_){
+	std::ostream& log = *_options.log_;
+	log << "[anyfold::" << _caller << "]\timage " << src_extents[0] << "x" << src_extents[1] << "x" << src_extents[2]
+	    << ", kernel " << kernel_extents[0] << "x" << kernel_extents[1] << "x" << kernel_extents[2]
+	    << (_analysis.separable_ ? " (separable)" : "");
+	if(!_analysis.terms_.empty())
+	  log << " (rank " << _analysis.terms_.size() << ")";
+	log << "\n";
+	for(unsigned i = 0;i<estimates.size();++i)
+	  log << "\t" << name(estimates[i].backend_) << "\t" << estimates[i].seconds_ << " s\n";
+	log << "\t=> " << name(chosen) << ((_options.backend_ == backend::automatic) ? "" : " (requested)") << "\n";
+      }
+
+      return chosen;
+    }
+
+  };
+
+  //front door: convolves the c-ordered volume at src_begin with the kernel (interior
+  //voxels only, like cpu::convolve_3d) using the backend the cost model expects to be
+  //fastest, or _options.backend_ if that isn't automatic; returns the backend used
+  template <typename ExtentT>
+  backend convolve(const float* src_begin, ExtentT* src_extents,
+		   const float* kernel_begin, ExtentT* kernel_extents,
+		   float* out_begin,
+		   const convolve_options& _options = convolve_options())
+  {
+    kernel_analysis analysis;
+    analyse_kernel(src_extents, kernel_begin, kernel_extents, _options, analysis);
+
+    const backend chosen = detail::choose_backend(src_extents, kernel_extents, analysis, _options, "convolve");
+
+    const unsigned threads = _options.num_threads_ ? _options.num_threads_ : cpu::thread_pool::global().size();
+    detail::run_backend(chosen, src_begin, src_extents, kernel_begin, kernel_extents, out_begin,
+			analysis, _options, threads);
+    return chosen;
+  }
+
+  //filter bank: convolves the image with _count kernels (kernel_begins[k] of the
+  //extents kernel_extents[k]) into out_begins[k], interior voxels only; the image is
+  //read once for all kernels, either tile by tile (cpu_tiled) or as one spectrum that
+  //all kernels share (cpu_fft), whichever the cost model expects to be faster unless
+  //_options.backend_ asks for one of the two; returns the backend used
+  template <typename ExtentT>
+  backend convolve_bank(const float* src_begin, ExtentT* src_extents,
+			const float* const* kernel_begins, ExtentT* const* kernel_extents,
+			std::size_t _count,
+			float* const* out_begins,
+			const convolve_options& _options = convolve_options())
+  {
+    const cost_model& model = _options.model_ ? *_options.model_ : cost_model::global();
+    const unsigned threads = _options.num_threads_ ? _options.num_threads_ : cpu::thread_pool::global().size();
+
+    double direct = 0;
+    long largest[3] = {1, 1, 1};
+    for(std::size_t k = 0;k<_count;++k){
+      double interior = 1;
+      for(int d = 0;d<3;++d){
+	interior *= std::max<long>(0, long(src_extents[d]) - 2*(long(kernel_extents[k][d])/2));
+	largest[d] = std::max(largest[d], long(kernel_extents[k][d]));
+      }
+      direct += model.tiled_tap_*interior*kernel_extents[k][0]*kernel_extents[k][1]*kernel_extents[k][2];
+    }
+
+    long shape[3] = {long(src_extents[0]), long(src_extents[1]), long(src_extents[2])};
+    zero_padd<image_stack> padding = cpu::fft_padding(shape, largest);
+    const double points = double(padding.extents_[0])*padding.extents_[1]*padding.extents_[2];
+    //one forward transform of the image, one of every kernel and one inverse per kernel
+    const double fft = model.fft_point_*points*std::log2(std::max(2., points))*(1 + 2*_count);
+
+    backend chosen = _options.backend_;
+    if(chosen == backend::automatic)
+      chosen = (fft < direct) ? backend::cpu_fft : backend::cpu_tiled;
+    else if(chosen != backend::cpu_fft && chosen != backend::cpu_tiled){
+      std::ostringstream msg;
+      msg << "[anyfold::convolve_bank]\tbackend " << name(chosen) << " has no filter bank, use cpu_tiled or cpu_fft\n";
+      throw std::runtime_error(msg.str().c_str());
+    }
+
+    if(_options.log_)
+      *_options.log_ << "[anyfold::convolve_bank]\t" << _count << " kernels\n"
+		     << "\t" << name(backend::cpu_tiled) << "\t" << direct/threads << " s\n"
+		     << "\t" << name(backend::cpu_fft) << "\t" << fft/threads << " s\n"
+		     << "\t=> " << name(chosen) << ((_options.backend_ == backend::automatic) ? "" : " (requested)") << "\n";
+
+    if(chosen == backend::cpu_fft)
+      cpu::fft_filter_bank_3d(src_begin, src_extents, kernel_begins, kernel_extents, _count, out_begins, threads);
+    else
+      cpu::tiled_filter_bank_3d(src_begin, src_extents, kernel_begins, kernel_extents, _count, out_begins, threads);
+    return chosen;
+  }
+
+  namespace detail {
+
+    //fastest of _repeats runs in seconds
+    template <typename F>
+    double time_best_of(F _func, int _repeats = 3){
+
+      double value = 0;
+      for(int r = 0;r<_repeats;++r){
+	const auto start = std::chrono::steady_clock::now();
+	_func();
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	value = (r == 0) ? seconds : std::min(value, seconds);
+      }
+      return value;
+    }
+
+  };
+
+  //measures the constants of the cost model on this machine (single thread, takes a
+  //few seconds with OpenCL and well below that without), save() the result to
+  //cost_model::default_path() to have cost_model::global() pick it up
+  inline cost_model calibrate(){
+
+    cost_model model;
+
+    std::vector<int> shape(3, 64);
+    std::vector<int> kshape(3, 7);
+    image_stack image(shape);
+    image_stack kernel(kshape);
+    image_stack output(shape);
+    for(unsigned i = 0;i<image.num_elements();++i)
+      image.data()[i] = std::sin(.1f*i);
+    for(unsigned i = 0;i<kernel.num_elements();++i)
+      kernel.data()[i] = std::cos(1.3f*i*i);
+
+    double interior = 1;
+    double voxels = 1;
+    double taps = 1;
+    double taps_1d = 0;
+    for(int d = 0;d<3;++d){
+      interior *= shape[d] - 2*(kshape[d]/2);
+      voxels *= shape[d];
+      taps *= kshape[d];
+      taps_1d += kshape[d];
+    }
+
+    //the generic loops, parallel_convolve_3d would pick the fixed size kernel for 7x7x7
+    std::vector<int> offsets(3, kshape[0]/2);
+    model.direct_tap_ = detail::time_best_of([&](){
+	cpu::parallel_convolve(image, kernel, output, offsets, 1);
+      })/(interior*taps);
+
+    model.vectorized_tap_ = detail::time_best_of([&](){
+	cpu::vectorized_convolve_3d(image.data(), &shape[0], kernel.data(), &kshape[0], output.data(), 1);
+      })/(interior*taps);
+
+    model.tiled_tap_ = detail::time_best_of([&](){
+	cpu::tiled_convolve_3d(image.data(), &shape[0], kernel.data(), &kshape[0], output.data(), 1);
+      })/(interior*taps);
+
+    std::vector<float> factor(kshape[0], 1.f/kshape[0]);
+    model.separable_tap_ = detail::time_best_of([&](){
+	cpu::convolve_separable(image, factor, factor, factor, output, 1);
+      })/(voxels*taps_1d);
+
+    zero_padd<image_stack> padding = cpu::fft_padding(&shape[0], &kshape[0]);
+    const double points = double(padding.extents_[0])*padding.extents_[1]*padding.extents_[2];
+    cpu::fft_convolve_3d(image.data(), &shape[0], kernel.data(), &kshape[0], output.data(), 1);
+    model.fft_point_ = detail::time_best_of([&](){
+	cpu::fft_convolve_3d(image.data(), &shape[0], kernel.data(), &kshape[0], output.data(), 1);
+      })/(points*std::log2(points));
+
+#ifdef HAS_OPENCL
+    if(opencl_available()){
+      kernel_analysis analysis;
+      analysis.separable_ = factorize_separable(kernel.data(), &kshape[0], analysis.factors_);
+      convolve_options options;
+
+      //the overhead from a tiny problem, the transfer from a one tap kernel
+      std::vector<int> tiny(3, 4);
+      std::vector<int> one(3, 1);
+      image_stack tiny_image(tiny);
+      model.opencl_overhead_ = detail::time_best_of([&](){
+	  detail::run_backend(backend::opencl_buffer, tiny_image.data(), &tiny[0], kernel.data(), &one[0], tiny_image.data(), analysis, options, 1);
+	});
+
+      const double bytes = 2*sizeof(float)*voxels;
+      model.opencl_byte_ = std::max(0., detail::time_best_of([&](){
+	    detail::run_backend(backend::opencl_buffer, image.data(), &shape[0], kernel.data(), &one[0], output.data(), analysis, options, 1);
+	  }) - model.opencl_overhead_)/bytes;
+
+      const double fixed = model.opencl_overhead_ + model.opencl_byte_*bytes;
+      const std::pair<backend, double*> variants[] = {std::make_pair(backend::opencl_buffer, &model.opencl_buffer_tap_),
+						      std::make_pair(backend::opencl_buffer_local_mem, &model.opencl_buffer_local_mem_tap_),
+						      std::make_pair(backend::opencl_image, &model.opencl_image_tap_),
+						      std::make_pair(backend::opencl_image_local_mem, &model.opencl_image_local_mem_tap_)};
+      for(unsigned i = 0;i<4;++i)
+	*variants[i].second = std::max(0., detail::time_best_of([&](){
+	      detail::run_backend(variants[i].first, image.data(), &shape[0], kernel.data(), &kshape[0], output.data(), analysis, options, 1);
+	    }) - fixed)/(interior*taps);
+
+      analysis.factors_[0] = analysis.factors_[1] = analysis.factors_[2] = factor;
+      model.opencl_separable_tap_ = std::max(0., detail::time_best_of([&](){
+	    detail::run_backend(backend::opencl_separable, image.data(), &shape[0], kernel.data(), &kshape[0], output.data(), analysis, options, 1);
+	  }) - fixed)/(voxels*taps_1d);
+    }
+#endif
+
+    return model;
+  }
+
+};
+
+#endif /* _ANYFOLD_DISPATCH_HPP_ */
@@ -0,0 +1,231 @@
+#ifndef _KERNEL_UTILS_H_
+#define _KERNEL_UTILS_H_
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+namespace anyfold {
+
+  //relative frobenius error up to which a kernel is considered to be separable
+  static const float default_separable_tolerance = 1e-5f;
+
+  //tries to write _kernel (c storage order, extents in boost index order) as the outer
+  //product _factors[0] x _factors[1] x _factors[2]; the factors are taken from the three
+  //lines through the largest absolute tap and the result is accepted if the frobenius norm of
+  //the residual is below _tolerance times the norm of the kernel
+  template <typename KernIterT, typename ExtentT>
+  bool factorize_separable(KernIterT _kernel, const ExtentT* _extents,
+			   std::vector<float> (&_factors)[3],
+			   float _tolerance = default_separable_tolerance){
+
+    const long shape[3] = {long(_extents[0]), long(_extents[1]), long(_extents[2])};
+    const long size = shape[0]*shape[1]*shape[2];
+
+    long pivot = 0;
+    double norm = 0;
+    for(long i = 0;i<size;++i){
+      const double value = _kernel[i];
+      norm += value*value;
+      if(std::fabs(value) > std::fabs(double(_kernel[pivot])))
+	pivot = i;
+    }
+
+    for(int d = 0;d<3;++d)
+      _factors[d].assign(shape[d], 0.f);
+
+    if(norm == 0)
+      return true;
+
+    const long p[3] = {pivot/(shape[1]*shape[2]), (pivot/shape[2]) % shape[1], pivot % shape[2]};
+    const double pivot_value = _kernel[pivot];
+
+    const long strides[3] = {shape[1]*shape[2], shape[2], 1};
+    long non_zero[3] = {0, 0, 0};
+    for(int d = 0;d<3;++d)
+      for(long i = 0;i<shape[d];++i)
+	non_zero[d] += _kernel[pivot + (i - p[d])*strides[d]] != 0;
+
+    //the densest line is kept as is and the other two are divided by the pivot, so
+    //kernels that vary along one axis only are factorized without rounding
+    const int kept = std::max_element(non_zero, non_zero + 3) - non_zero;
+    for(int d = 0;d<3;++d)
+      for(long i = 0;i<shape[d];++i){
+	const double value = _kernel[pivot + (i - p[d])*strides[d]];
+	_factors[d][i] = (d == kept) ? value : value/pivot_value;
+      }
+
+    double residual = 0;
+    for(long a = 0;a<shape[0];++a)
+      for(long b = 0;b<shape[1];++b)
+	for(long c = 0;c<shape[2];++c){
+	  const double delta = double(_kernel[(a*shape[1] + b)*shape[2] + c]) - double(_factors[0][a])*_factors[1][b]*_factors[2][c];
+	  residual += delta*delta;
+	}
+
+    return residual <= double(_tolerance)*_tolerance*norm;
+  }
+
+  //a separable kernel is only worth the three 1D passes if they need fewer taps
+  //than the direct 3D loop
+  template <typename KernIterT, typename ExtentT>
+  bool prefer_separable(KernIterT _kernel, const ExtentT* _extents,
+			std::vector<float> (&_factors)[3],
+			float _tolerance = default_separable_tolerance){
+
+    const long taps_direct = long(_extents[0])*_extents[1]*_extents[2];
+    const long taps_separable = long(_extents[0]) + _extents[1] + _extents[2];
+    if(taps_separable >= taps_direct)
+      return false;
+
+    return factorize_separable(_kernel, _extents, _factors, _tolerance);
+  }
+
+  //one term of a sum-of-separable approximation, the weight is folded into the factors
+  struct separable_term {
+    std::vector<float> factors_[3];
+  };
+
+  //solves _matrix * x = _rhs in place for a small symmetric positive (semi-)definite
+  //matrix by gaussian elimination with partial pivoting, _rhs holds the solution on exit
+  inline void solve_small_system(std::vector<double> _matrix, std::vector<double>& _rhs, long _n){
+
+    for(long c = 0;c<_n;++c){
+      long pivot = c;
+      for(long r = c+1;r<_n;++r)
+	if(std::fabs(_matrix[r*_n + c]) > std::fabs(_matrix[pivot*_n + c]))
+	  pivot = r;
+      if(_matrix[pivot*_n + c] == 0)
+	continue;
+      for(long k = 0;k<_n;++k)
+	std::swap(_matrix[c*_n + k], _matrix[pivot*_n + k]);
+      std::swap(_rhs[c], _rhs[pivot]);
+
+      for(long r = 0;r<_n;++r){
+	if(r == c)
+	  continue;
+	const double factor = _matrix[r*_n + c]/_matrix[c*_n + c];
+	for(long k = c;k<_n;++k)
+	  _matrix[r*_n + k] -= factor*_matrix[c*_n + k];
+	_rhs[r] -= factor*_rhs[c];
+      }
+    }
+
+    for(long c = 0;c<_n;++c)
+      _rhs[c] = (_matrix[c*_n + c] != 0) ? _rhs[c]/_matrix[c*_n + c] : 0.;
+  }
+
+  //approximates _kernel by a short sum of separable terms (CP decomposition): the rank
+  //is increased one term at a time, every new term is initialized from the lines through
+  //the largest tap of the residual and then all terms are refined together by
+  //alternating least squares; stops as soon as the relative frobenius error is below
+  //_rel_error or _max_rank terms are used and returns the relative error reached
+  template <typename KernIterT, typename ExtentT>
+  double decompose_low_rank(KernIterT _kernel, const ExtentT* _extents,
+			    std::vector<separable_term>& _terms,
+			    float _rel_error,
+			    unsigned _max_rank,
+			    unsigned _iterations = 128){
+
+    const long shape[3] = {long(_extents[0]), long(_extents[1]), long(_extents[2])};
+    const long size = shape[0]*shape[1]*shape[2];
+    const long strides[3] = {shape[1]*shape[2], shape[2], 1};
+
+    const std::vector<double> kernel(_kernel, _kernel + size);
+    double norm = 0;
+    for(long i = 0;i<size;++i)
+      norm += kernel[i]*kernel[i];
+
+    _terms.clear();
+    if(norm == 0)
+      return 0.;
+
+    //factors[d][i*rank + r] is entry i of the factor along dimension d of term r
+    std::vector<double> factors[3];
+    std::vector<double> residual(kernel);
+    double residual_norm = norm;
+    long rank = 0;
+
+    while(residual_norm > double(_rel_error)*_rel_error*norm && rank < long(_max_rank)){
+
+      const long pivot = std::max_element(residual.begin(), residual.end(),
+					  [](double _a, double _b){ return std::fabs(_a) < std::fabs(_b); }) - residual.begin();
+      const long p[3] = {pivot/strides[0], (pivot/strides[1]) % shape[1], pivot % shape[2]};
+      const double pivot_value = residual[pivot];
+
+      for(int d = 0;d<3;++d){
+	std::vector<double> grown(shape[d]*(rank+1));
+	for(long i = 0;i<shape[d];++i){
+	  std::copy(factors[d].begin() + i*rank, factors[d].begin() + (i+1)*rank, grown.begin() + i*(rank+1));
+	  const double value = residual[pivot + (i - p[d])*strides[d]];
+	  grown[i*(rank+1) + rank] = (d == 0) ? value : value/pivot_value;
+	}
+	factors[d].swap(grown);
+      }
+      ++rank;
+
+      for(unsigned it = 0;it<_iterations;++it){
+	double change = 0;
+	for(int d = 0;d<3;++d){
+	  const int e = (d+1) % 3;
+	  const int f = (d+2) % 3;
+
+	  //gram matrix of the khatri-rao product of the other two factors
+	  std::vector<double> gram(rank*rank);
+	  for(long r = 0;r<rank;++r)
+	    for(long q = 0;q<rank;++q){
+	      double ge = 0;
+	      double gf = 0;
+	      for(long j = 0;j<shape[e];++j)
+		ge += factors[e][j*rank + r]*factors[e][j*rank + q];
+	      for(long k = 0;k<shape[f];++k)
+		gf += factors[f][k*rank + r]*factors[f][k*rank + q];
+	      gram[r*rank + q] = ge*gf;
+	    }
+
+	  for(long i = 0;i<shape[d];++i){
+	    std::vector<double> rhs(rank, 0.);
+	    for(long j = 0;j<shape[e];++j)
+	      for(long k = 0;k<shape[f];++k){
+		const double value = kernel[i*strides[d] + j*strides[e] + k*strides[f]];
+		if(value == 0)
+		  continue;
+		for(long r = 0;r<rank;++r)
+		  rhs[r] += value*factors[e][j*rank + r]*factors[f][k*rank + r];
+	      }
+	    solve_small_system(gram, rhs, rank);
+	    for(long r = 0;r<rank;++r){
+	      change = std::max(change, std::fabs(rhs[r] - factors[d][i*rank + r]));
+	      factors[d][i*rank + r] = rhs[r];
+	    }
+	  }
+	}
+	if(change <= 1e-9*std::sqrt(norm))
+	  break;
+      }
+
+      residual_norm = 0;
+      for(long a = 0;a<shape[0];++a)
+	for(long b = 0;b<shape[1];++b)
+	  for(long c = 0;c<shape[2];++c){
+	    double value = kernel[a*strides[0] + b*strides[1] + c];
+	    for(long r = 0;r<rank;++r)
+	      value -= factors[0][a*rank + r]*factors[1][b*rank + r]*factors[2][c*rank + r];
+	    residual[a*strides[0] + b*strides[1] + c] = value;
+	    residual_norm += value*value;
+	  }
+    }
+
+    _terms.resize(rank);
+    for(long r = 0;r<rank;++r)
+      for(int d = 0;d<3;++d){
+	_terms[r].factors_[d].resize(shape[d]);
+	for(long i = 0;i<shape[d];++i)
+	  _terms[r].factors_[d][i] = factors[d][i*rank + r];
+      }
+
+    return std::sqrt(residual_norm/norm);
+  }
+
+}
+
+#endif /* _KERNEL_UTILS_H_ */
@@ -11,6 +11,8 @@
 #endif
 
 #include "image_stack_utils.h"
+#include "sample_utils.h"
+#include "runtime.hpp"
 
 namespace anyfold {
 
@@ -23,14 +25,41 @@ public:
 	~Convolution3DCLBuffer() = default;
 
 	bool setupCLcontext();
+	// storage of the image and the result on the device and the host (fp32 by
+	// default), to be set before createProgramAndLoadKernel; 16 and 8 bit
+	// samples cut the memory traffic, the sums are accumulated in float
+	// regardless and integer results are saturated
+	void setSampleType(sample_type _type);
+	// storage of the result only (that of setSampleType by default), e.g. to
+	// store uint16 images as uint8, to be set before createProgramAndLoadKernel
+	void setResultType(sample_type _type);
+	// the results are mapped to value*_scale + _offset on the device before
+	// they are stored (and saturated), to be set before setupKernelArgs
+	void setScaling(float _scale, float _offset);
+	// host memory handling (HostMemory::automatic by default), to be set before
+	// setupKernelArgs; with zero copy the image given to setupKernelArgs or
+	// uploadImage may be used in place until the next upload
+	void setHostMemory(HostMemory _mode);
 	void createProgramAndLoadKernel(const std::string& fileName,
 	                                const std::string& kernelName,
 	                                size_t const* filterSize);
 	void setupKernelArgs(image_stack_cref _image,
 	                     image_stack_cref _kernel,
 	                     const std::vector<int>& _offset);
+	// replaces the input of the next execute() by _image (same shape as the one
+	// given to setupKernelArgs), the device buffers and the program are reused
+	void uploadImage(image_stack_cref _image);
 	void execute();
 	void getResult(image_stack_ref result);
+
+	// the same for images of the sample type given to setSampleType (results of
+	// that given to setResultType), _shape holds the extents in c order like
+	// image_stack::shape()
+	void setupKernelArgs(const void* _samples, const std::size_t* _shape,
+	                     image_stack_cref _kernel,
+	                     const std::vector<int>& _offset);
+	void uploadSamples(const void* _samples);
+	void getResultSamples(void* _result);
 	// void convolve3D(/* something image3D, something filterkernel3D */);
 
 
@@ -55,6 +84,15 @@ private:
 	cl::CommandQueue queue;
 
 	cl_int status = CL_SUCCESS;
+	sample_type sampleType = sample_type::fp32;
+	sample_type resultType = sample_type::fp32;
+	float resultScale = 1.f;
+	float resultOffset = 0.f;
+
+	HostMemory hostMemory = HostMemory::automatic;
+	bool zeroCopy = false;
+	// the caller's image wrapped by inputBuffer, if any
+	const void* hostInput = nullptr;
 
 	cl::Buffer inputBuffer;
 	cl::Buffer outputBuffer;
@@ -11,6 +11,7 @@
 #endif
 
 #include "image_stack_utils.h"
+#include "runtime.hpp"
 
 namespace anyfold {
 
@@ -23,12 +24,19 @@ public:
 	~Convolution3DCLBufferLocalMem() = default;
 
 	bool setupCLcontext();
+	// host memory handling (HostMemory::automatic by default), to be set before
+	// setupKernelArgs; with zero copy the image given to setupKernelArgs or
+	// uploadImage may be used in place until the next upload
+	void setHostMemory(HostMemory _mode);
 	void createProgramAndLoadKernel(const std::string& fileName,
 	                                const std::string& kernelName,
 	                                size_t const* filterSize);
 	void setupKernelArgs(image_stack_cref _image,
 	                     image_stack_cref _kernel,
 	                     const std::vector<int>& _offset);
+	// replaces the input of the next execute() by _image (same shape as the one
+	// given to setupKernelArgs), the device buffers and the program are reused
+	void uploadImage(image_stack_cref _image);
 	void execute();
 	void getResult(image_stack_ref result);
 
@@ -55,6 +63,11 @@ private:
 
 	cl_int status = CL_SUCCESS;
 
+	HostMemory hostMemory = HostMemory::automatic;
+	bool zeroCopy = false;
+	// the caller's image wrapped by inputBuffer, if any
+	const void* hostInput = nullptr;
+
 	cl::Buffer inputBuffer;
 	cl::Buffer outputBuffer[2];
 	cl::Buffer filterWeightsBuffer;
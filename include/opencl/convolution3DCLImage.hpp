@@ -29,6 +29,9 @@ public:
 	void setupKernelArgs(image_stack_cref _image,
 	                     image_stack_cref _kernel,
 	                     const std::vector<int>& _offset);
+	// replaces the input of the next execute() by _image (same shape as the one
+	// given to setupKernelArgs), the device buffers and the program are reused
+	void uploadImage(image_stack_cref _image);
 	void execute();
 	void getResult(image_stack_ref result);
 	// void convolve3D(/* something image3D, something filterkernel3D */);
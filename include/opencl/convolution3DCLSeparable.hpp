@@ -0,0 +1,69 @@
+#ifndef CONVOLUTION3DCLSEPARABLE_HPP
+#define CONVOLUTION3DCLSEPARABLE_HPP
+
+#include <vector>
+#include <string>
+
+#ifdef __APPLE__
+	#include "Opencl/opencl.hpp"
+#else
+	#include "CL/cl.hpp"
+#endif
+
+#include "image_stack_utils.h"
+
+namespace anyfold {
+
+namespace opencl {
+
+// convolution with a separable kernel by three 1D passes (x, y and z) over
+// buffers, the factors are given in boost index order (z, y, x)
+class Convolution3DCLSeparable
+{
+public:
+	Convolution3DCLSeparable() = default;
+	~Convolution3DCLSeparable() = default;
+
+	bool setupCLcontext();
+	void createProgramAndLoadKernel(const std::string& fileName,
+	                                const std::string& kernelName);
+	void setupKernelArgs(image_stack_cref _image,
+	                     const std::vector<float> (&_factors)[3]);
+	// replaces the input of the next execute() by _image (same shape as the one
+	// given to setupKernelArgs), the device buffers and the program are reused
+	void uploadImage(image_stack_cref _image);
+	void execute();
+	void getResult(image_stack_ref result);
+
+
+private:
+	void createProgram(const std::string& source);
+	void loadKernel(const std::string& kernelName);
+	void enqueuePass(const cl::Buffer& input, const cl::Buffer& weights,
+	                 const cl::Buffer& output, int axis,
+	                 const std::size_t* begin, const std::size_t* end);
+
+
+private:
+	cl::Context context;
+	std::vector<cl::Platform> platforms;
+	std::vector<cl::Device> devices;
+
+	cl::Program program;
+	cl::Kernel kernel;
+	cl::CommandQueue queue;
+
+	cl_int status = CL_SUCCESS;
+
+	cl::Buffer inputBuffer;
+	cl::Buffer intermediateBuffer[2];
+	cl::Buffer outputBuffer;
+	cl::Buffer filterWeightsBuffer[3];
+	std::size_t imageSize[3];
+	std::size_t filterSize[3];
+};
+
+} /* namespace opencl */
+} /* namespace anyfold */
+
+#endif /* CONVOLUTION3DCLSEPARABLE_HPP */
@@ -4,15 +4,53 @@
 #include <vector>
 
 #include "image_stack_utils.h"
+#include "kernel_utils.h"
+#include "sample_utils.h"
+#include "cpu/convert.hpp"
 #include "convolution3DCLBuffer.hpp"
 #include "convolution3DCLBufferLocalMem.hpp"
 #include "convolution3DCLImage.hpp"
 #include "convolution3DCLImageLocalMem.hpp"
+#include "convolution3DCLSeparable.hpp"
+#include "runtime.hpp"
+#include "sources.hpp"
 
 namespace anyfold {
 
 namespace opencl {
 
+void convolveSeparable(image_stack_cref image, 
+              const std::vector<float> (&factors)[3], 
+              image_stack_ref result)
+{
+	Convolution3DCLSeparable c;
+	c.setupCLcontext();
+	c.createProgramAndLoadKernel("convolution3dSeparable.cl", "convolution1d");
+	c.setupKernelArgs(image, factors);
+	c.execute();
+	c.getResult(result);
+}
+
+
+// convolution with the separable kernel k0 x k1 x k2 (one factor per boost dimension)
+void convolve_3dSeparable(const float* src_begin, int* src_extents,
+                 const float* k0_begin, const float* k1_begin, const float* k2_begin,
+                 int* kernel_extents,
+                 float* out_begin)
+{
+	std::vector<int> image_shape(src_extents,src_extents+3);
+
+	anyfold::image_stack_cref image(src_begin, image_shape);
+	anyfold::image_stack_ref output(out_begin, image_shape);
+
+	std::vector<float> factors[3];
+	factors[0].assign(k0_begin, k0_begin + kernel_extents[0]);
+	factors[1].assign(k1_begin, k1_begin + kernel_extents[1]);
+	factors[2].assign(k2_begin, k2_begin + kernel_extents[2]);
+
+	convolveSeparable(image,factors,output);
+}
+
 void convolveBuffer(image_stack_cref image, 
               image_stack_cref kernel, 
               image_stack_ref result,
@@ -20,8 +58,7 @@ void convolveBuffer(image_stack_cref image,
 {
 	Convolution3DCLBuffer c;
 	c.setupCLcontext();
-	std::string loc = std::string(PROJECT_ROOT_DIR) + std::string("/src/opencl/convolution3dBuffer.cl");
-	c.createProgramAndLoadKernel(loc.c_str(), "convolution3d", kernel.shape());
+	c.createProgramAndLoadKernel("convolution3dBuffer.cl", "convolution3d", kernel.shape());
 	c.setupKernelArgs(image, kernel, offset);
 	c.execute();
 	c.getResult(result);
@@ -42,10 +79,51 @@ void convolve_3dBuffer(const float* src_begin, int* src_extents,
 	std::vector<int> offsets(3);
 	for (unsigned i = 0; i < offsets.size(); ++i)
 		offsets[i] = kernel_shape[i]/2;
+
+	std::vector<float> factors[3];
+	if(prefer_separable(kernel_begin, kernel_extents, factors))
+		return convolveSeparable(image,factors,output);
       
 	convolveBuffer(image,kernel,output,offsets);
 }
 
+// convolve_3dBuffer for images stored as float16, bfloat16, uint8 or uint16, the
+// device reads and writes the samples at their storage width and accumulates in
+// float, the sums are mapped by _scaling (integer results are saturated)
+template <typename InT, typename OutT>
+void convolve_3dBuffer(const InT* src_begin, int* src_extents,
+                 float* kernel_begin, int* kernel_extents,
+                 OutT* out_begin,
+                 const cpu::sample_scaling& _scaling)
+{
+	std::vector<int> kernel_shape(kernel_extents,kernel_extents+3);
+	anyfold::image_stack_cref kernel(kernel_begin, kernel_shape);
+	const std::size_t image_shape[3] = {std::size_t(src_extents[0]), std::size_t(src_extents[1]), std::size_t(src_extents[2])};
+
+	std::vector<int> offsets(3);
+	for (unsigned i = 0; i < offsets.size(); ++i)
+		offsets[i] = kernel_shape[i]/2;
+
+	Convolution3DCLBuffer c;
+	c.setupCLcontext();
+	c.setSampleType(sample_traits<InT>::type);
+	c.setResultType(sample_traits<OutT>::type);
+	c.setScaling(_scaling.scale_, _scaling.offset_);
+	c.createProgramAndLoadKernel("convolution3dBuffer.cl", "convolution3d", kernel.shape());
+	c.setupKernelArgs(src_begin, image_shape, kernel, offsets);
+	c.execute();
+	c.getResultSamples(out_begin);
+}
+
+template <typename InT, typename OutT>
+void convolve_3dBuffer(const InT* src_begin, int* src_extents,
+                 float* kernel_begin, int* kernel_extents,
+                 OutT* out_begin)
+{
+	convolve_3dBuffer(src_begin, src_extents, kernel_begin, kernel_extents, out_begin,
+	                  cpu::sample_scaling());
+}
+
 void convolveBufferLocalMem(image_stack_cref image, 
               image_stack_cref kernel, 
               image_stack_ref result,
@@ -53,8 +131,7 @@ void convolveBufferLocalMem(image_stack_cref image,
 {
 	Convolution3DCLBufferLocalMem c;
 	c.setupCLcontext();
-	std::string loc = std::string(PROJECT_ROOT_DIR) + std::string("/src/opencl/convolution3dBufferLocalMem.cl");
-	c.createProgramAndLoadKernel(loc.c_str(), "convolution3d", kernel.shape());
+	c.createProgramAndLoadKernel("convolution3dBufferLocalMem.cl", "convolution3d", kernel.shape());
 	c.setupKernelArgs(image, kernel, offset);
 	c.execute();
 	c.getResult(result);
@@ -75,6 +152,10 @@ void convolve_3dBufferLocalMem(const float* src_begin, int* src_extents,
 	std::vector<int> offsets(3);
 	for (unsigned i = 0; i < offsets.size(); ++i)
 		offsets[i] = kernel_shape[i]/2;
+
+	std::vector<float> factors[3];
+	if(prefer_separable(kernel_begin, kernel_extents, factors))
+		return convolveSeparable(image,factors,output);
       
 	convolveBufferLocalMem(image,kernel,output,offsets);
 }
@@ -86,8 +167,7 @@ void convolveImage(image_stack_cref image,
 {
 	Convolution3DCLImage c;
 	c.setupCLcontext();
-	std::string loc = std::string(PROJECT_ROOT_DIR) + std::string("/src/opencl/convolution3dImage.cl");
-	c.createProgramAndLoadKernel(loc.c_str(), "convolution3d", kernel.shape());
+	c.createProgramAndLoadKernel("convolution3dImage.cl", "convolution3d", kernel.shape());
 	c.setupKernelArgs(image, kernel, offset);
 	c.execute();
 	c.getResult(result);
@@ -108,6 +188,10 @@ void convolve_3dImage(const float* src_begin, int* src_extents,
 	std::vector<int> offsets(3);
 	for (unsigned i = 0; i < offsets.size(); ++i)
 		offsets[i] = kernel_shape[i]/2;
+
+	std::vector<float> factors[3];
+	if(prefer_separable(kernel_begin, kernel_extents, factors))
+		return convolveSeparable(image,factors,output);
       
 	convolveImage(image,kernel,output,offsets);
 }
@@ -119,8 +203,7 @@ void convolveImageLocalMem(image_stack_cref image,
 {
 	Convolution3DCLImageLocalMem c;
 	c.setupCLcontext();
-	std::string loc = std::string(PROJECT_ROOT_DIR) + std::string("/src/opencl/convolution3dImageLocalMem.cl");
-	c.createProgramAndLoadKernel(loc.c_str(), "convolution3d", kernel.shape());
+	c.createProgramAndLoadKernel("convolution3dImageLocalMem.cl", "convolution3d", kernel.shape());
 	c.setupKernelArgs(image, kernel, offset);
 	c.execute();
 	c.getResult(result);
@@ -141,6 +224,10 @@ void convolve_3dImageLocalMem(const float* src_begin, int* src_extents,
 	std::vector<int> offsets(3);
 	for (unsigned i = 0; i < offsets.size(); ++i)
 		offsets[i] = kernel_shape[i]/2;
+
+	std::vector<float> factors[3];
+	if(prefer_separable(kernel_begin, kernel_extents, factors))
+		return convolveSeparable(image,factors,output);
       
 	convolveImageLocalMem(image,kernel,output,offsets);
 }
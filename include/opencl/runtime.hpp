@@ -0,0 +1,180 @@
+#ifndef RUNTIME_HPP
+#define RUNTIME_HPP
+
+#include <vector>
+#include <map>
+#include <mutex>
+#include <string>
+
+#ifdef __APPLE__
+	#include "Opencl/opencl.hpp"
+#else
+	#include "CL/cl.hpp"
+#endif
+
+namespace anyfold {
+
+namespace opencl {
+
+// one OpenCL device of any platform as listed by Runtime::listDevices
+struct DeviceInfo
+{
+	cl::Platform platform;
+	cl::Device device;
+	// position in listDevices(), stable as long as the drivers don't change
+	std::size_t index = 0;
+	std::string platformName;
+	std::string name;
+	std::string vendor;
+	std::string version;
+	cl_device_type type = 0;
+	cl_uint computeUnits = 0;
+	cl_uint clockMHz = 0;
+	cl_ulong globalMemory = 0;
+	cl_ulong localMemory = 0;
+	cl_ulong maxAllocation = 0;
+	bool imageSupport = false;
+	bool available = false;
+	// the device works on host memory (integrated GPUs, CPU runtimes)
+	bool hostUnifiedMemory = false;
+	// alignment in bits that sub-buffers and wrapped host memory should have
+	cl_uint baseAddressAlign = 0;
+	// seconds of one probe() run, set by rankDevices only
+	double probeSeconds = 0;
+
+	// "gpu", "cpu", "accelerator" or "other"
+	std::string typeName() const;
+};
+
+// how the buffer based Convolution3DCL classes move images between host and
+// device
+enum class HostMemory
+{
+	// zeroCopy on devices with hostUnifiedMemory, copy on all others
+	automatic,
+	// the image is copied into and the result out of device memory
+	copy,
+	// the image is wrapped with CL_MEM_USE_HOST_PTR if its address is aligned
+	// for the device, else placed in CL_MEM_ALLOC_HOST_PTR memory through a
+	// mapping; the result is read through a mapping of CL_MEM_ALLOC_HOST_PTR
+	// memory, so shared memory devices skip both transfers
+	zeroCopy,
+	// like automatic, but the image is never wrapped: it is always written into
+	// the CL_MEM_ALLOC_HOST_PTR buffer through a mapping, so the buffers stay
+	// the same for every upload and no image needs to outlive its upload (what
+	// plans use)
+	staged
+};
+
+// platform, device, context and command queue shared by all Convolution3DCL
+// objects of the process: created on first use (thread safe), so after the first
+// convolution only the program, the buffers, the transfers and the kernels remain
+// per call; the device is the one findDevice picks for the selector given to
+// selectDevice, or for $ANYFOLD_CL_DEVICE if selectDevice wasn't called (the
+// fastest device by default)
+class Runtime
+{
+public:
+	static Runtime& global();
+
+	// all devices of all platforms, including CPU runtimes like PoCL
+	static std::vector<DeviceInfo> listDevices();
+
+	// the available device matching _selector: "" picks the fastest device (the
+	// winner of rankDevices, whose result is kept in binaryCacheDirectory() so
+	// that the probes only run once per host and driver), "gpu", "cpu" and
+	// "accelerator" the first device of that type, "fastest" the winner of a new
+	// rankDevices, a number the device of that index and any other text the
+	// first device whose name or platform name contains it (ignoring case);
+	// without a match the device of "" is taken and a note printed; throws if
+	// there is no device at all
+	static DeviceInfo findDevice(const std::string& _selector);
+
+	// chooses the device of global(), throws std::runtime_error once global()
+	// exists
+	static void selectDevice(const std::string& _selector);
+
+	// seconds of one convolution of a 64^3 image with a 5^3 kernel by
+	// convolution3dBuffer.cl on _device (best of three after a warm-up run,
+	// compilation and transfers excluded), infinity if the device fails it
+	static double probe(const DeviceInfo& _device);
+
+	// the available devices, fastest probe() first
+	static std::vector<DeviceInfo> rankDevices();
+
+	// the device global() runs on
+	const DeviceInfo& deviceInfo() const { return info_; }
+
+	const cl::Platform& platform() const { return platform_; }
+	const std::vector<cl::Device>& devices() const { return devices_; }
+	const cl::Device& device() const { return devices_[0]; }
+	const cl::Context& context() const { return context_; }
+	// command queues are thread safe, kernels and their arguments are not and
+	// stay with the Convolution3DCL objects
+	const cl::CommandQueue& queue() const { return queue_; }
+
+	// _source built with _options for device(): from memory if it was built
+	// before in this process, else from the binary left in
+	// binaryCacheDirectory() by an earlier process, else compiled (the build log
+	// is printed) and its binary kept in both places; the key is a hash of the
+	// source, the options and the device, driver and platform versions
+	cl::Program buildProgram(const std::string& _source, const std::string& _options);
+
+	// $ANYFOLD_CL_CACHE if set (empty switches the disk cache off), else
+	// ~/.anyfold_cl_cache; missing parent directories are created
+	static std::string binaryCacheDirectory();
+
+	// whether _mode avoids the transfers on device()
+	bool zeroCopy(HostMemory _mode) const;
+	// _data can be wrapped by a CL_MEM_USE_HOST_PTR buffer without the driver
+	// copying it aside
+	bool wrappable(const void* _data) const;
+	// a read only buffer of the _bytes at _data for zeroCopy, _wraps tells
+	// whether it uses _data itself (which must then outlive it) or a copy,
+	// without _wrap it is always a copy
+	cl::Buffer hostBuffer(const void* _data, std::size_t _bytes, bool& _wraps, bool _wrap = true) const;
+	// replaces the contents of _buffer by _data through a mapping, a buffer
+	// wrapping _data is only synchronized
+	void writeMapped(const cl::Buffer& _buffer, const void* _data, std::size_t _bytes) const;
+	// enqueueReadBufferRect of a densely packed _buffer through a mapping,
+	// _region[0] and _hostOffset[0] in bytes
+	void readMappedRect(const cl::Buffer& _buffer, const std::size_t* _region,
+	                    const std::size_t* _hostOffset, std::size_t _hostRowPitch,
+	                    std::size_t _hostSlicePitch, void* _result) const;
+
+	// number of compilations from source so far
+	std::size_t compilations() const;
+	// drops the programs kept in memory, buildProgram reads them from the disk
+	// cache (or compiles them) again
+	void forgetPrograms();
+
+	// throws std::runtime_error naming _label unless _status is CL_SUCCESS
+	static void check(cl_int _status, const char* _label);
+
+private:
+	Runtime();
+	Runtime(const Runtime&) = delete;
+	Runtime& operator=(const Runtime&) = delete;
+
+	static DeviceInfo describe(const cl::Platform& platform, const cl::Device& device, std::size_t index);
+	std::string programKey(const std::string& source, const std::string& options) const;
+	static DeviceInfo fastestDevice(const std::vector<DeviceInfo>& devices);
+	static void makeDirectories(const std::string& path);
+	bool loadBinary(const std::string& path, const std::string& options, cl::Program& program) const;
+	void storeBinary(const std::string& path, const cl::Program& program) const;
+
+	DeviceInfo info_;
+	cl::Platform platform_;
+	std::vector<cl::Device> devices_;
+	cl::Context context_;
+	cl::CommandQueue queue_;
+
+	mutable std::mutex programMutex_;
+	std::map<std::string, cl::Program> programs_;
+	std::size_t compilations_ = 0;
+};
+
+} /* namespace opencl */
+} /* namespace anyfold */
+
+#endif /* RUNTIME_HPP */
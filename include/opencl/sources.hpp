@@ -0,0 +1,21 @@
+#ifndef SOURCES_HPP
+#define SOURCES_HPP
+
+#include <string>
+
+namespace anyfold {
+
+namespace opencl {
+
+// the kernel file _name of src/opencl (e.g. "convolution3dBuffer.cl", of a path
+// only the file name counts) as compiled into the library at build time, so
+// neither the source tree nor the file system is needed at run time; throws
+// std::runtime_error for files that are not part of the library
+const std::string& kernelSource(const std::string& _name);
+
+bool hasKernelSource(const std::string& _name);
+
+} /* namespace opencl */
+} /* namespace anyfold */
+
+#endif /* SOURCES_HPP */
@@ -24,6 +24,42 @@ struct minus_1_div_2 {
   
 };
 
+//how voxels outside of the image are defined: zero, the nearest edge voxel, the
+//image mirrored at the edge voxel (d c b | a b c d | c b a) or repeated periodically
+enum class boundary_mode {
+  zero = 0,
+  clamp,
+  mirror,
+  periodic
+};
+
+//index of the voxel that stands in for _index on an axis of _size voxels, -1 if
+//the voxel is zero
+inline long boundary_index(long _index, long _size, boundary_mode _mode){
+
+  if(_index >= 0 && _index < _size)
+    return _index;
+
+  switch(_mode){
+  case boundary_mode::clamp:
+    return _index < 0 ? 0 : _size - 1;
+  case boundary_mode::mirror: {
+    if(_size == 1)
+      return 0;
+    const long period = 2*(_size - 1);
+    long folded = _index % period;
+    folded = folded < 0 ? folded + period : folded;
+    return folded < _size ? folded : period - folded;
+  }
+  case boundary_mode::periodic: {
+    const long folded = _index % _size;
+    return folded < 0 ? folded + _size : folded;
+  }
+  default:
+    return -1;
+  }
+}
+
 template <typename ImageStackT>
 struct zero_padd {
 
@@ -0,0 +1,394 @@
+#ifndef _ANYFOLD_PLAN_HPP_
+#define _ANYFOLD_PLAN_HPP_
+#include <vector>
+#include <memory>
+#include <string>
+#include <sstream>
+#include <stdexcept>
+#include <functional>
+#include <mutex>
+#include <algorithm>
+
+#include "image_stack_utils.h"
+#include "dispatch.hpp"
+#include "cpu/vectorized_convolve.hpp"
+#include "cpu/tiled_convolve.hpp"
+#include "cpu/separable.hpp"
+#include "cpu/low_rank.hpp"
+#include "cpu/fft_convolve.hpp"
+#include "cpu/overlap_save.hpp"
+#include "cpu/scratch_pool.hpp"
+
+#ifdef HAS_OPENCL
+#include "opencl/convolve.hpp"
+#endif
+
+namespace anyfold {
+
+  //a convolution with one kernel prepared for images of one shape: make_plan chooses
+  //the backend and does all the shape dependent work (kernel flip, decomposition or
+  //spectrum, scratch buffers, OpenCL context, program and device buffers) once, so
+  //execute() only does the compute; copies of a plan share that state, so a plan (and
+  //its copies) must not execute on two threads at the same time, fork() gives a plan
+  //that can
+  class plan {
+
+  public:
+
+    typedef std::function<void(const float*, float*)> executor;
+    //builds an executor for the given number of threads with scratch of its own, the
+    //kernel data it captures is shared by all executors
+    typedef std::function<executor(unsigned)> executor_factory;
+
+  private:
+
+    backend backend_;
+    std::vector<long> image_shape_;
+    std::vector<long> kernel_shape_;
+    unsigned num_threads_;
+    executor_factory factory_;
+    executor execute_;
+    //the single threaded forks execute_batch runs on, created by its first call and
+    //shared by all copies of the plan, whose batches take turns
+    std::shared_ptr<std::vector<plan> > workers_;
+    std::shared_ptr<std::mutex> batch_mutex_;
+
+  public:
+
+    //see make_plan
+    plan(backend _backend,
+	 const std::vector<long>& _image_shape, const std::vector<long>& _kernel_shape,
+	 const executor_factory& _factory,
+	 unsigned _num_threads):
+      backend_(_backend),
+      image_shape_(_image_shape),
+      kernel_shape_(_kernel_shape),
+      num_threads_(_num_threads),
+      factory_(_factory),
+      execute_(_factory(_num_threads)),
+      workers_(std::make_shared<std::vector<plan> >()),
+      batch_mutex_(std::make_shared<std::mutex>())
+    {}
+
+    backend chosen() const {
+      return backend_;
+    }
+
+    const std::vector<long>& image_shape() const {
+      return image_shape_;
+    }
+
+    const std::vector<long>& kernel_shape() const {
+      return kernel_shape_;
+    }
+
+    unsigned num_threads() const {
+      return num_threads_;
+    }
+
+    //convolves the c-ordered image at _src (of image_shape()) into _out, only the
+    //interior voxels are written like with convolve
+    void execute(const float* _src, float* _out) const {
+      execute_(_src, _out);
+    }
+
+    //the same convolution sharing the kernel data of this plan, but with scratch of its
+    //own and _num_threads threads, so that it can execute while this plan does; the
+    //OpenCL backends share their device buffers and can't run concurrently
+    plan fork(unsigned _num_threads) const {
+      return plan(backend_, image_shape_, kernel_shape_, factory_, _num_threads);
+    }
+
+    //number of single threaded forks execute_batch has built so far
+    std::size_t forks() const {
+      return workers_->size();
+    }
+
+    //convolves _count images: _src[i] into _out[i]; with at least as many images as
+    //threads (of the plan and of _pool) every thread convolves whole images on a fork
+    //of its own (no barrier between the images), otherwise the images are convolved
+    //one after the other with all threads; OpenCL plans always run the images one
+    //after the other
+    void execute_batch(const float* const* _src, float* const* _out, std::size_t _count,
+		       cpu::thread_pool& _pool = cpu::thread_pool::global()) const {
+
+      const unsigned threads = std::min(num_threads_, _pool.size());
+      if(threads < 2 || _count < threads || backend_ >= backend::opencl_buffer){
+	for(std::size_t i = 0;i<_count;++i)
+	  execute_(_src[i], _out[i]);
+	return;
+      }
+
+      std::lock_guard<std::mutex> batch_lock(*batch_mutex_);
+      for(unsigned w = workers_->size();w<threads;++w)
+	workers_->push_back(fork(1));
+
+      std::mutex idle_mutex;
+      std::vector<const plan*> idle;
+      for(unsigned w = 0;w<threads;++w)
+	idle.push_back(&(*workers_)[w]);
+
+      _pool.parallel_for(0, long(_count),
+			 [&](long _index){
+			   const plan* worker = nullptr;
+			   {
+			     std::lock_guard<std::mutex> lock(idle_mutex);
+			     worker = idle.back();
+			     idle.pop_back();
+			   }
+			   worker->execute(_src[_index], _out[_index]);
+			   std::lock_guard<std::mutex> lock(idle_mutex);
+			   idle.push_back(worker);
+			 },
+			 threads);
+    }
+
+    //convolves _count images stored _stride floats apart (a 4D volume with the image
+    //index slowest for _stride 0) from _src to _out
+    void execute_batch(const float* _src, float* _out, std::size_t _count, std::size_t _stride = 0,
+		       cpu::thread_pool& _pool = cpu::thread_pool::global()) const {
+
+      const std::size_t stride = _stride ? _stride : std::size_t(image_shape_[0]*image_shape_[1]*image_shape_[2]);
+      std::vector<const float*> src(_count);
+      std::vector<float*> out(_count);
+      for(std::size_t i = 0;i<_count;++i){
+	src[i] = _src + i*stride;
+	out[i] = _out + i*stride;
+      }
+      execute_batch(src.data(), out.data(), _count, _pool);
+    }
+  };
+
+  namespace detail {
+
+    //the flipped kernel and the line kernel of the vectorized and tiled backends
+    struct line_plan {
+      std::vector<float> flipped_;
+      cpu::line_geometry geometry_;
+      cpu::line_kernel line_;
+      std::vector<long> tile_;
+    };
+
+
+#ifdef HAS_OPENCL
+    //the buffer classes of a plan keep their device buffers for every execute and never
+    //wrap an image (the blank one of opencl_plan is gone before the first execute), the
+    //image classes always copy
+    inline void stage_host_memory(opencl::Convolution3DCLBuffer& _engine){
+      _engine.setHostMemory(opencl::HostMemory::staged);
+    }
+
+    inline void stage_host_memory(opencl::Convolution3DCLBufferLocalMem& _engine){
+      _engine.setHostMemory(opencl::HostMemory::staged);
+    }
+
+    template <typename ConvolutionT>
+    void stage_host_memory(ConvolutionT&){}
+
+    //sets up context, program and device buffers of one of the Convolution3DCL
+    //classes for images of _shape, execute uploads the image and reads the result back
+    template <typename ConvolutionT>
+    plan::executor_factory opencl_plan(const std::string& _file,
+							   const std::vector<long>& _shape,
+							   const float* _kernel, const std::vector<long>& _kernel_shape){
+
+      std::shared_ptr<ConvolutionT> engine = std::make_shared<ConvolutionT>();
+      engine->setupCLcontext();
+
+      anyfold::image_stack_cref kernel(_kernel, _kernel_shape);
+      engine->createProgramAndLoadKernel(_file, "convolution3d", kernel.shape());
+
+      std::vector<int> offsets(3);
+      for (unsigned i = 0; i < offsets.size(); ++i)
+	offsets[i] = _kernel_shape[i]/2;
+
+      //the buffers are created from a blank image, every execute uploads the real one
+      stage_host_memory(*engine);
+      cpu::scratch_buffer<float> blank(std::size_t(_shape[0])*_shape[1]*_shape[2]);
+      std::fill(blank.data(), blank.data() + blank.size(), 0.f);
+      engine->setupKernelArgs(anyfold::image_stack_cref(blank.data(), _shape), kernel, offsets);
+
+      const plan::executor execute = [engine, _shape](const float* _src, float* _out){
+	anyfold::image_stack_cref image(_src, _shape);
+	anyfold::image_stack_ref output(_out, _shape);
+	engine->uploadImage(image);
+	engine->execute();
+	engine->getResult(output);
+      };
+      return [execute](unsigned){ return execute; };
+    }
+#endif
+
+  };
+
+  //prepares the convolution of images of src_extents (c storage order) with the
+  //kernel, the backend is chosen like in convolve (_options.log_ receives the
+  //estimates); the kernel is copied or transformed, it doesn't need to outlive the plan
+  template <typename ExtentT>
+  plan make_plan(ExtentT* src_extents,
+		 const float* kernel_begin, ExtentT* kernel_extents,
+		 const convolve_options& _options = convolve_options())
+  {
+    const std::vector<long> shape(src_extents, src_extents + 3);
+    const std::vector<long> kernel_shape(kernel_extents, kernel_extents + 3);
+
+    std::shared_ptr<kernel_analysis> analysis = std::make_shared<kernel_analysis>();
+    analyse_kernel(src_extents, kernel_begin, kernel_extents, _options, *analysis);
+    const backend chosen = detail::choose_backend(src_extents, kernel_extents, *analysis, _options, "make_plan");
+
+    const unsigned threads = _options.num_threads_ ? _options.num_threads_ : cpu::thread_pool::global().size();
+    plan::executor_factory factory;
+
+    switch(chosen){
+    case backend::cpu_direct: {
+      std::shared_ptr<std::vector<float> > kernel = std::make_shared<std::vector<float> >(kernel_begin, kernel_begin + kernel_shape[0]*kernel_shape[1]*kernel_shape[2]);
+      factory = [kernel, shape, kernel_shape](unsigned _threads) -> plan::executor {
+	return [kernel, shape, kernel_shape, _threads](const float* _src, float* _out){
+	  long extents[3] = {shape[0], shape[1], shape[2]};
+	  long kernel_extents[3] = {kernel_shape[0], kernel_shape[1], kernel_shape[2]};
+	  cpu::parallel_convolve_3d(_src, extents, &(*kernel)[0], kernel_extents, _out, _threads);
+	};
+      };
+      break;
+    }
+    case backend::cpu_vectorized:
+    case backend::cpu_tiled: {
+      std::shared_ptr<detail::line_plan> lines = std::make_shared<detail::line_plan>();
+      lines->flipped_ = cpu::flip_kernel(kernel_begin, kernel_extents);
+      lines->geometry_.kernel_ = &lines->flipped_[0];
+      std::copy(kernel_shape.begin(), kernel_shape.end(), lines->geometry_.kernel_shape_);
+      lines->geometry_.line_stride_ = shape[2];
+      lines->geometry_.plane_stride_ = shape[1]*shape[2];
+      lines->line_ = cpu::select_line_kernel(cpu::best_instruction_set());
+
+      if(chosen == backend::cpu_vectorized){
+	factory = [lines, shape](unsigned _threads) -> plan::executor {
+	  return [lines, shape, _threads](const float* _src, float* _out){
+	    cpu::convolve_lines(_src, &shape[0], lines->geometry_, lines->line_, _out, _threads);
+	  };
+	};
+	break;
+      }
+
+      long interior[3];
+      for(int d = 0;d<3;++d)
+	interior[d] = std::max(1L, shape[d] - 2*(kernel_shape[d]/2));
+      lines->tile_ = cpu::choose_tile_shape(interior, &kernel_shape[0]);
+      factory = [lines, shape](unsigned _threads) -> plan::executor {
+	return [lines, shape, _threads](const float* _src, float* _out){
+	  cpu::convolve_tiles(_src, &shape[0], lines->geometry_, lines->line_, lines->tile_, _out, _threads);
+	};
+      };
+      break;
+    }
+    case backend::cpu_separable:
+    case backend::cpu_low_rank:
+      factory = [analysis, shape, chosen](unsigned _threads) -> plan::executor {
+	std::shared_ptr<cpu::separable_scratch> scratch = std::make_shared<cpu::separable_scratch>();
+	return [analysis, shape, chosen, scratch, _threads](const float* _src, float* _out){
+	  anyfold::image_stack_cref image(_src, shape);
+	  anyfold::image_stack_ref output(_out, shape);
+	  const std::vector<float>* factors = analysis->factors_;
+	  if(chosen == backend::cpu_separable)
+	    cpu::convolve_separable(image, factors[0], factors[1], factors[2], output, *scratch, _threads);
+	  else
+	    cpu::convolve_low_rank(image, analysis->terms_, output, *scratch, _threads);
+	};
+      };
+      break;
+    case backend::cpu_fft: {
+      std::shared_ptr<const cpu::fft_convolution> spectrum = std::make_shared<cpu::fft_convolution>(src_extents, kernel_begin, kernel_extents, threads);
+      factory = [spectrum](unsigned _threads) -> plan::executor {
+	std::shared_ptr<cpu::fft_convolution> fft = std::make_shared<cpu::fft_convolution>(*spectrum, _threads);
+	return [fft](const float* _src, float* _out){
+	  fft->convolve(_src, _out);
+	};
+      };
+      break;
+    }
+    case backend::cpu_overlap_save: {
+      std::shared_ptr<const cpu::overlap_save_convolution> spectrum =
+	std::make_shared<cpu::overlap_save_convolution>(src_extents, kernel_begin, kernel_extents, _options.memory_budget_, threads);
+      factory = [spectrum](unsigned _threads) -> plan::executor {
+	std::shared_ptr<cpu::overlap_save_convolution> blocks = std::make_shared<cpu::overlap_save_convolution>(*spectrum, _threads);
+	return [blocks](const float* _src, float* _out){
+	  blocks->convolve(_src, _out);
+	};
+      };
+      break;
+    }
+#ifdef HAS_OPENCL
+    case backend::opencl_buffer:
+      factory = detail::opencl_plan<opencl::Convolution3DCLBuffer>("convolution3dBuffer.cl", shape, kernel_begin, kernel_shape);
+      break;
+    case backend::opencl_buffer_local_mem:
+      factory = detail::opencl_plan<opencl::Convolution3DCLBufferLocalMem>("convolution3dBufferLocalMem.cl", shape, kernel_begin, kernel_shape);
+      break;
+    case backend::opencl_image:
+      factory = detail::opencl_plan<opencl::Convolution3DCLImage>("convolution3dImage.cl", shape, kernel_begin, kernel_shape);
+      break;
+    case backend::opencl_image_local_mem:
+      factory = detail::opencl_plan<opencl::Convolution3DCLImageLocalMem>("convolution3dImageLocalMem.cl", shape, kernel_begin, kernel_shape);
+      break;
+    case backend::opencl_separable: {
+      std::shared_ptr<opencl::Convolution3DCLSeparable> engine = std::make_shared<opencl::Convolution3DCLSeparable>();
+      engine->setupCLcontext();
+      engine->createProgramAndLoadKernel("convolution3dSeparable.cl",
+					 "convolution1d");
+      cpu::scratch_buffer<float> blank(std::size_t(shape[0])*shape[1]*shape[2]);
+      std::fill(blank.data(), blank.data() + blank.size(), 0.f);
+      engine->setupKernelArgs(anyfold::image_stack_cref(blank.data(), shape), analysis->factors_);
+
+      const plan::executor execute = [engine, shape](const float* _src, float* _out){
+	anyfold::image_stack_cref image(_src, shape);
+	anyfold::image_stack_ref output(_out, shape);
+	engine->uploadImage(image);
+	engine->execute();
+	engine->getResult(output);
+      };
+      factory = [execute](unsigned){ return execute; };
+      break;
+    }
+#endif
+    default: {
+      std::ostringstream msg;
+      msg << "[anyfold::make_plan]\tno plan for backend " << name(chosen) << "\n";
+      throw std::runtime_error(msg.str().c_str());
+    }
+    }
+
+    return plan(chosen, shape, kernel_shape, factory, threads);
+  }
+
+  //convolves _count images of src_extents (_src[i] into _out[i]) with one kernel: the
+  //kernel is prepared once by make_plan and the images are spread over the threads (of
+  //_pool) by plan::execute_batch; returns the backend used
+  template <typename ExtentT>
+  backend convolve_batch(const float* const* _src, float* const* _out, std::size_t _count,
+			 ExtentT* src_extents,
+			 const float* kernel_begin, ExtentT* kernel_extents,
+			 const convolve_options& _options = convolve_options(),
+			 cpu::thread_pool& _pool = cpu::thread_pool::global())
+  {
+    const plan prepared = make_plan(src_extents, kernel_begin, kernel_extents, _options);
+    prepared.execute_batch(_src, _out, _count, _pool);
+    return prepared.chosen();
+  }
+
+  //same for _count images stored _stride floats apart (0 for a packed 4D volume with
+  //the image index slowest)
+  template <typename ExtentT>
+  backend convolve_batch(const float* _src, float* _out, std::size_t _count, std::size_t _stride,
+			 ExtentT* src_extents,
+			 const float* kernel_begin, ExtentT* kernel_extents,
+			 const convolve_options& _options = convolve_options(),
+			 cpu::thread_pool& _pool = cpu::thread_pool::global())
+  {
+    const plan prepared = make_plan(src_extents, kernel_begin, kernel_extents, _options);
+    prepared.execute_batch(_src, _out, _count, _stride, _pool);
+    return prepared.chosen();
+  }
+
+};
+
+#endif /* _ANYFOLD_PLAN_HPP_ */
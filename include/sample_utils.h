@@ -0,0 +1,195 @@
+#ifndef _SAMPLE_UTILS_H_
+#define _SAMPLE_UTILS_H_
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <limits>
+
+namespace anyfold {
+
+//storage formats of image voxels, computation is always done in float
+enum class sample_type {
+  fp32 = 0,
+  fp16,
+  bf16,
+  u8,
+  u16
+};
+
+inline const char* name(sample_type _type){
+  switch(_type){
+  case sample_type::fp16:
+    return "fp16";
+  case sample_type::bf16:
+    return "bf16";
+  case sample_type::u8:
+    return "u8";
+  case sample_type::u16:
+    return "u16";
+  default:
+    return "fp32";
+  }
+}
+
+//IEEE 754 binary16, only used for storage
+struct float16 {
+  std::uint16_t bits_;
+};
+
+//the upper half of a float, only used for storage
+struct bfloat16 {
+  std::uint16_t bits_;
+};
+
+inline std::uint32_t float_bits(float _value){
+  std::uint32_t bits;
+  std::memcpy(&bits, &_value, sizeof(bits));
+  return bits;
+}
+
+inline float bits_float(std::uint32_t _bits){
+  float value;
+  std::memcpy(&value, &_bits, sizeof(value));
+  return value;
+}
+
+inline float to_float(float _value){
+  return _value;
+}
+
+inline float to_float(float16 _value){
+
+  const std::uint32_t sign = std::uint32_t(_value.bits_ & 0x8000) << 16;
+  std::uint32_t exponent = (_value.bits_ >> 10) & 0x1f;
+  std::uint32_t mantissa = _value.bits_ & 0x3ff;
+
+  if(exponent == 0x1f)
+    return bits_float(sign | 0x7f800000 | (mantissa << 13));
+  if(exponent)
+    return bits_float(sign | ((exponent + 112) << 23) | (mantissa << 13));
+  if(!mantissa)
+    return bits_float(sign);
+
+  //subnormal, normalized for the wider exponent of float
+  exponent = 113;
+  while(!(mantissa & 0x400)){
+    mantissa <<= 1;
+    --exponent;
+  }
+  return bits_float(sign | (exponent << 23) | ((mantissa & 0x3ff) << 13));
+}
+
+inline float to_float(bfloat16 _value){
+  return bits_float(std::uint32_t(_value.bits_) << 16);
+}
+
+inline float to_float(std::uint8_t _value){
+  return _value;
+}
+
+inline float to_float(std::uint16_t _value){
+  return _value;
+}
+
+//rounds to nearest even, out of range values become infinite
+inline float16 to_float16(float _value){
+
+  std::uint32_t bits = float_bits(_value);
+  const std::uint16_t sign = (bits >> 16) & 0x8000;
+  bits &= 0x7fffffff;
+  float16 value;
+
+  if(bits >= 0x7f800000){
+    value.bits_ = sign | 0x7c00 | (bits > 0x7f800000 ? 0x200 : 0);
+    return value;
+  }
+  //65520 and above round to infinity
+  if(bits >= 0x477ff000){
+    value.bits_ = sign | 0x7c00;
+    return value;
+  }
+  //below the smallest normal binary16 2^-14
+  if(bits < 0x38800000){
+    if(bits < 0x33000000){
+      value.bits_ = sign;
+      return value;
+    }
+    const int shift = 126 - int(bits >> 23);
+    const std::uint32_t mantissa = (bits & 0x7fffff) | 0x800000;
+    const std::uint32_t rest = mantissa & ((1u << shift) - 1);
+    const std::uint32_t halfway = 1u << (shift - 1);
+    std::uint32_t result = mantissa >> shift;
+    if(rest > halfway || (rest == halfway && (result & 1)))
+      ++result;
+    value.bits_ = sign | result;
+    return value;
+  }
+
+  //rebias the exponent from 127 to 15, a carry of the rounding moves into the exponent
+  bits -= 0x38000000;
+  std::uint32_t result = bits >> 13;
+  const std::uint32_t rest = bits & 0x1fff;
+  if(rest > 0x1000 || (rest == 0x1000 && (result & 1)))
+    ++result;
+  value.bits_ = sign | result;
+  return value;
+}
+
+//rounds to nearest even, nan stays nan
+inline bfloat16 to_bfloat16(float _value){
+
+  const std::uint32_t bits = float_bits(_value);
+  bfloat16 value;
+  if((bits & 0x7fffffff) > 0x7f800000)
+    value.bits_ = (bits >> 16) | 0x40;
+  else
+    value.bits_ = (bits + 0x7fff + ((bits >> 16) & 1)) >> 16;
+  return value;
+}
+
+//the sample_type of a storage type
+template <typename T> struct sample_traits;
+
+template <> struct sample_traits<float> {
+  static const sample_type type = sample_type::fp32;
+};
+
+template <> struct sample_traits<float16> {
+  static const sample_type type = sample_type::fp16;
+};
+
+template <> struct sample_traits<bfloat16> {
+  static const sample_type type = sample_type::bf16;
+};
+
+template <> struct sample_traits<std::uint8_t> {
+  static const sample_type type = sample_type::u8;
+};
+
+template <> struct sample_traits<std::uint16_t> {
+  static const sample_type type = sample_type::u16;
+};
+
+inline std::size_t sample_size(sample_type _type){
+  switch(_type){
+  case sample_type::fp32:
+    return sizeof(float);
+  case sample_type::u8:
+    return sizeof(std::uint8_t);
+  default:
+    return sizeof(std::uint16_t);
+  }
+}
+
+//integer samples from a float: rounded to nearest even and clamped to the range of
+//the type, nan becomes 0
+template <typename IntT>
+IntT saturate_sample(float _value){
+  const float top = float(std::numeric_limits<IntT>::max());
+  const float clamped = _value > 0.f ? (_value < top ? _value : top) : 0.f;
+  return IntT(std::nearbyint(clamped));
+}
+
+} /* namespace anyfold */
+
+#endif /* _SAMPLE_UTILS_H_ */
@@ -1,7 +1,9 @@
 #include <iostream>
-#include <fstream>
+#include <stdexcept>
 
 #include "opencl/convolution3DCLBuffer.hpp"
+#include "opencl/runtime.hpp"
+#include "opencl/sources.hpp"
 
 namespace anyfold {
 
@@ -45,29 +47,14 @@ std::string Convolution3DCLBuffer::getDeviceInfo(cl::Device device, cl_device_in
 
 void Convolution3DCLBuffer::createProgramAndLoadKernel(const std::string& fileName, const std::string& kernelName, size_t const* filterSize)
 {
-	std::string content;
-	std::ifstream in(fileName, std::ios::in);
-	if(in)
-	{
-		in.seekg(0, std::ios::end);
-		content.resize(in.tellg());
-		in.seekg(0, std::ios::beg);
-		in.read(&content[0], content.size());
-		in.close();
-	}
-
-	createProgram(content, filterSize);
+	// the kernels are compiled into the library, see opencl/sources.hpp
+	createProgram(kernelSource(fileName), filterSize);
 	loadKernel(kernelName);
 }
 
 void Convolution3DCLBuffer::createProgram(const std::string& source, 
                                     size_t const* fs)
 {
-	cl::Program::Sources program_source(1, std::make_pair(source.c_str(), source.length()));
-
-	program = cl::Program(context, program_source, &status);
-	CHECK_ERROR(status, "cl::Program");
-	
 	std::string defines = std::string("-D FILTER_SIZE_X=") +
 	                      std::to_string(fs[2]) +
 	                      std::string(" -D FILTER_SIZE_Y=") +
@@ -80,17 +67,24 @@ void Convolution3DCLBuffer::createProgram(const std::string& source,
 	                      std::to_string(fs[1]/2) +
 	                      std::string(" -D FILTER_SIZE_Z_HALF=") +
 	                      std::to_string(fs[0]/2);
-	status = program.build(devices,
-	                       defines.c_str(),
-	                       nullptr, nullptr);
-
-	std::string log;
-	program.getBuildInfo(devices[0],CL_PROGRAM_BUILD_LOG,&log);
-	if(log.size() > 0)
-	{
-		std::cout << log << std::endl;
-	}
-	CHECK_ERROR(status, "cl::Program::Build");
+	if(sampleType == sample_type::fp16)
+		defines += " -D STORAGE_HALF";
+	else if(sampleType == sample_type::bf16)
+		defines += " -D STORAGE_BF16";
+	else if(sampleType == sample_type::u8)
+		defines += " -D STORAGE_U8";
+	else if(sampleType == sample_type::u16)
+		defines += " -D STORAGE_U16";
+	if(resultType == sample_type::fp16)
+		defines += " -D RESULT_HALF";
+	else if(resultType == sample_type::bf16)
+		defines += " -D RESULT_BF16";
+	else if(resultType == sample_type::u8)
+		defines += " -D RESULT_U8";
+	else if(resultType == sample_type::u16)
+		defines += " -D RESULT_U16";
+	// compiled once per source, defines and device, see Runtime::buildProgram
+	program = Runtime::global().buildProgram(source, defines);
 }
 
 void Convolution3DCLBuffer::loadKernel(const std::string& kernelName)
@@ -99,18 +93,36 @@ void Convolution3DCLBuffer::loadKernel(const std::string& kernelName)
 	CHECK_ERROR(status, "cl::Kernel");
 }
 
-bool Convolution3DCLBuffer::setupCLcontext()
+void Convolution3DCLBuffer::setSampleType(sample_type type)
 {
-	status = cl::Platform::get(&platforms);
+	sampleType = type;
+	resultType = type;
+}
 
-	status = platforms[0].getDevices(CL_DEVICE_TYPE_GPU,&devices);
-	CHECK_ERROR(status, "cl::Platform::getDevices");
+void Convolution3DCLBuffer::setResultType(sample_type type)
+{
+	resultType = type;
+}
 
-	context = cl::Context(devices,nullptr,nullptr,nullptr,&status);
-	CHECK_ERROR(status, "cl::Context");
+void Convolution3DCLBuffer::setScaling(float scale, float offset)
+{
+	resultScale = scale;
+	resultOffset = offset;
+}
 
-	queue = cl::CommandQueue(context,devices[0],0,&status);
-	CHECK_ERROR(status, "cl::CommandQueue");
+void Convolution3DCLBuffer::setHostMemory(HostMemory mode)
+{
+	hostMemory = mode;
+}
+
+bool Convolution3DCLBuffer::setupCLcontext()
+{
+	// created once per process and shared by all convolutions
+	const Runtime& runtime = Runtime::global();
+	platforms.assign(1, runtime.platform());
+	devices = runtime.devices();
+	context = runtime.context();
+	queue = runtime.queue();
 
 	return true;
 }
@@ -119,9 +131,19 @@ void Convolution3DCLBuffer::setupKernelArgs(image_stack_cref image,
                                       image_stack_cref filterKernel,
                                       const std::vector<int>& offset)
 {
-	imageSize[0] = image.shape()[2];
-	imageSize[1] = image.shape()[1];
-	imageSize[2] = image.shape()[0];
+	if(sampleType != sample_type::fp32)
+		throw std::runtime_error("[anyfold::opencl::Convolution3DCLBuffer]\tfloat image given for samples of another type\n");
+	const std::size_t shape[3] = {image.shape()[0], image.shape()[1], image.shape()[2]};
+	setupKernelArgs(image.data(), shape, filterKernel, offset);
+}
+
+void Convolution3DCLBuffer::setupKernelArgs(const void* samples, const std::size_t* shape,
+                                      image_stack_cref filterKernel,
+                                      const std::vector<int>& offset)
+{
+	imageSize[0] = shape[2];
+	imageSize[1] = shape[1];
+	imageSize[2] = shape[0];
 	filterSize[0] = filterKernel.shape()[2];
 	filterSize[1] = filterKernel.shape()[1];
 	filterSize[2] = filterKernel.shape()[0];
@@ -129,17 +151,31 @@ void Convolution3DCLBuffer::setupKernelArgs(image_stack_cref image,
 	imageSizeInner[1] = imageSize[1]-2*(filterSize[1]/2);
 	imageSizeInner[2] = imageSize[2]-2*(filterSize[2]/2);
 
-	inputBuffer = cl::Buffer(context,
-	                         CL_MEM_READ_ONLY |
-	                         CL_MEM_COPY_HOST_PTR,
-	                         sizeof(float) * image.num_elements(),
-	                         const_cast<float*>(image.data()), &status);
-	CHECK_ERROR(status, "cl::Buffer");
+	const std::size_t sampleSize = sample_size(sampleType);
+	zeroCopy = Runtime::global().zeroCopy(hostMemory);
+	if(zeroCopy)
+	{
+		bool wraps = false;
+		inputBuffer = Runtime::global().hostBuffer(samples, sampleSize * shape[0] * shape[1] * shape[2], wraps,
+		                                           hostMemory != HostMemory::staged);
+		hostInput = wraps ? samples : nullptr;
+	}
+	else
+	{
+		inputBuffer = cl::Buffer(context,
+		                         CL_MEM_READ_ONLY |
+		                         CL_MEM_COPY_HOST_PTR,
+		                         sampleSize * shape[0] * shape[1] * shape[2],
+		                         const_cast<void*>(samples), &status);
+		CHECK_ERROR(status, "cl::Buffer");
+	}
 
+	// with zero copy the result is mapped instead of read, see getResultSamples
 	size_t imageSizeInnerTotal = imageSizeInner[0] * imageSizeInner[1] * imageSizeInner[2];
 	outputBuffer = cl::Buffer(context,
-	                          CL_MEM_WRITE_ONLY,
-	                          sizeof(float) * imageSizeInnerTotal,
+	                          CL_MEM_WRITE_ONLY |
+	                          (zeroCopy ? CL_MEM_ALLOC_HOST_PTR : 0),
+	                          sample_size(resultType) * imageSizeInnerTotal,
 	                          nullptr, &status);
 	CHECK_ERROR(status, "cl::Buffer");
 
@@ -153,6 +189,40 @@ void Convolution3DCLBuffer::setupKernelArgs(image_stack_cref image,
 	kernel.setArg(0,inputBuffer);
 	kernel.setArg(1,filterWeightsBuffer);
 	kernel.setArg(2,outputBuffer);
+	kernel.setArg(3,resultScale);
+	kernel.setArg(4,resultOffset);
+}
+
+void Convolution3DCLBuffer::uploadImage(image_stack_cref image)
+{
+	if(sampleType != sample_type::fp32)
+		throw std::runtime_error("[anyfold::opencl::Convolution3DCLBuffer]\tfloat image given for samples of another type\n");
+	uploadSamples(image.data());
+}
+
+void Convolution3DCLBuffer::uploadSamples(const void* samples)
+{
+	const std::size_t bytes = sample_size(sampleType) * imageSize[0] * imageSize[1] * imageSize[2];
+	if(!zeroCopy)
+	{
+		status = queue.enqueueWriteBuffer(inputBuffer, CL_TRUE, 0, bytes, samples);
+		CHECK_ERROR(status, "Queue::enqueueWriteBuffer");
+		return;
+	}
+
+	// the wrapped image is only synchronized, a copy is refilled (always when
+	// staged), another image gets a buffer of its own (the previous one is
+	// never written to)
+	const Runtime& runtime = Runtime::global();
+	if(samples == hostInput || (!hostInput && (hostMemory == HostMemory::staged || !runtime.wrappable(samples))))
+	{
+		runtime.writeMapped(inputBuffer, samples, bytes);
+		return;
+	}
+	bool wraps = false;
+	inputBuffer = runtime.hostBuffer(samples, bytes, wraps);
+	hostInput = wraps ? samples : nullptr;
+	kernel.setArg(0,inputBuffer);
 }
 
 void Convolution3DCLBuffer::execute()
@@ -166,28 +236,47 @@ void Convolution3DCLBuffer::execute()
 
 void Convolution3DCLBuffer::getResult(image_stack_ref result)
 {
+	if(resultType != sample_type::fp32)
+		throw std::runtime_error("[anyfold::opencl::Convolution3DCLBuffer]\tfloat result requested for samples of another type\n");
+	getResultSamples(result.data());
+}
+
+void Convolution3DCLBuffer::getResultSamples(void* result)
+{
+	const std::size_t sampleSize = sample_size(resultType);
 	cl::size_t<3> bufOffset;
 	bufOffset[0] = 0;
 	bufOffset[1] = 0;
 	bufOffset[2] = 0;
 	cl::size_t<3> hostOffset;
-	hostOffset[0] = (filterSize[0]/2)*sizeof(float);
+	hostOffset[0] = (filterSize[0]/2)*sampleSize;
 	hostOffset[1] = filterSize[1]/2;
 	hostOffset[2] = filterSize[2]/2;
 	cl::size_t<3> region;
-	region[0] = imageSizeInner[0]*sizeof(float);
+	region[0] = imageSizeInner[0]*sampleSize;
 	region[1] = imageSizeInner[1];
 	region[2] = imageSizeInner[2];
 
+	if(zeroCopy)
+	{
+		const std::size_t mappedRegion[3] = {region[0], region[1], region[2]};
+		const std::size_t mappedOffset[3] = {hostOffset[0], hostOffset[1], hostOffset[2]};
+		Runtime::global().readMappedRect(outputBuffer, mappedRegion, mappedOffset,
+		                                 imageSize[0] * sampleSize,
+		                                 imageSize[0] * imageSize[1] * sampleSize,
+		                                 result);
+		return;
+	}
+
 	status = queue.enqueueReadBufferRect(outputBuffer, CL_TRUE,
 	                                     bufOffset,
 	                                     hostOffset,
 	                                     region,
-	                                     imageSizeInner[0] * sizeof(float),
-	                                     imageSizeInner[0] * imageSizeInner[1] * sizeof(float),
-	                                     imageSize[0] * sizeof(float),
-	                                     imageSize[0] * imageSize[1] * sizeof(float),
-	                                     result.data());
+	                                     imageSizeInner[0] * sampleSize,
+	                                     imageSizeInner[0] * imageSizeInner[1] * sampleSize,
+	                                     imageSize[0] * sampleSize,
+	                                     imageSize[0] * imageSize[1] * sampleSize,
+	                                     result);
 	CHECK_ERROR(status, "Queue::enqueueReadBufferRect");
 }
 
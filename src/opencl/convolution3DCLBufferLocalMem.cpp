@@ -1,7 +1,8 @@
 #include <iostream>
-#include <fstream>
 
 #include "opencl/convolution3DCLBufferLocalMem.hpp"
+#include "opencl/runtime.hpp"
+#include "opencl/sources.hpp"
 
 namespace anyfold {
 
@@ -45,29 +46,14 @@ std::string Convolution3DCLBufferLocalMem::getDeviceInfo(cl::Device device, cl_d
 
 void Convolution3DCLBufferLocalMem::createProgramAndLoadKernel(const std::string& fileName, const std::string& kernelName, size_t const* filterSize)
 {
-	std::string content;
-	std::ifstream in(fileName, std::ios::in);
-	if(in)
-	{
-		in.seekg(0, std::ios::end);
-		content.resize(in.tellg());
-		in.seekg(0, std::ios::beg);
-		in.read(&content[0], content.size());
-		in.close();
-	}
-
-	createProgram(content, filterSize);
+	// the kernels are compiled into the library, see opencl/sources.hpp
+	createProgram(kernelSource(fileName), filterSize);
 	loadKernel(kernelName);
 }
 
 void Convolution3DCLBufferLocalMem::createProgram(const std::string& source, 
                                     size_t const* fs)
 {
-	cl::Program::Sources program_source(1, std::make_pair(source.c_str(), source.length()));
-
-	program = cl::Program(context, program_source, &status);
-	CHECK_ERROR(status, "cl::Program");
-	
 	std::string defines = std::string("-D FILTER_SIZE_X=") +
 	                      std::to_string(fs[2]) +
 	                      std::string(" -D FILTER_SIZE_Y=") +
@@ -80,17 +66,8 @@ void Convolution3DCLBufferLocalMem::createProgram(const std::string& source,
 	                      std::to_string(fs[1]/2) +
 	                      std::string(" -D FILTER_SIZE_Z_HALF=") +
 	                      std::to_string(fs[0]/2);
-	status = program.build(devices,
-	                       defines.c_str(),
-	                       nullptr, nullptr);
-
-	std::string log;
-	program.getBuildInfo(devices[0],CL_PROGRAM_BUILD_LOG,&log);
-	if(log.size() > 0)
-	{
-		std::cout << log << std::endl;
-	}
-	CHECK_ERROR(status, "cl::Program::Build");
+	// compiled once per source, defines and device, see Runtime::buildProgram
+	program = Runtime::global().buildProgram(source, defines);
 }
 
 void Convolution3DCLBufferLocalMem::loadKernel(const std::string& kernelName)
@@ -101,20 +78,21 @@ void Convolution3DCLBufferLocalMem::loadKernel(const std::string& kernelName)
 
 bool Convolution3DCLBufferLocalMem::setupCLcontext()
 {
-	status = cl::Platform::get(&platforms);
-
-	status = platforms[0].getDevices(CL_DEVICE_TYPE_GPU,&devices);
-	CHECK_ERROR(status, "cl::Platform::getDevices");
-
-	context = cl::Context(devices,nullptr,nullptr,nullptr,&status);
-	CHECK_ERROR(status, "cl::Context");
-
-	queue = cl::CommandQueue(context,devices[0],0,&status);
-	CHECK_ERROR(status, "cl::CommandQueue");
+	// created once per process and shared by all convolutions
+	const Runtime& runtime = Runtime::global();
+	platforms.assign(1, runtime.platform());
+	devices = runtime.devices();
+	context = runtime.context();
+	queue = runtime.queue();
 
 	return true;
 }
 
+void Convolution3DCLBufferLocalMem::setHostMemory(HostMemory mode)
+{
+	hostMemory = mode;
+}
+
 void Convolution3DCLBufferLocalMem::setupKernelArgs(image_stack_cref image,
                                       image_stack_cref filterKernel,
                                       const std::vector<int>& offset)
@@ -129,16 +107,29 @@ void Convolution3DCLBufferLocalMem::setupKernelArgs(image_stack_cref image,
 	imageSizeInner[1] = imageSize[1]-2*(filterSize[1]/2);
 	imageSizeInner[2] = imageSize[2]-2*(filterSize[2]/2);
 
-	inputBuffer = cl::Buffer(context,
-	                         CL_MEM_READ_ONLY |
-	                         CL_MEM_COPY_HOST_PTR,
-	                         sizeof(float) * image.num_elements(),
-	                         const_cast<float*>(image.data()), &status);
-	CHECK_ERROR(status, "cl::Buffer");
+	zeroCopy = Runtime::global().zeroCopy(hostMemory);
+	if(zeroCopy)
+	{
+		bool wraps = false;
+		inputBuffer = Runtime::global().hostBuffer(image.data(), sizeof(float) * image.num_elements(), wraps,
+		                                           hostMemory != HostMemory::staged);
+		hostInput = wraps ? image.data() : nullptr;
+	}
+	else
+	{
+		inputBuffer = cl::Buffer(context,
+		                         CL_MEM_READ_ONLY |
+		                         CL_MEM_COPY_HOST_PTR,
+		                         sizeof(float) * image.num_elements(),
+		                         const_cast<float*>(image.data()), &status);
+		CHECK_ERROR(status, "cl::Buffer");
+	}
 
+	// with zero copy the result is mapped instead of read, see getResult
+	const cl_mem_flags outputFlags = CL_MEM_WRITE_ONLY | (zeroCopy ? CL_MEM_ALLOC_HOST_PTR : 0);
 	size_t imageSizeInnerTotal = imageSizeInner[0] * imageSizeInner[1] * imageSizeInner[2];
 	outputBuffer[0] = cl::Buffer(context,
-	                             CL_MEM_WRITE_ONLY,
+	                             outputFlags,
 	                             sizeof(float) * imageSizeInnerTotal,
 	                             nullptr, &status);
 	CHECK_ERROR(status, "cl::Buffer");
@@ -147,7 +138,7 @@ void Convolution3DCLBufferLocalMem::setupKernelArgs(image_stack_cref image,
 	queue.enqueueFillBuffer(outputBuffer[0], val, 0, sizeof(float) * imageSizeInnerTotal);
 
 	outputBuffer[1] = cl::Buffer(context,
-	                             CL_MEM_WRITE_ONLY,
+	                             outputFlags,
 	                             sizeof(float) * imageSizeInnerTotal,
 	                             nullptr, &status);
 	CHECK_ERROR(status, "cl::Buffer");
@@ -164,6 +155,35 @@ void Convolution3DCLBufferLocalMem::setupKernelArgs(image_stack_cref image,
 	kernel.setArg(2,outputBuffer[0]);
 }
 
+void Convolution3DCLBufferLocalMem::uploadImage(image_stack_cref image)
+{
+	const std::size_t bytes = sizeof(float) * image.num_elements();
+	const Runtime& runtime = Runtime::global();
+	if(!zeroCopy)
+	{
+		status = queue.enqueueWriteBuffer(inputBuffer, CL_TRUE, 0, bytes, image.data());
+		CHECK_ERROR(status, "Queue::enqueueWriteBuffer");
+	}
+	// the wrapped image is only synchronized, a copy is refilled (always when
+	// staged), another image gets a buffer of its own
+	else if(image.data() == hostInput ||
+	        (!hostInput && (hostMemory == HostMemory::staged || !runtime.wrappable(image.data()))))
+		runtime.writeMapped(inputBuffer, image.data(), bytes);
+	else
+	{
+		bool wraps = false;
+		inputBuffer = runtime.hostBuffer(image.data(), bytes, wraps);
+		hostInput = wraps ? image.data() : nullptr;
+		kernel.setArg(0,inputBuffer);
+	}
+
+	// execute() accumulates into the first output buffer
+	const std::size_t imageSizeInnerTotal = imageSizeInner[0] * imageSizeInner[1] * imageSizeInner[2];
+	cl_float val = 0.0f;
+	status = queue.enqueueFillBuffer(outputBuffer[0], val, 0, sizeof(float) * imageSizeInnerTotal);
+	CHECK_ERROR(status, "Queue::enqueueFillBuffer");
+}
+
 void Convolution3DCLBufferLocalMem::execute()
 {
 	bool d = 0;
@@ -211,6 +231,17 @@ void Convolution3DCLBufferLocalMem::getResult(image_stack_ref result)
 	region[1] = imageSizeInner[1];
 	region[2] = imageSizeInner[2];
 
+	if(zeroCopy)
+	{
+		const std::size_t mappedRegion[3] = {region[0], region[1], region[2]};
+		const std::size_t mappedOffset[3] = {hostOffset[0], hostOffset[1], hostOffset[2]};
+		Runtime::global().readMappedRect(outputBuffer[outputSwap], mappedRegion, mappedOffset,
+		                                 imageSize[0] * sizeof(float),
+		                                 imageSize[0] * imageSize[1] * sizeof(float),
+		                                 result.data());
+		return;
+	}
+
 	status = queue.enqueueReadBufferRect(outputBuffer[outputSwap], CL_TRUE,
 	                                     bufOffset,
 	                                     hostOffset,
@@ -1,7 +1,8 @@
 #include <iostream>
-#include <fstream>
 
 #include "opencl/convolution3DCLImage.hpp"
+#include "opencl/runtime.hpp"
+#include "opencl/sources.hpp"
 
 namespace anyfold {
 
@@ -45,29 +46,14 @@ std::string Convolution3DCLImage::getDeviceInfo(cl::Device device, cl_device_inf
 
 void Convolution3DCLImage::createProgramAndLoadKernel(const std::string& fileName,const std::string& kernelName, size_t const* filterSize)
 {
-	std::string content;
-	std::ifstream in(fileName, std::ios::in);
-	if(in)
-	{
-		in.seekg(0, std::ios::end);
-		content.resize(in.tellg());
-		in.seekg(0, std::ios::beg);
-		in.read(&content[0], content.size());
-		in.close();
-	}
-
-	createProgram(content,filterSize);
+	// the kernels are compiled into the library, see opencl/sources.hpp
+	createProgram(kernelSource(fileName),filterSize);
 	loadKernel(kernelName);
 }
 
 void Convolution3DCLImage::createProgram(const std::string& source, 
                                     size_t const* fs)
 {
-	cl::Program::Sources program_source(1, std::make_pair(source.c_str(), source.length()));
-
-	program = cl::Program(context, program_source, &status);
-	CHECK_ERROR(status, "cl::Program");
-
 	std::string defines = std::string("-D FILTER_SIZE_X=") +
 	                      std::to_string(fs[2]) +
 	                      std::string(" -D FILTER_SIZE_Y=") +
@@ -80,18 +66,8 @@ void Convolution3DCLImage::createProgram(const std::string& source,
 	                      std::to_string(fs[1]/2) +
 	                      std::string(" -D FILTER_SIZE_Z_HALF=") +
 	                      std::to_string(fs[0]/2);
-	status = program.build(devices,
-	                       defines.c_str(),
-	                       nullptr, nullptr);
-
-	CHECK_ERROR(status, "cl::Program::Build");
-
-	std::string log;
-	program.getBuildInfo(devices[0],CL_PROGRAM_BUILD_LOG,&log);
-	if(log.size() > 0)
-	{
-		std::cout << log << std::endl;
-	}
+	// compiled once per source, defines and device, see Runtime::buildProgram
+	program = Runtime::global().buildProgram(source, defines);
 }
 
 void Convolution3DCLImage::loadKernel(const std::string& kernelName)
@@ -102,16 +78,12 @@ void Convolution3DCLImage::loadKernel(const std::string& kernelName)
 
 bool Convolution3DCLImage::setupCLcontext()
 {
-	status = cl::Platform::get(&platforms);
-
-	status = platforms[0].getDevices(CL_DEVICE_TYPE_ALL,&devices);
-	CHECK_ERROR(status, "cl::Platform::getDevices");
-
-	context = cl::Context(devices,nullptr,nullptr,nullptr,&status);
-	CHECK_ERROR(status, "cl::Context");
-
-	queue = cl::CommandQueue(context,devices[0],0,&status);
-	CHECK_ERROR(status, "cl::CommandQueue");
+	// created once per process and shared by all convolutions
+	const Runtime& runtime = Runtime::global();
+	platforms.assign(1, runtime.platform());
+	devices = runtime.devices();
+	context = runtime.context();
+	queue = runtime.queue();
 
 	return true;
 }
@@ -152,6 +124,22 @@ void Convolution3DCLImage::setupKernelArgs(image_stack_cref image,
 	kernel.setArg(2,outputImage);
 }
 
+void Convolution3DCLImage::uploadImage(image_stack_cref image)
+{
+	cl::size_t<3> origin;
+	origin[0] = 0;
+	origin[1] = 0;
+	origin[2] = 0;
+	cl::size_t<3> region;
+	region[0] = imageSize[0];
+	region[1] = imageSize[1];
+	region[2] = imageSize[2];
+	status = queue.enqueueWriteImage(inputImage, CL_TRUE,
+	                                 origin, region, 0, 0,
+	                                 const_cast<float*>(image.data()));
+	CHECK_ERROR(status, "Queue::enqueueWriteImage");
+}
+
 void Convolution3DCLImage::execute()
 {
 	queue.enqueueNDRangeKernel(kernel,0,cl::NDRange(imageSize[0],
@@ -1,7 +1,8 @@
 #include <iostream>
-#include <fstream>
 
 #include "opencl/convolution3DCLImageLocalMem.hpp"
+#include "opencl/runtime.hpp"
+#include "opencl/sources.hpp"
 
 namespace anyfold {
 
@@ -45,29 +46,14 @@ std::string Convolution3DCLImageLocalMem::getDeviceInfo(cl::Device device, cl_de
 
 void Convolution3DCLImageLocalMem::createProgramAndLoadKernel(const std::string& fileName,const std::string& kernelName, size_t const* filterSize)
 {
-	std::string content;
-	std::ifstream in(fileName, std::ios::in);
-	if(in)
-	{
-		in.seekg(0, std::ios::end);
-		content.resize(in.tellg());
-		in.seekg(0, std::ios::beg);
-		in.read(&content[0], content.size());
-		in.close();
-	}
-
-	createProgram(content,filterSize);
+	// the kernels are compiled into the library, see opencl/sources.hpp
+	createProgram(kernelSource(fileName),filterSize);
 	loadKernel(kernelName);
 }
 
 void Convolution3DCLImageLocalMem::createProgram(const std::string& source, 
                                     size_t const* filterSize)
 {
-	cl::Program::Sources program_source(1, std::make_pair(source.c_str(), source.length()));
-
-	program = cl::Program(context, program_source, &status);
-	CHECK_ERROR(status, "cl::Program");
-
 	std::string defines = std::string("-D FILTER_SIZE_X=") +
 	                        std::to_string(filterSize[2]) +
 	                      std::string(" -D FILTER_SIZE_Y=") +
@@ -80,17 +66,8 @@ void Convolution3DCLImageLocalMem::createProgram(const std::string& source,
 	                        std::to_string(filterSize[1]/2) +
 	                      std::string(" -D FILTER_SIZE_Z_HALF=") +
 	                        std::to_string(filterSize[0]/2);
-	status = program.build(devices,
-	                       defines.c_str(),
-	                       nullptr, nullptr);
-
-	std::string log;
-	program.getBuildInfo(devices[0],CL_PROGRAM_BUILD_LOG,&log);
-	if(log.size() > 0)
-	{
-		std::cout << log << std::endl;
-	}
-	CHECK_ERROR(status, "cl::Program::Build");
+	// compiled once per source, defines and device, see Runtime::buildProgram
+	program = Runtime::global().buildProgram(source, defines);
 }
 
 void Convolution3DCLImageLocalMem::loadKernel(const std::string& kernelName)
@@ -101,16 +78,12 @@ void Convolution3DCLImageLocalMem::loadKernel(const std::string& kernelName)
 
 bool Convolution3DCLImageLocalMem::setupCLcontext()
 {
-	status = cl::Platform::get(&platforms);
-
-	status = platforms[0].getDevices(CL_DEVICE_TYPE_GPU,&devices);
-	CHECK_ERROR(status, "cl::Platform::getDevices");
-
-	context = cl::Context(devices,nullptr,nullptr,nullptr,&status);
-	CHECK_ERROR(status, "cl::Context");
-
-	queue = cl::CommandQueue(context,devices[0],0,&status);
-	CHECK_ERROR(status, "cl::CommandQueue");
+	// created once per process and shared by all convolutions
+	const Runtime& runtime = Runtime::global();
+	platforms.assign(1, runtime.platform());
+	devices = runtime.devices();
+	context = runtime.context();
+	queue = runtime.queue();
 
 	return true;
 }
@@ -176,6 +149,27 @@ void Convolution3DCLImageLocalMem::setupKernelArgs(image_stack_cref image,
 	// std::cout << image << std::endl;
 }
 
+void Convolution3DCLImageLocalMem::uploadImage(image_stack_cref image)
+{
+	cl::size_t<3> origin;
+	origin[0] = 0;
+	origin[1] = 0;
+	origin[2] = 0;
+	cl::size_t<3> region;
+	region[0] = size[0];
+	region[1] = size[1];
+	region[2] = size[2];
+	status = queue.enqueueWriteImage(inputImage, CL_TRUE,
+	                                 origin, region, 0, 0,
+	                                 const_cast<float*>(image.data()));
+	CHECK_ERROR(status, "Queue::enqueueWriteImage");
+
+	// execute() accumulates into the first output image
+	cl_float4 fc = {0.0f, 0.0f, 0.0f, 0.0f};
+	status = queue.enqueueFillImage(outputImage[0], fc, origin, region);
+	CHECK_ERROR(status, "Queue::enqueueFillImage");
+}
+
 void Convolution3DCLImageLocalMem::execute()
 {
 	bool d = 0;
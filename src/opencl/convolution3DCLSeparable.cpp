@@ -0,0 +1,159 @@
+#include "opencl/convolution3DCLSeparable.hpp"
+#include "opencl/runtime.hpp"
+#include "opencl/sources.hpp"
+
+namespace anyfold {
+
+namespace opencl {
+
+// failures throw std::runtime_error, see Runtime::check
+#define CHECK_ERROR(status, fctname) Runtime::check(status, fctname)
+
+void Convolution3DCLSeparable::createProgramAndLoadKernel(const std::string& fileName, const std::string& kernelName)
+{
+	// the kernels are compiled into the library, see opencl/sources.hpp
+	createProgram(kernelSource(fileName));
+	loadKernel(kernelName);
+}
+
+void Convolution3DCLSeparable::createProgram(const std::string& source)
+{
+	// compiled once per source and device, see Runtime::buildProgram
+	program = Runtime::global().buildProgram(source, "");
+}
+
+void Convolution3DCLSeparable::loadKernel(const std::string& kernelName)
+{
+	kernel = cl::Kernel(program,kernelName.c_str(), &status);
+	CHECK_ERROR(status, "cl::Kernel");
+}
+
+bool Convolution3DCLSeparable::setupCLcontext()
+{
+	// created once per process and shared by all convolutions
+	const Runtime& runtime = Runtime::global();
+	platforms.assign(1, runtime.platform());
+	devices = runtime.devices();
+	context = runtime.context();
+	queue = runtime.queue();
+
+	return true;
+}
+
+void Convolution3DCLSeparable::setupKernelArgs(image_stack_cref image,
+                                               const std::vector<float> (&factors)[3])
+{
+	imageSize[0] = image.shape()[2];
+	imageSize[1] = image.shape()[1];
+	imageSize[2] = image.shape()[0];
+	filterSize[0] = factors[2].size();
+	filterSize[1] = factors[1].size();
+	filterSize[2] = factors[0].size();
+
+	const std::size_t bytes = sizeof(float) * image.num_elements();
+	inputBuffer = cl::Buffer(context,
+	                         CL_MEM_READ_ONLY |
+	                         CL_MEM_COPY_HOST_PTR,
+	                         bytes,
+	                         const_cast<float*>(image.data()), &status);
+	CHECK_ERROR(status, "cl::Buffer");
+
+	for(int i = 0; i < 2; ++i)
+	{
+		intermediateBuffer[i] = cl::Buffer(context, CL_MEM_READ_WRITE,
+		                                   bytes, nullptr, &status);
+		CHECK_ERROR(status, "cl::Buffer");
+	}
+
+	outputBuffer = cl::Buffer(context, CL_MEM_WRITE_ONLY,
+	                          bytes, nullptr, &status);
+	CHECK_ERROR(status, "cl::Buffer");
+
+	// factors arrive in boost order, the passes count axes from x (fastest)
+	for(int axis = 0; axis < 3; ++axis)
+	{
+		std::vector<float> flipped(factors[2-axis].rbegin(), factors[2-axis].rend());
+		filterWeightsBuffer[axis] = cl::Buffer(context,
+		                                       CL_MEM_READ_ONLY |
+		                                       CL_MEM_COPY_HOST_PTR,
+		                                       sizeof(float) * flipped.size(),
+		                                       &flipped[0], &status);
+		CHECK_ERROR(status, "cl::Buffer");
+	}
+}
+
+void Convolution3DCLSeparable::enqueuePass(const cl::Buffer& input,
+                                           const cl::Buffer& weights,
+                                           const cl::Buffer& output,
+                                           int axis,
+                                           const std::size_t* begin,
+                                           const std::size_t* end)
+{
+	const int strides[3] = {1, int(imageSize[0]), int(imageSize[0] * imageSize[1])};
+	cl_int4 size = {{int(imageSize[0]), int(imageSize[1]), int(imageSize[2]), 0}};
+	cl_int4 origin = {{int(begin[0]), int(begin[1]), int(begin[2]), 0}};
+
+	kernel.setArg(0, input);
+	kernel.setArg(1, weights);
+	kernel.setArg(2, output);
+	kernel.setArg(3, size);
+	kernel.setArg(4, origin);
+	kernel.setArg(5, strides[axis]);
+	kernel.setArg(6, int(filterSize[axis]));
+
+	status = queue.enqueueNDRangeKernel(kernel, 0,
+	                                    cl::NDRange(end[0] - begin[0],
+	                                                end[1] - begin[1],
+	                                                end[2] - begin[2]));
+	CHECK_ERROR(status, "Queue::enqueueNDRangeKernel");
+}
+
+void Convolution3DCLSeparable::uploadImage(image_stack_cref image)
+{
+	status = queue.enqueueWriteBuffer(inputBuffer, CL_TRUE, 0,
+	                                  sizeof(float) * image.num_elements(),
+	                                  image.data());
+	CHECK_ERROR(status, "Queue::enqueueWriteBuffer");
+}
+
+void Convolution3DCLSeparable::execute()
+{
+	// x over the full y-z extent, then shrink the computed region axis by axis
+	std::size_t begin[3] = {filterSize[0]/2, 0, 0};
+	std::size_t end[3] = {imageSize[0] - filterSize[0]/2, imageSize[1], imageSize[2]};
+	enqueuePass(inputBuffer, filterWeightsBuffer[0], intermediateBuffer[0], 0, begin, end);
+
+	begin[1] = filterSize[1]/2;
+	end[1] = imageSize[1] - filterSize[1]/2;
+	enqueuePass(intermediateBuffer[0], filterWeightsBuffer[1], intermediateBuffer[1], 1, begin, end);
+
+	begin[2] = filterSize[2]/2;
+	end[2] = imageSize[2] - filterSize[2]/2;
+	enqueuePass(intermediateBuffer[1], filterWeightsBuffer[2], outputBuffer, 2, begin, end);
+}
+
+void Convolution3DCLSeparable::getResult(image_stack_ref result)
+{
+	cl::size_t<3> origin;
+	origin[0] = (filterSize[0]/2)*sizeof(float);
+	origin[1] = filterSize[1]/2;
+	origin[2] = filterSize[2]/2;
+	cl::size_t<3> region;
+	region[0] = (imageSize[0] - 2*(filterSize[0]/2))*sizeof(float);
+	region[1] = imageSize[1] - 2*(filterSize[1]/2);
+	region[2] = imageSize[2] - 2*(filterSize[2]/2);
+
+	status = queue.enqueueReadBufferRect(outputBuffer, CL_TRUE,
+	                                     origin,
+	                                     origin,
+	                                     region,
+	                                     imageSize[0] * sizeof(float),
+	                                     imageSize[0] * imageSize[1] * sizeof(float),
+	                                     imageSize[0] * sizeof(float),
+	                                     imageSize[0] * imageSize[1] * sizeof(float),
+	                                     result.data());
+	CHECK_ERROR(status, "Queue::enqueueReadBufferRect");
+}
+
+} /* namespace opencl */
+} /* namespace anyfold */
@@ -5,6 +5,52 @@ __constant sampler_t sampler =
 	| CLK_ADDRESS_CLAMP
 	| CLK_FILTER_NEAREST;
 
+// input voxels are stored as float, as half (-D STORAGE_HALF), as the upper 16
+// bits of a float (-D STORAGE_BF16) or as unsigned integers (-D STORAGE_U8,
+// -D STORAGE_U16), results likewise by -D RESULT_HALF, -D RESULT_BF16, -D RESULT_U8
+// or -D RESULT_U16 (integers are saturated); the sum is always accumulated in
+// float and mapped to sum*scale + offset before it is stored
+#if defined(STORAGE_HALF)
+typedef half storage_t;
+#define LOAD(p, i) vload_half((i), (p))
+#elif defined(STORAGE_BF16)
+typedef ushort storage_t;
+#define LOAD(p, i) as_float(((uint)(p)[i]) << 16)
+#elif defined(STORAGE_U8)
+typedef uchar storage_t;
+#define LOAD(p, i) convert_float((p)[i])
+#elif defined(STORAGE_U16)
+typedef ushort storage_t;
+#define LOAD(p, i) convert_float((p)[i])
+#else
+typedef float storage_t;
+#define LOAD(p, i) ((p)[i])
+#endif
+
+#if defined(RESULT_HALF)
+typedef half result_t;
+#define STORE(v, i, p) vstore_half_rte((v), (i), (p))
+#elif defined(RESULT_BF16)
+typedef ushort result_t;
+#define STORE(v, i, p) ((p)[i] = bf16_round(v))
+ushort bf16_round(float value)
+{
+	const uint bits = as_uint(value);
+	if((bits & 0x7fffffff) > 0x7f800000)
+		return (ushort)((bits >> 16) | 0x40);
+	return (ushort)((bits + 0x7fff + ((bits >> 16) & 1)) >> 16);
+}
+#elif defined(RESULT_U8)
+typedef uchar result_t;
+#define STORE(v, i, p) ((p)[i] = convert_uchar_sat_rte(v))
+#elif defined(RESULT_U16)
+typedef ushort result_t;
+#define STORE(v, i, p) ((p)[i] = convert_ushort_sat_rte(v))
+#else
+typedef float result_t;
+#define STORE(v, i, p) ((p)[i] = (v))
+#endif
+
 float currentWeight (__constant const float* filterWeights,
                      const int x, const int y, const int z)
 {
@@ -13,9 +59,11 @@ float currentWeight (__constant const float* filterWeights,
 	                     (FILTER_SIZE_Z-1-(z+FILTER_SIZE_Z_HALF)) * FILTER_SIZE_X * FILTER_SIZE_Y];
 }
 
-__kernel void convolution3d (__global float* input,
+__kernel void convolution3d (__global storage_t* input,
                              __constant float* filterWeights,
-                             __global float* output)
+                             __global result_t* output,
+                             const float scale,
+                             const float offset)
 {
 	const int4 pos = {get_global_id(0)+FILTER_SIZE_X_HALF,
 	                  get_global_id(1)+FILTER_SIZE_Y_HALF,
@@ -36,10 +84,10 @@ __kernel void convolution3d (__global float* input,
 			{
 				int id = idz + idy + pos.x+x;
 				float val = currentWeight(filterWeights, x, y, z)
-				             * input[id];
+				             * LOAD(input, id);
 				sum += val;
 			}
 		}
 	}
-	output[gidx] = sum;
+	STORE(sum*scale + offset, gidx, output);
 }
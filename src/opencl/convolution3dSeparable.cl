@@ -0,0 +1,24 @@
+// one 1D pass of a separable convolution, the weights are flipped on the host
+// and taps are stride elements apart; every work item computes the voxel
+// origin + global id of the volume size (x fastest)
+__kernel void convolution1d (__global const float* input,
+                             __constant float* filterWeights,
+                             __global float* output,
+                             const int4 size,
+                             const int4 origin,
+                             const int stride,
+                             const int filterSize)
+{
+	const int x = get_global_id(0) + origin.x;
+	const int y = get_global_id(1) + origin.y;
+	const int z = get_global_id(2) + origin.z;
+	const int idx = (z * size.y + y) * size.x + x;
+	const int first = idx - (filterSize/2) * stride;
+
+	float sum = 0.0f;
+	for(int k = 0; k < filterSize; k++)
+	{
+		sum += filterWeights[k] * input[first + k * stride];
+	}
+	output[idx] = sum;
+}
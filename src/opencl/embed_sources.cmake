@@ -0,0 +1,38 @@
+# writes OUTPUT, a c++ file that compiles every .cl file of SOURCE_DIR into the
+# library as a string, see include/opencl/sources.hpp; run by src/CMakeLists.txt
+# whenever one of the kernels changes
+file(GLOB KERNEL_FILES "${SOURCE_DIR}/*.cl")
+list(SORT KERNEL_FILES)
+
+set(CONTENT "// generated from src/opencl/*.cl by src/opencl/embed_sources.cmake, do not edit\n")
+set(CONTENT "${CONTENT}#include <map>\n#include <stdexcept>\n\n#include \"opencl/sources.hpp\"\n\n")
+set(CONTENT "${CONTENT}namespace anyfold {\n\nnamespace opencl {\n\n")
+set(CONTENT "${CONTENT}static const std::map<std::string, std::string>& embeddedSources()\n{\n")
+set(CONTENT "${CONTENT}\tstatic const std::map<std::string, std::string> sources = {\n")
+foreach(KERNEL_FILE ${KERNEL_FILES})
+  get_filename_component(KERNEL_NAME "${KERNEL_FILE}" NAME)
+  file(READ "${KERNEL_FILE}" KERNEL_TEXT)
+  set(CONTENT "${CONTENT}\t\t{\"${KERNEL_NAME}\", R\"anyfold_cl(${KERNEL_TEXT})anyfold_cl\"},\n")
+endforeach()
+set(CONTENT "${CONTENT}\t};\n\treturn sources;\n}\n\n")
+
+set(CONTENT "${CONTENT}static std::string fileName(const std::string& path)\n{\n")
+set(CONTENT "${CONTENT}\treturn path.substr(path.find_last_of(\"/\\\\\") + 1);\n}\n\n")
+
+set(CONTENT "${CONTENT}bool hasKernelSource(const std::string& name)\n{\n")
+set(CONTENT "${CONTENT}\treturn embeddedSources().count(fileName(name)) > 0;\n}\n\n")
+
+set(CONTENT "${CONTENT}const std::string& kernelSource(const std::string& name)\n{\n")
+set(CONTENT "${CONTENT}\tstd::map<std::string, std::string>::const_iterator source = embeddedSources().find(fileName(name));\n")
+set(CONTENT "${CONTENT}\tif(source == embeddedSources().end())\n")
+set(CONTENT "${CONTENT}\t\tthrow std::runtime_error(\"[anyfold::opencl::kernelSource]\\t\" + name + \" is not a kernel of the library\\n\");\n")
+set(CONTENT "${CONTENT}\treturn source->second;\n}\n\n")
+set(CONTENT "${CONTENT}} /* namespace opencl */\n} /* namespace anyfold */\n")
+
+# an unchanged file keeps its time stamp and is not recompiled
+if(EXISTS "${OUTPUT}")
+  file(READ "${OUTPUT}" PREVIOUS)
+endif()
+if(NOT "${PREVIOUS}" STREQUAL "${CONTENT}")
+  file(WRITE "${OUTPUT}" "${CONTENT}")
+endif()
@@ -0,0 +1,565 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <stdexcept>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <cctype>
+#include <chrono>
+#include <limits>
+#include <algorithm>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "opencl/runtime.hpp"
+#include "opencl/sources.hpp"
+
+namespace anyfold {
+
+namespace opencl {
+
+namespace {
+
+// the selector of selectDevice, guarded by selectionMutex as is the creation of
+// Runtime::global() which consumes it
+std::mutex selectionMutex;
+std::string selection;
+bool selected = false;
+bool created = false;
+
+std::string lowerCase(std::string text)
+{
+	for(std::size_t i = 0; i < text.size(); ++i)
+		text[i] = static_cast<char>(std::tolower(static_cast<unsigned char>(text[i])));
+	return text;
+}
+
+// some drivers count the terminating zero or pad names with blanks
+std::string trimmed(std::string text)
+{
+	while(!text.empty() && (text.back() == '\0' || text.back() == ' '))
+		text.pop_back();
+	return text;
+}
+
+// identifies a device and its driver in the ranking kept by fastestDevice
+std::string deviceKey(const DeviceInfo& device)
+{
+	std::string driver;
+	device.device.getInfo(CL_DRIVER_VERSION, &driver);
+	std::string key = device.platformName + " / " + device.name + " / " + device.version + " / " + trimmed(driver);
+	std::replace(key.begin(), key.end(), '\n', ' ');
+	return key;
+}
+
+} /* namespace */
+
+Runtime& Runtime::global()
+{
+	// never destroyed, drivers may already be unloaded when static objects die
+	static Runtime* runtime = new Runtime();
+	return *runtime;
+}
+
+Runtime::Runtime()
+{
+	std::string selector;
+	{
+		std::lock_guard<std::mutex> lock(selectionMutex);
+		const char* variable = std::getenv("ANYFOLD_CL_DEVICE");
+		selector = selected ? selection : (variable ? variable : "");
+		created = true;
+	}
+
+	info_ = findDevice(selector);
+	platform_ = info_.platform;
+	devices_.assign(1, info_.device);
+
+	cl_int status = CL_SUCCESS;
+	context_ = cl::Context(devices_, nullptr, nullptr, nullptr, &status);
+	check(status, "cl::Context");
+
+	queue_ = cl::CommandQueue(context_, devices_[0], 0, &status);
+	check(status, "cl::CommandQueue");
+}
+
+std::string DeviceInfo::typeName() const
+{
+	if(type & CL_DEVICE_TYPE_GPU)
+		return "gpu";
+	if(type & CL_DEVICE_TYPE_CPU)
+		return "cpu";
+	if(type & CL_DEVICE_TYPE_ACCELERATOR)
+		return "accelerator";
+	return "other";
+}
+
+DeviceInfo Runtime::describe(const cl::Platform& platform, const cl::Device& device, std::size_t index)
+{
+	DeviceInfo info;
+	info.platform = platform;
+	info.device = device;
+	info.index = index;
+
+	platform.getInfo(CL_PLATFORM_NAME, &info.platformName);
+	device.getInfo(CL_DEVICE_NAME, &info.name);
+	device.getInfo(CL_DEVICE_VENDOR, &info.vendor);
+	device.getInfo(CL_DEVICE_VERSION, &info.version);
+	info.platformName = trimmed(info.platformName);
+	info.name = trimmed(info.name);
+	info.vendor = trimmed(info.vendor);
+	info.version = trimmed(info.version);
+
+	device.getInfo(CL_DEVICE_TYPE, &info.type);
+	device.getInfo(CL_DEVICE_MAX_COMPUTE_UNITS, &info.computeUnits);
+	device.getInfo(CL_DEVICE_MAX_CLOCK_FREQUENCY, &info.clockMHz);
+	device.getInfo(CL_DEVICE_GLOBAL_MEM_SIZE, &info.globalMemory);
+	device.getInfo(CL_DEVICE_LOCAL_MEM_SIZE, &info.localMemory);
+	device.getInfo(CL_DEVICE_MAX_MEM_ALLOC_SIZE, &info.maxAllocation);
+	cl_bool flag = CL_FALSE;
+	device.getInfo(CL_DEVICE_IMAGE_SUPPORT, &flag);
+	info.imageSupport = flag == CL_TRUE;
+	flag = CL_FALSE;
+	device.getInfo(CL_DEVICE_AVAILABLE, &flag);
+	info.available = flag == CL_TRUE;
+	flag = CL_FALSE;
+	device.getInfo(CL_DEVICE_HOST_UNIFIED_MEMORY, &flag);
+	info.hostUnifiedMemory = flag == CL_TRUE;
+	device.getInfo(CL_DEVICE_MEM_BASE_ADDR_ALIGN, &info.baseAddressAlign);
+	return info;
+}
+
+std::vector<DeviceInfo> Runtime::listDevices()
+{
+	std::vector<DeviceInfo> result;
+	std::vector<cl::Platform> platforms;
+	// no installable client driver is no device rather than an error
+	if(cl::Platform::get(&platforms) != CL_SUCCESS)
+		return result;
+
+	for(std::size_t p = 0; p < platforms.size(); ++p)
+	{
+		std::vector<cl::Device> devices;
+		if(platforms[p].getDevices(CL_DEVICE_TYPE_ALL, &devices) != CL_SUCCESS)
+			continue;
+		for(std::size_t d = 0; d < devices.size(); ++d)
+			result.push_back(describe(platforms[p], devices[d], result.size()));
+	}
+	return result;
+}
+
+DeviceInfo Runtime::findDevice(const std::string& _selector)
+{
+	std::vector<DeviceInfo> devices = listDevices();
+	devices.erase(std::remove_if(devices.begin(), devices.end(),
+	                             [](const DeviceInfo& d){ return !d.available; }),
+	              devices.end());
+	if(devices.empty())
+		throw std::runtime_error("[anyfold::opencl::Runtime]\tno OpenCL device found\n");
+
+	const std::string selector = lowerCase(_selector);
+	const DeviceInfo* match = nullptr;
+
+	if(selector == "fastest")
+		return rankDevices().front();
+
+	if(!selector.empty() && selector.find_first_not_of("0123456789") == std::string::npos)
+	{
+		const std::size_t index = std::strtoul(selector.c_str(), nullptr, 10);
+		for(std::size_t i = 0; i < devices.size() && !match; ++i)
+			if(devices[i].index == index)
+				match = &devices[i];
+	}
+	else if(selector == "gpu" || selector == "cpu" || selector == "accelerator")
+	{
+		for(std::size_t i = 0; i < devices.size() && !match; ++i)
+			if(devices[i].typeName() == selector)
+				match = &devices[i];
+	}
+	else if(!selector.empty())
+	{
+		for(std::size_t i = 0; i < devices.size() && !match; ++i)
+			if(lowerCase(devices[i].name).find(selector) != std::string::npos ||
+			   lowerCase(devices[i].platformName).find(selector) != std::string::npos)
+				match = &devices[i];
+	}
+
+	if(!match)
+	{
+		if(!selector.empty())
+			std::cerr << "[anyfold::opencl::Runtime]\tno device matches \"" << _selector
+			          << "\", using the default device\n";
+		return fastestDevice(devices);
+	}
+	return *match;
+}
+
+DeviceInfo Runtime::fastestDevice(const std::vector<DeviceInfo>& _devices)
+{
+	if(_devices.size() == 1)
+		return _devices[0];
+
+	// one line per device: probe seconds and the device key
+	const std::string directory = binaryCacheDirectory();
+	const std::string path = directory.empty() ? std::string() : directory + "/devices.rank";
+	std::map<std::string, double> known;
+	if(!path.empty())
+	{
+		std::ifstream in(path.c_str());
+		double seconds = 0;
+		std::string key;
+		while(in >> seconds && std::getline(in >> std::ws, key))
+			known[key] = seconds;
+	}
+
+	const DeviceInfo* fastest = nullptr;
+	double best = std::numeric_limits<double>::infinity();
+	bool complete = true;
+	for(std::size_t i = 0; i < _devices.size() && complete; ++i)
+	{
+		std::map<std::string, double>::const_iterator entry = known.find(deviceKey(_devices[i]));
+		complete = entry != known.end();
+		if(complete && (!fastest || entry->second < best))
+		{
+			fastest = &_devices[i];
+			best = entry->second;
+		}
+	}
+	if(complete)
+		return *fastest;
+
+	// a device or driver the file doesn't know: probe them all and remember
+	// the result, written aside and renamed like the program binaries
+	const std::vector<DeviceInfo> ranked = rankDevices();
+	if(!path.empty())
+	{
+		makeDirectories(directory);
+		std::ostringstream temporary;
+		temporary << path << "." << ::getpid();
+		bool written = false;
+		{
+			std::ofstream out(temporary.str().c_str());
+			for(std::size_t i = 0; i < ranked.size(); ++i)
+				out << std::min(ranked[i].probeSeconds, std::numeric_limits<double>::max())
+				    << ' ' << deviceKey(ranked[i]) << '\n';
+			written = static_cast<bool>(out.flush());
+		}
+		if(!written || std::rename(temporary.str().c_str(), path.c_str()) != 0)
+			std::remove(temporary.str().c_str());
+	}
+	return ranked.front();
+}
+
+void Runtime::selectDevice(const std::string& _selector)
+{
+	std::lock_guard<std::mutex> lock(selectionMutex);
+	if(created)
+		throw std::runtime_error("[anyfold::opencl::Runtime]\tselectDevice must be called before the first OpenCL convolution\n");
+	selection = _selector;
+	selected = true;
+}
+
+double Runtime::probe(const DeviceInfo& _device)
+{
+	const std::size_t size = 64;
+	const std::size_t filter = 5;
+	const std::size_t padded = size + filter - 1;
+	const std::string defines = "-D FILTER_SIZE_X=5 -D FILTER_SIZE_Y=5 -D FILTER_SIZE_Z=5"
+	                            " -D FILTER_SIZE_X_HALF=2 -D FILTER_SIZE_Y_HALF=2 -D FILTER_SIZE_Z_HALF=2";
+
+	try
+	{
+		// a context of its own, the device need not be the one of global()
+		cl_int status = CL_SUCCESS;
+		const std::vector<cl::Device> device(1, _device.device);
+		cl::Context context(device, nullptr, nullptr, nullptr, &status);
+		check(status, "cl::Context");
+		cl::CommandQueue queue(context, _device.device, 0, &status);
+		check(status, "cl::CommandQueue");
+
+		const std::string& source = kernelSource("convolution3dBuffer.cl");
+		cl::Program::Sources sources(1, std::make_pair(source.c_str(), source.length()));
+		cl::Program program(context, sources, &status);
+		check(status, "cl::Program");
+		check(program.build(device, defines.c_str(), nullptr, nullptr), "cl::Program::build");
+		cl::Kernel kernel(program, "convolution3d", &status);
+		check(status, "cl::Kernel");
+
+		std::vector<float> image(padded*padded*padded, 1.f);
+		std::vector<float> weights(filter*filter*filter, 1.f/(filter*filter*filter));
+		cl::Buffer input(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, image.size()*sizeof(float), &image[0], &status);
+		check(status, "cl::Buffer");
+		cl::Buffer filterWeights(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, weights.size()*sizeof(float), &weights[0], &status);
+		check(status, "cl::Buffer");
+		cl::Buffer output(context, CL_MEM_WRITE_ONLY, size*size*size*sizeof(float), nullptr, &status);
+		check(status, "cl::Buffer");
+		check(kernel.setArg(0, input), "cl::Kernel::setArg");
+		check(kernel.setArg(1, filterWeights), "cl::Kernel::setArg");
+		check(kernel.setArg(2, output), "cl::Kernel::setArg");
+		check(kernel.setArg(3, 1.f), "cl::Kernel::setArg");
+		check(kernel.setArg(4, 0.f), "cl::Kernel::setArg");
+
+		double best = std::numeric_limits<double>::infinity();
+		for(int run = 0; run < 4; ++run)
+		{
+			const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			check(queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(size, size, size), cl::NullRange),
+			      "cl::CommandQueue::enqueueNDRangeKernel");
+			check(queue.finish(), "cl::CommandQueue::finish");
+			const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			// the first run pays for lazy initialization in the driver
+			if(run > 0)
+				best = std::min(best, seconds);
+		}
+		return best;
+	}
+	catch(const std::exception&)
+	{
+		return std::numeric_limits<double>::infinity();
+	}
+}
+
+std::vector<DeviceInfo> Runtime::rankDevices()
+{
+	std::vector<DeviceInfo> devices = listDevices();
+	devices.erase(std::remove_if(devices.begin(), devices.end(),
+	                             [](const DeviceInfo& d){ return !d.available; }),
+	              devices.end());
+	if(devices.empty())
+		throw std::runtime_error("[anyfold::opencl::Runtime]\tno OpenCL device found\n");
+
+	for(std::size_t i = 0; i < devices.size(); ++i)
+		devices[i].probeSeconds = probe(devices[i]);
+	std::stable_sort(devices.begin(), devices.end(),
+	                 [](const DeviceInfo& a, const DeviceInfo& b){ return a.probeSeconds < b.probeSeconds; });
+	return devices;
+}
+
+bool Runtime::zeroCopy(HostMemory _mode) const
+{
+	return _mode == HostMemory::zeroCopy ||
+	       ((_mode == HostMemory::automatic || _mode == HostMemory::staged) && info_.hostUnifiedMemory);
+}
+
+bool Runtime::wrappable(const void* _data) const
+{
+	const std::size_t alignment = std::max<std::size_t>(info_.baseAddressAlign/8, 64);
+	return reinterpret_cast<std::uintptr_t>(_data) % alignment == 0;
+}
+
+cl::Buffer Runtime::hostBuffer(const void* _data, std::size_t _bytes, bool& _wraps, bool _wrap) const
+{
+	cl_int status = CL_SUCCESS;
+	_wraps = _wrap && wrappable(_data);
+	if(_wraps)
+	{
+		// the kernels only read their input, the const_cast is never written through
+		cl::Buffer buffer(context_, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, _bytes, const_cast<void*>(_data), &status);
+		check(status, "cl::Buffer");
+		return buffer;
+	}
+
+	cl::Buffer buffer(context_, CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR, _bytes, nullptr, &status);
+	check(status, "cl::Buffer");
+	writeMapped(buffer, _data, _bytes);
+	return buffer;
+}
+
+void Runtime::writeMapped(const cl::Buffer& _buffer, const void* _data, std::size_t _bytes) const
+{
+	cl_int status = CL_SUCCESS;
+	void* mapped = queue_.enqueueMapBuffer(_buffer, CL_TRUE, CL_MAP_WRITE_INVALIDATE_REGION, 0, _bytes,
+	                                       nullptr, nullptr, &status);
+	check(status, "cl::CommandQueue::enqueueMapBuffer");
+	// CL_MEM_USE_HOST_PTR buffers map to their host memory
+	if(mapped != _data)
+		std::memcpy(mapped, _data, _bytes);
+	check(queue_.enqueueUnmapMemObject(_buffer, mapped), "cl::CommandQueue::enqueueUnmapMemObject");
+}
+
+void Runtime::readMappedRect(const cl::Buffer& _buffer, const std::size_t* _region,
+                             const std::size_t* _hostOffset, std::size_t _hostRowPitch,
+                             std::size_t _hostSlicePitch, void* _result) const
+{
+	cl_int status = CL_SUCCESS;
+	void* mapped = queue_.enqueueMapBuffer(_buffer, CL_TRUE, CL_MAP_READ, 0, _region[0]*_region[1]*_region[2],
+	                                       nullptr, nullptr, &status);
+	check(status, "cl::CommandQueue::enqueueMapBuffer");
+
+	const char* source = static_cast<const char*>(mapped);
+	char* destination = static_cast<char*>(_result) + _hostOffset[0] +
+	                    _hostOffset[1]*_hostRowPitch + _hostOffset[2]*_hostSlicePitch;
+	for(std::size_t z = 0; z < _region[2]; ++z)
+		for(std::size_t y = 0; y < _region[1]; ++y)
+			std::memcpy(destination + z*_hostSlicePitch + y*_hostRowPitch,
+			            source + (z*_region[1] + y)*_region[0], _region[0]);
+
+	check(queue_.enqueueUnmapMemObject(_buffer, mapped), "cl::CommandQueue::enqueueUnmapMemObject");
+}
+
+std::string Runtime::binaryCacheDirectory()
+{
+	const char* path = std::getenv("ANYFOLD_CL_CACHE");
+	if(path)
+		return path;
+	const char* home = std::getenv("HOME");
+	return std::string(home ? home : ".") + "/.anyfold_cl_cache";
+}
+
+std::size_t Runtime::compilations() const
+{
+	std::lock_guard<std::mutex> lock(programMutex_);
+	return compilations_;
+}
+
+void Runtime::forgetPrograms()
+{
+	std::lock_guard<std::mutex> lock(programMutex_);
+	programs_.clear();
+}
+
+void Runtime::makeDirectories(const std::string& path)
+{
+	// parents first, each step fails harmlessly if the directory exists or
+	// can't be created (storeBinary then gives up)
+	for(std::size_t slash = path.find('/', 1); slash != std::string::npos; slash = path.find('/', slash + 1))
+		::mkdir(path.substr(0, slash).c_str(), 0755);
+	::mkdir(path.c_str(), 0755);
+}
+
+std::string Runtime::programKey(const std::string& source, const std::string& options) const
+{
+	std::string driver;
+	std::string text;
+	device().getInfo(CL_DEVICE_NAME, &text);
+	driver += text + '\0';
+	device().getInfo(CL_DEVICE_VERSION, &text);
+	driver += text + '\0';
+	device().getInfo(CL_DRIVER_VERSION, &text);
+	driver += text + '\0';
+	platform_.getInfo(CL_PLATFORM_VERSION, &text);
+	driver += text;
+
+	// 64 bit FNV-1a, stable across processes unlike std::hash
+	std::uint64_t hash = 14695981039346656037ull;
+	const std::string* parts[3] = {&source, &options, &driver};
+	for(int p = 0; p < 3; ++p)
+	{
+		for(std::size_t i = 0; i < parts[p]->size(); ++i)
+		{
+			hash ^= static_cast<unsigned char>((*parts[p])[i]);
+			hash *= 1099511628211ull;
+		}
+		// separates the parts
+		hash ^= 0xff;
+		hash *= 1099511628211ull;
+	}
+
+	std::ostringstream key;
+	key << std::hex << std::setw(16) << std::setfill('0') << hash;
+	return key.str();
+}
+
+bool Runtime::loadBinary(const std::string& path, const std::string& options, cl::Program& program) const
+{
+	std::ifstream in(path.c_str(), std::ios::in | std::ios::binary);
+	if(!in)
+		return false;
+	const std::string binary((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+	if(binary.empty())
+		return false;
+
+	// a binary the driver rejects is recompiled and overwritten
+	const std::vector<cl::Device> device(1, devices_[0]);
+	cl::Program::Binaries binaries(1, std::make_pair(static_cast<const void*>(binary.data()), binary.size()));
+	std::vector<cl_int> binaryStatus;
+	cl_int status = CL_SUCCESS;
+	cl::Program candidate(context_, device, binaries, &binaryStatus, &status);
+	if(status != CL_SUCCESS || candidate.build(device, options.c_str(), nullptr, nullptr) != CL_SUCCESS)
+		return false;
+
+	program = candidate;
+	return true;
+}
+
+void Runtime::storeBinary(const std::string& path, const cl::Program& program) const
+{
+	std::size_t size = 0;
+	if(clGetProgramInfo(program(), CL_PROGRAM_BINARY_SIZES, sizeof(size), &size, nullptr) != CL_SUCCESS || !size)
+		return;
+	std::vector<unsigned char> binary(size);
+	unsigned char* data = &binary[0];
+	if(clGetProgramInfo(program(), CL_PROGRAM_BINARIES, sizeof(data), &data, nullptr) != CL_SUCCESS)
+		return;
+
+	// written aside and renamed, concurrent processes never see half a binary
+	std::ostringstream temporary;
+	temporary << path << "." << ::getpid();
+	{
+		std::ofstream out(temporary.str().c_str(), std::ios::out | std::ios::binary);
+		if(!out.write(reinterpret_cast<const char*>(data), size))
+		{
+			std::remove(temporary.str().c_str());
+			return;
+		}
+	}
+	if(std::rename(temporary.str().c_str(), path.c_str()) != 0)
+		std::remove(temporary.str().c_str());
+}
+
+cl::Program Runtime::buildProgram(const std::string& source, const std::string& options)
+{
+	const std::string key = programKey(source, options);
+
+	std::lock_guard<std::mutex> lock(programMutex_);
+	std::map<std::string, cl::Program>::const_iterator known = programs_.find(key);
+	if(known != programs_.end())
+		return known->second;
+
+	const std::string directory = binaryCacheDirectory();
+	const std::string path = directory.empty() ? std::string() : directory + "/" + key + ".bin";
+
+	cl::Program program;
+	if(path.empty() || !loadBinary(path, options, program))
+	{
+		const std::vector<cl::Device> device(1, devices_[0]);
+		cl::Program::Sources sources(1, std::make_pair(source.c_str(), source.length()));
+		cl_int status = CL_SUCCESS;
+		program = cl::Program(context_, sources, &status);
+		check(status, "cl::Program");
+
+		status = program.build(device, options.c_str(), nullptr, nullptr);
+		++compilations_;
+
+		std::string log;
+		program.getBuildInfo(devices_[0], CL_PROGRAM_BUILD_LOG, &log);
+		if(log.size() > 0)
+			std::cout << log << std::endl;
+		check(status, "cl::Program::build");
+
+		if(!path.empty())
+		{
+			makeDirectories(directory);
+			storeBinary(path, program);
+		}
+	}
+
+	programs_[key] = program;
+	return program;
+}
+
+void Runtime::check(cl_int status, const char* label)
+{
+	if(status == CL_SUCCESS)
+		return;
+
+	std::ostringstream msg;
+	msg << "[anyfold::opencl::Runtime]\t" << label << " failed with status " << status << "\n";
+	throw std::runtime_error(msg.str());
+}
+
+} /* namespace opencl */
+} /* namespace anyfold */
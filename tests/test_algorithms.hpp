@@ -2,6 +2,7 @@
 #define _TEST_ALGORITHMS_H_
 
 #include <vector>
+#include <cmath>
 #include "image_stack_utils.h"
 
 namespace anyfold {
@@ -144,6 +145,45 @@ namespace anyfold {
     
     return min;
   }
+
+  //smooth test image: sin(.1*i) at linear index i
+  template <typename ValueT>
+  void fill_wave(ValueT* _data, std::size_t _size){
+    for(std::size_t i = 0;i<_size;++i)
+      _data[i] = std::sin(.1f*i);
+  }
+
+  inline void fill_wave(image_stack& _image){
+    fill_wave(_image.data(), _image.num_elements());
+  }
+
+  //test kernel without symmetries (so no backend can exploit one by accident):
+  //cos(1.3*i*i)/_norm at linear index i
+  template <typename ValueT>
+  void fill_scattered(ValueT* _data, std::size_t _size, float _norm = 1.f){
+    for(std::size_t i = 0;i<_size;++i)
+      _data[i] = std::cos(1.3f*i*i)/_norm;
+  }
+
+  inline void fill_scattered(image_stack& _kernel, float _norm = 1.f){
+    fill_scattered(_kernel.data(), _kernel.num_elements(), _norm);
+  }
+
+  //squared l2 distance of _result to _expected relative to the energy of _expected
+  template <typename ValueT>
+  float relative_error(const ValueT* _expected, const ValueT* _result, std::size_t _size){
+    float reference = 0.f;
+    float distance = 0.f;
+    for(std::size_t p = 0;p<_size;++p){
+      reference += _expected[p]*_expected[p];
+      distance += (_expected[p] - _result[p])*(_expected[p] - _result[p]);
+    }
+    return distance/reference;
+  }
+
+  inline float relative_error(const image_stack& _expected, const image_stack& _result){
+    return relative_error(_expected.data(), _result.data(), _expected.num_elements());
+  }
 }
 #endif /* _TEST_ALGORITHMS_H_ */
 
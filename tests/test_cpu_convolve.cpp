@@ -3,7 +3,9 @@
 #include "boost/test/unit_test.hpp"
 #include "test_fixtures.hpp"
 #include <numeric>
+#include <fstream>
 #include <algorithm>
+#include <boost/filesystem.hpp>
 #include "anyfold.hpp"
 
 #include "test_algorithms.hpp"
@@ -137,3 +139,1288 @@ BOOST_AUTO_TEST_CASE( all1_convolve )
   BOOST_REQUIRE_CLOSE(l2norm, 0, .00001);
 }
 BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_FIXTURE_TEST_SUITE( parallel_convolution_works, anyfold::default_3D_fixture )
+
+BOOST_AUTO_TEST_CASE( parallel_all1_convolve )
+{
+
+  anyfold::cpu::parallel_convolve_3d(padded_image_.data(),(int*)&padded_image_shape_[0],
+				     all1_kernel_.data(),&kernel_dims_[0],
+				     padded_output_.data());
+
+  float l2norm = anyfold::l2norm(padded_output_.data(), padded_image_folded_by_all1_.data(),  padded_output_.num_elements());
+  BOOST_REQUIRE_CLOSE(l2norm, 0, .00001);
+}
+
+BOOST_AUTO_TEST_CASE( parallel_bit_identical_to_serial )
+{
+
+  std::vector<int> shape(3);
+  shape[0] = 23; shape[1] = 17; shape[2] = 19;
+  std::vector<int> kshape(3);
+  kshape[0] = 5; kshape[1] = 3; kshape[2] = 7;
+
+  anyfold::image_stack image(shape);
+  anyfold::image_stack kernel(kshape);
+  anyfold::fill_wave(image);
+  for(unsigned i = 0;i<kernel.num_elements();++i)
+    kernel.data()[i] = std::cos(.3f*i);
+
+  anyfold::image_stack serial(shape);
+  anyfold::cpu::convolve_3d(image.data(), &shape[0], kernel.data(), &kshape[0], serial.data());
+
+  anyfold::cpu::thread_pool pool(3);
+  for(unsigned threads = 1;threads<=4;++threads){
+    anyfold::image_stack parallel(shape);
+    anyfold::cpu::parallel_convolve_3d(image.data(), &shape[0], kernel.data(), &kshape[0], parallel.data(),
+				       threads, pool);
+    BOOST_REQUIRE(std::equal(serial.data(), serial.data() + serial.num_elements(), parallel.data()));
+  }
+}
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_FIXTURE_TEST_SUITE( vectorized_convolution_works, anyfold::default_3D_fixture )
+
+BOOST_AUTO_TEST_CASE( vectorized_all1_convolve )
+{
+
+  anyfold::cpu::vectorized_convolve_3d(padded_image_.data(),(int*)&padded_image_shape_[0],
+				       all1_kernel_.data(),&kernel_dims_[0],
+				       padded_output_.data());
+
+  float l2norm = anyfold::l2norm(padded_output_.data(), padded_image_folded_by_all1_.data(),  padded_output_.num_elements());
+  BOOST_REQUIRE_CLOSE(l2norm, 0, .00001);
+}
+
+BOOST_AUTO_TEST_CASE( all_instruction_sets_match_reference )
+{
+
+  std::vector<int> shape(3);
+  shape[0] = 11; shape[1] = 9; shape[2] = 83;
+  std::vector<int> kshape(3);
+  kshape[0] = 3; kshape[1] = 5; kshape[2] = 7;
+
+  anyfold::image_stack image(shape);
+  anyfold::image_stack kernel(kshape);
+  anyfold::fill_wave(image);
+  for(unsigned i = 0;i<kernel.num_elements();++i)
+    kernel.data()[i] = std::cos(.3f*i);
+
+  anyfold::image_stack expected(shape);
+  anyfold::cpu::convolve_3d(image.data(), &shape[0], kernel.data(), &kshape[0], expected.data());
+
+  const anyfold::cpu::instruction_set sets[] = {anyfold::cpu::instruction_set::scalar,
+						anyfold::cpu::instruction_set::avx2,
+						anyfold::cpu::instruction_set::avx512};
+  for(const anyfold::cpu::instruction_set isa : sets){
+    if(!anyfold::cpu::supported(isa))
+      continue;
+
+    anyfold::image_stack result(shape);
+    anyfold::cpu::vectorized_convolve_3d(image.data(), &shape[0], kernel.data(), &kshape[0], result.data(), 2, isa);
+
+    float l2norm = anyfold::l2norm(expected.data(), result.data(), result.num_elements());
+    BOOST_TEST_MESSAGE(anyfold::cpu::name(isa) << " l2norm " << l2norm);
+    BOOST_CHECK_LT(l2norm, 1e-6);
+  }
+}
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_FIXTURE_TEST_SUITE( separable_convolution_works, anyfold::default_3D_fixture )
+
+BOOST_AUTO_TEST_CASE( detects_separable_kernels )
+{
+
+  std::vector<float> factors[3];
+  BOOST_CHECK(anyfold::factorize_separable(all1_kernel_.data(), &kernel_dims_[0], factors));
+  BOOST_CHECK(anyfold::factorize_separable(horizontal_kernel_.data(), &kernel_dims_[0], factors));
+
+  anyfold::image_stack cross(all1_kernel_);
+  cross[0][0][0] = 5.f;
+  BOOST_CHECK(!anyfold::factorize_separable(cross.data(), &kernel_dims_[0], factors));
+}
+
+BOOST_AUTO_TEST_CASE( separable_gaussian_matches_direct )
+{
+
+  std::vector<int> shape(3);
+  shape[0] = 21; shape[1] = 18; shape[2] = 25;
+  std::vector<int> kshape(3);
+  kshape[0] = 5; kshape[1] = 7; kshape[2] = 9;
+
+  anyfold::image_stack image(shape);
+  anyfold::fill_wave(image);
+
+  std::vector<float> factors[3];
+  anyfold::image_stack kernel(kshape);
+  for(int d = 0;d<3;++d)
+    for(int i = 0;i<kshape[d];++i)
+      factors[d].push_back(std::exp(-.5f*(i - kshape[d]/2)*(i - kshape[d]/2)/(d+1.f)) + .1f*i);
+
+  for(int x = 0;x<kshape[0];++x)
+    for(int y = 0;y<kshape[1];++y)
+      for(int z = 0;z<kshape[2];++z)
+	kernel[x][y][z] = factors[0][x]*factors[1][y]*factors[2][z];
+
+  std::vector<unsigned> offsets(kshape.begin(), kshape.end());
+  for(int d = 0;d<3;++d)
+    offsets[d] /= 2;
+
+  anyfold::image_stack expected(shape);
+  anyfold::convolve(image, kernel, expected, offsets);
+
+  anyfold::image_stack separable(shape);
+  anyfold::cpu::convolve_separable_3d(image.data(), &shape[0],
+				      &factors[0][0], &factors[1][0], &factors[2][0], &kshape[0],
+				      separable.data());
+  BOOST_CHECK_LT(anyfold::l2norm(expected.data(), separable.data(), separable.num_elements()), 1e-6);
+
+  anyfold::image_stack detected(shape);
+  anyfold::cpu::convolve_3d(image.data(), &shape[0], kernel.data(), &kshape[0], detected.data());
+  BOOST_CHECK_LT(anyfold::l2norm(expected.data(), detected.data(), detected.num_elements()), 1e-6);
+}
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE( low_rank_convolution_works )
+
+BOOST_AUTO_TEST_CASE( rank2_kernel_matches_direct )
+{
+
+  std::vector<int> shape(3);
+  shape[0] = 20; shape[1] = 22; shape[2] = 24;
+  std::vector<int> kshape(3);
+  kshape[0] = 7; kshape[1] = 9; kshape[2] = 5;
+
+  anyfold::image_stack image(shape);
+  anyfold::fill_wave(image);
+
+  //narrow core plus wide halo, a typical shape of a measured psf
+  anyfold::image_stack kernel(kshape);
+  for(int x = 0;x<kshape[0];++x)
+    for(int y = 0;y<kshape[1];++y)
+      for(int z = 0;z<kshape[2];++z){
+	const float r2 = (x-3)*(x-3) + (y-4)*(y-4) + (z-2)*(z-2);
+	kernel[x][y][z] = std::exp(-r2/2.f) + .2f*std::exp(-(x-3)*(x-3)/8.f)*std::exp(-(y-4)*(y-4)/1.f)*std::exp(-(z-2)*(z-2)/18.f);
+      }
+
+  std::vector<anyfold::separable_term> terms;
+  const double error = anyfold::decompose_low_rank(kernel.data(), &kshape[0], terms, 1e-4f, 6);
+  BOOST_CHECK_LE(error, 1e-4);
+  BOOST_CHECK_LE(terms.size(), 3u);
+
+  std::vector<unsigned> offsets(3);
+  for(int d = 0;d<3;++d)
+    offsets[d] = kshape[d]/2;
+
+  anyfold::image_stack expected(shape);
+  anyfold::convolve(image, kernel, expected, offsets);
+
+  anyfold::image_stack result(shape);
+  const unsigned rank = anyfold::cpu::convolve_low_rank_3d(image.data(), &shape[0], kernel.data(), &kshape[0],
+							   result.data(), 1e-4f, 6);
+  BOOST_CHECK_GT(rank, 0u);
+
+  BOOST_CHECK_LT(anyfold::relative_error(expected, result), 1e-6);
+}
+
+BOOST_AUTO_TEST_CASE( exceeded_rank_falls_back_to_direct )
+{
+
+  std::vector<int> shape(3, 12);
+  std::vector<int> kshape(3, 5);
+
+  anyfold::image_stack image(shape);
+  anyfold::image_stack kernel(kshape);
+  anyfold::fill_wave(image);
+  anyfold::fill_scattered(kernel);
+
+  anyfold::image_stack expected(shape);
+  anyfold::cpu::vectorized_convolve_3d(image.data(), &shape[0], kernel.data(), &kshape[0], expected.data());
+
+  anyfold::image_stack result(shape);
+  BOOST_CHECK_EQUAL(anyfold::cpu::convolve_low_rank_3d(image.data(), &shape[0], kernel.data(), &kshape[0],
+						       result.data(), 1e-3f, 2), 0u);
+  BOOST_CHECK(std::equal(expected.data(), expected.data() + expected.num_elements(), result.data()));
+}
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE( fft_convolution_works )
+
+BOOST_AUTO_TEST_CASE( complex_fft_matches_dft )
+{
+
+  const long sizes[] = {1, 2, 12, 13, 60, 77};
+  for(const long n : sizes){
+    std::vector<anyfold::cpu::complex_type> in(n), out(n), back(n);
+    for(long i = 0;i<n;++i)
+      in[i] = anyfold::cpu::complex_type(std::sin(.7f*i), std::cos(.3f*i));
+
+    anyfold::cpu::complex_fft fft(n);
+    fft.transform(&in[0], 1, &out[0], false);
+
+    for(long k = 0;k<n;++k){
+      std::complex<double> expected = 0;
+      for(long i = 0;i<n;++i)
+	expected += std::complex<double>(in[i].real(), in[i].imag())*std::polar(1., -2.*std::acos(-1.)*i*k/n);
+      BOOST_CHECK_SMALL(std::abs(std::complex<double>(out[k].real(), out[k].imag()) - expected), 1e-3);
+    }
+
+    fft.transform(&out[0], 1, &back[0], true);
+    for(long i = 0;i<n;++i)
+      BOOST_CHECK_SMALL(std::abs(back[i]/float(n) - in[i]), 1e-4f);
+  }
+}
+
+BOOST_AUTO_TEST_CASE( fft_matches_direct )
+{
+
+  std::vector<int> shape(3);
+  shape[0] = 19; shape[1] = 24; shape[2] = 17;
+  std::vector<int> kshape(3);
+  kshape[0] = 7; kshape[1] = 5; kshape[2] = 9;
+
+  anyfold::image_stack image(shape);
+  anyfold::image_stack kernel(kshape);
+  anyfold::fill_wave(image);
+  anyfold::fill_scattered(kernel);
+
+  anyfold::image_stack expected(shape);
+  anyfold::cpu::vectorized_convolve_3d(image.data(), &shape[0], kernel.data(), &kshape[0], expected.data());
+
+  //twice to hit the plan cache
+  for(int repeat = 0;repeat<2;++repeat){
+    anyfold::image_stack result(shape);
+    anyfold::cpu::fft_convolve_3d(image.data(), &shape[0], kernel.data(), &kshape[0], result.data());
+
+    BOOST_CHECK_LT(anyfold::relative_error(expected, result), 1e-9);
+  }
+}
+
+BOOST_AUTO_TEST_CASE( fft_centers_even_kernels_like_direct )
+{
+
+  std::vector<int> shape(3, 12);
+  std::vector<int> kshape(3);
+  kshape[0] = 4; kshape[1] = 5; kshape[2] = 6;
+
+  anyfold::image_stack image(shape);
+  anyfold::image_stack kernel(kshape);
+  anyfold::fill_wave(image);
+  anyfold::fill_scattered(kernel);
+
+  anyfold::image_stack expected(shape);
+  anyfold::cpu::convolve_3d(image.data(), &shape[0], kernel.data(), &kshape[0], expected.data());
+
+  anyfold::image_stack result(shape);
+  anyfold::cpu::fft_convolve_3d(image.data(), &shape[0], kernel.data(), &kshape[0], result.data());
+  BOOST_CHECK_LT(anyfold::relative_error(expected, result), 1e-9);
+
+  //overlap-save shares the kernel spectrum
+  anyfold::image_stack blocked(shape);
+  anyfold::cpu::overlap_save_convolve_3d(image.data(), &shape[0], kernel.data(), &kshape[0], blocked.data(), 1 << 20);
+  BOOST_CHECK_LT(anyfold::relative_error(expected, blocked), 1e-9);
+}
+
+BOOST_AUTO_TEST_CASE( plan_cache_stays_bounded )
+{
+  typedef anyfold::cpu::fft_plan_3d plan_type;
+  BOOST_CHECK(plan_type::cache_limit() == plan_type::default_cache_limit);
+
+  plan_type::clear_cache();
+  plan_type::set_cache_limit(2);
+
+  std::shared_ptr<const plan_type> first = plan_type::get(std::vector<long>(3, 8), 1);
+  BOOST_CHECK(plan_type::get(std::vector<long>(3, 8), 1) == first);
+
+  for(long n = 9;n<13;++n)
+    plan_type::get(std::vector<long>(3, n), 1);
+  BOOST_CHECK_EQUAL(plan_type::cached_plans(), 2u);
+
+  //evicted plans stay valid for their users and are planned again on demand
+  BOOST_CHECK_EQUAL(first->extents()[0], 8);
+  BOOST_CHECK(plan_type::get(std::vector<long>(3, 8), 1) != first);
+
+  plan_type::clear_cache();
+  BOOST_CHECK_EQUAL(plan_type::cached_plans(), 0u);
+  plan_type::set_cache_limit(plan_type::default_cache_limit);
+}
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE( overlap_save_convolution_works )
+
+BOOST_AUTO_TEST_CASE( block_shape_respects_budget )
+{
+  std::vector<int> shape(3, 512);
+  std::vector<int> kshape(3);
+  kshape[0] = 7; kshape[1] = 5; kshape[2] = 9;
+
+  const std::size_t budget = 4 << 20;
+  const std::vector<long> block = anyfold::cpu::overlap_save_block_shape(&shape[0], &kshape[0], budget);
+  BOOST_CHECK_LE(anyfold::cpu::overlap_save_footprint(block), budget);
+  for(int d = 0;d<3;++d)
+    BOOST_CHECK_GE(block[d], kshape[d]);
+
+  BOOST_CHECK_THROW(anyfold::cpu::overlap_save_block_shape(&shape[0], &kshape[0], 64), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE( overlap_save_matches_direct )
+{
+
+  std::vector<int> shape(3);
+  shape[0] = 29; shape[1] = 34; shape[2] = 41;
+  std::vector<int> kshape(3);
+  kshape[0] = 7; kshape[1] = 5; kshape[2] = 9;
+
+  anyfold::image_stack image(shape);
+  anyfold::image_stack kernel(kshape);
+  anyfold::fill_wave(image);
+  anyfold::fill_scattered(kernel);
+
+  anyfold::image_stack expected(shape);
+  anyfold::cpu::vectorized_convolve_3d(image.data(), &shape[0], kernel.data(), &kshape[0], expected.data());
+
+  //a budget that forces several blocks along every axis and one that fits the whole volume
+  const std::size_t budgets[] = {32 << 10, 64 << 20};
+  for(const std::size_t budget : budgets){
+    anyfold::image_stack result(shape);
+    anyfold::cpu::overlap_save_convolve_3d(image.data(), &shape[0], kernel.data(), &kshape[0], result.data(), budget);
+
+    BOOST_CHECK_LT(anyfold::relative_error(expected, result), 1e-9);
+  }
+}
+
+BOOST_AUTO_TEST_CASE( small_budget_with_even_kernel_terminates )
+{
+
+  std::vector<int> shape(3, 40);
+  std::vector<int> kshape(3, 4);
+
+  anyfold::image_stack image(shape);
+  anyfold::image_stack kernel(kshape);
+  anyfold::fill_wave(image);
+  anyfold::fill_scattered(kernel);
+
+  anyfold::image_stack expected(shape);
+  anyfold::cpu::convolve_3d(image.data(), &shape[0], kernel.data(), &kshape[0], expected.data());
+
+  //budgets that shrink some axes of the block down to the kernel extent
+  const std::size_t budgets[] = {900, 1000, 1100, 1200};
+  for(const std::size_t budget : budgets){
+    anyfold::image_stack result(shape);
+    anyfold::cpu::overlap_save_convolve_3d(image.data(), &shape[0], kernel.data(), &kshape[0], result.data(), budget);
+    BOOST_CHECK_LT(anyfold::relative_error(expected, result), 1e-9);
+  }
+}
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE( convolve_front_door_works )
+
+BOOST_AUTO_TEST_CASE( every_cpu_backend_matches_direct )
+{
+
+  std::vector<int> shape(3);
+  shape[0] = 21; shape[1] = 26; shape[2] = 33;
+  std::vector<int> kshape(3);
+  kshape[0] = 5; kshape[1] = 7; kshape[2] = 3;
+
+  anyfold::image_stack image(shape);
+  anyfold::image_stack kernel(kshape);
+  anyfold::fill_wave(image);
+  for(int a = 0;a<kshape[0];++a)
+    for(int b = 0;b<kshape[1];++b)
+      for(int c = 0;c<kshape[2];++c)
+	kernel[a][b][c] = std::exp(-.3f*(a-2)*(a-2))*std::exp(-.1f*(b-3)*(b-3))*(1.f + c);
+
+  anyfold::image_stack expected(shape);
+  anyfold::cpu::convolve_3d(image.data(), &shape[0], kernel.data(), &kshape[0], expected.data());
+
+  anyfold::convolve_options options;
+  options.allow_opencl_ = false;
+
+  for(const anyfold::backend backend : anyfold::all_backends){
+    if(backend >= anyfold::backend::opencl_buffer || backend == anyfold::backend::cpu_low_rank)
+      continue;
+
+    //a budget the full size fft doesn't fit in enables overlap-save
+    options.backend_ = backend;
+    options.memory_budget_ = (backend == anyfold::backend::cpu_overlap_save) ? (64 << 10) : 0;
+    anyfold::image_stack result(shape);
+    BOOST_CHECK(anyfold::convolve(image.data(), &shape[0], kernel.data(), &kshape[0], result.data(), options) == backend);
+
+    const float error = anyfold::relative_error(expected, result);
+    BOOST_CHECK_MESSAGE(error < 1e-9, anyfold::name(backend) << " " << error);
+  }
+}
+
+BOOST_AUTO_TEST_CASE( cheapest_backend_is_chosen_and_logged )
+{
+
+  std::vector<int> shape(3, 24);
+  std::vector<int> kshape(3, 5);
+
+  anyfold::image_stack image(shape);
+  anyfold::image_stack kernel(kshape);
+  anyfold::fill_wave(image);
+  anyfold::fill_scattered(kernel);
+
+  anyfold::cost_model model;
+  model.fft_point_ = 1e-15;
+
+  anyfold::convolve_options options;
+  options.model_ = &model;
+  options.allow_opencl_ = false;
+  std::ostringstream log;
+  options.log_ = &log;
+
+  anyfold::image_stack result(shape);
+  BOOST_CHECK(anyfold::convolve(image.data(), &shape[0], kernel.data(), &kshape[0], result.data(), options) == anyfold::backend::cpu_fft);
+  BOOST_CHECK_NE(log.str().find("=> cpu_fft"), std::string::npos);
+
+  //the kernel is neither separable nor of low rank
+  options.backend_ = anyfold::backend::cpu_separable;
+  BOOST_CHECK_THROW(anyfold::convolve(image.data(), &shape[0], kernel.data(), &kshape[0], result.data(), options), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE( kernel_analysis_is_only_paid_when_it_can_pay_off )
+{
+
+  std::vector<int> shape(3);
+  shape[0] = 20; shape[1] = 22; shape[2] = 24;
+  std::vector<int> kshape(3);
+  kshape[0] = 7; kshape[1] = 9; kshape[2] = 5;
+
+  //of rank 2, like in rank2_kernel_matches_direct
+  anyfold::image_stack kernel(kshape);
+  for(int x = 0;x<kshape[0];++x)
+    for(int y = 0;y<kshape[1];++y)
+      for(int z = 0;z<kshape[2];++z){
+	const float r2 = (x-3)*(x-3) + (y-4)*(y-4) + (z-2)*(z-2);
+	kernel[x][y][z] = std::exp(-r2/2.f) + .2f*std::exp(-(x-3)*(x-3)/8.f)*std::exp(-(y-4)*(y-4)/1.f)*std::exp(-(z-2)*(z-2)/18.f);
+      }
+
+  anyfold::convolve_options options;
+  options.allow_opencl_ = false;
+  anyfold::kernel_analysis analysis;
+
+  //a backend that takes the kernel as it is needs no analysis at all
+  options.backend_ = anyfold::backend::cpu_vectorized;
+  anyfold::analyse_kernel(&shape[0], kernel.data(), &kshape[0], options, analysis);
+  BOOST_CHECK(!analysis.separable_);
+  BOOST_CHECK(analysis.terms_.empty());
+
+  options.backend_ = anyfold::backend::cpu_low_rank;
+  anyfold::analyse_kernel(&shape[0], kernel.data(), &kshape[0], options, analysis);
+  BOOST_CHECK(!analysis.terms_.empty());
+
+  //no decomposition if another backend beats rank 2 anyway
+  anyfold::cost_model model;
+  model.fft_point_ = 1e-15;
+  options.model_ = &model;
+  options.backend_ = anyfold::backend::automatic;
+  anyfold::analyse_kernel(&shape[0], kernel.data(), &kshape[0], options, analysis);
+  BOOST_CHECK(analysis.terms_.empty());
+
+  model = anyfold::cost_model();
+  model.separable_tap_ = 1e-15;
+  anyfold::analyse_kernel(&shape[0], kernel.data(), &kshape[0], options, analysis);
+  BOOST_CHECK(!analysis.terms_.empty());
+}
+
+BOOST_AUTO_TEST_CASE( calibration_round_trip )
+{
+  anyfold::cost_model model;
+  model.direct_tap_ = 3.25e-9;
+  model.opencl_separable_tap_ = 7e-12;
+
+  const boost::filesystem::path directory = boost::filesystem::temp_directory_path() /
+                                            boost::filesystem::unique_path();
+  boost::filesystem::create_directory(directory);
+  const std::string path = (directory / "calibration.txt").string();
+  model.save(path);
+
+  anyfold::cost_model loaded;
+  BOOST_CHECK(loaded.load(path));
+  BOOST_CHECK_CLOSE(loaded.direct_tap_, model.direct_tap_, 1e-3);
+  BOOST_CHECK_CLOSE(loaded.opencl_separable_tap_, model.opencl_separable_tap_, 1e-3);
+  BOOST_CHECK_CLOSE(loaded.fft_point_, model.fft_point_, 1e-3);
+  boost::filesystem::remove_all(directory);
+
+  BOOST_CHECK(!loaded.load(path));
+}
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE( tiled_convolution_works )
+
+BOOST_AUTO_TEST_CASE( cache_sizes_are_detected )
+{
+  const anyfold::cpu::cache_sizes& cache = anyfold::cpu::detected_cache_sizes();
+  BOOST_CHECK_GT(cache.l1_, 0u);
+  BOOST_CHECK_LE(cache.l1_, cache.l2_);
+
+  long interior[3] = {500, 500, 500};
+  std::vector<int> kshape(3, 9);
+  const std::vector<long> tile = anyfold::cpu::choose_tile_shape(interior, &kshape[0], cache);
+  BOOST_CHECK_LE((tile[0] + 8)*(tile[1] + 8)*(tile[2] + 8)*sizeof(float), cache.l2_);
+  BOOST_CHECK(tile[2] == 64 || 9*(tile[2] + 8)*sizeof(float) <= cache.l1_/2);
+  for(int d = 0;d<3;++d)
+    BOOST_CHECK_GE(tile[d], 1);
+}
+
+BOOST_AUTO_TEST_CASE( tiled_matches_vectorized )
+{
+
+  std::vector<int> shape(3);
+  shape[0] = 23; shape[1] = 30; shape[2] = 87;
+  std::vector<int> kshape(3);
+  kshape[0] = 3; kshape[1] = 7; kshape[2] = 5;
+
+  anyfold::image_stack image(shape);
+  anyfold::image_stack kernel(kshape);
+  anyfold::fill_wave(image);
+  anyfold::fill_scattered(kernel);
+
+  anyfold::image_stack expected(shape);
+  anyfold::cpu::vectorized_convolve_3d(image.data(), &shape[0], kernel.data(), &kshape[0], expected.data());
+
+  //automatic tiles and tiles that don't divide the interior
+  std::vector<long> tiles[2];
+  tiles[1].push_back(4); tiles[1].push_back(5); tiles[1].push_back(19);
+
+  for(int t = 0;t<2;++t){
+    anyfold::image_stack result(shape);
+    anyfold::cpu::tiled_convolve_3d(image.data(), &shape[0], kernel.data(), &kshape[0], result.data(), 3, tiles[t]);
+    //the lines are split differently, so scalar tails may round differently
+    BOOST_CHECK_LT(anyfold::relative_error(expected, result), 1e-10);
+  }
+}
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE( fixed_size_convolution_works )
+
+BOOST_AUTO_TEST_CASE( fixed_sizes_match_generic_loops )
+{
+
+  std::vector<int> shape(3);
+  shape[0] = 17; shape[1] = 14; shape[2] = 45;
+
+  anyfold::image_stack image(shape);
+  anyfold::fill_wave(image);
+
+  for(int size = 3;size<=7;size += 2){
+    std::vector<int> kshape(3, size);
+    anyfold::image_stack kernel(kshape);
+    anyfold::fill_scattered(kernel);
+
+    anyfold::image_stack expected(shape);
+    std::vector<int> offsets(3, size/2);
+    anyfold::cpu::convolve(image, kernel, expected, offsets);
+
+    anyfold::image_stack result(shape);
+    anyfold::cpu::convolve_3d(image.data(), &shape[0], kernel.data(), &kshape[0], result.data());
+    BOOST_CHECK_LT(anyfold::relative_error(expected, result), 1e-10);
+
+    //extents[0] runs fastest for discrete_convolve_3d, which keeps the source voxels on the border
+    anyfold::image_stack bordered(image);
+    anyfold::cpu::convolve_3d(image.data(), &shape[0], kernel.data(), &kshape[0], bordered.data());
+    std::vector<int> reversed(shape.rbegin(), shape.rend());
+    anyfold::image_stack discrete(shape);
+    anyfold::cpu::discrete_convolve_3d(image.data(), &reversed[0], kernel.data(), &kshape[0], discrete.data());
+    BOOST_CHECK(std::equal(bordered.data(), bordered.data() + bordered.num_elements(), discrete.data()));
+
+    anyfold::cpu::thread_pool pool(2);
+    anyfold::image_stack parallel(shape);
+    anyfold::cpu::parallel_convolve_3d(image.data(), &shape[0], kernel.data(), &kshape[0], parallel.data(), 3, pool);
+    BOOST_CHECK(std::equal(result.data(), result.data() + result.num_elements(), parallel.data()));
+  }
+}
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE( discrete_convolution_works )
+
+BOOST_AUTO_TEST_CASE( any_storage_order_matches_convolve_3d )
+{
+
+  std::vector<int> shape(3);
+  shape[0] = 13; shape[1] = 16; shape[2] = 21;
+  std::vector<int> kshape(3);
+  kshape[0] = 3; kshape[1] = 5; kshape[2] = 7;
+
+  anyfold::image_stack image(shape);
+  anyfold::image_stack kernel(kshape);
+  anyfold::fill_wave(image);
+  anyfold::fill_scattered(kernel);
+
+  anyfold::image_stack expected(image);
+  anyfold::cpu::vectorized_convolve_3d(image.data(), &shape[0], kernel.data(), &kshape[0], expected.data());
+
+  //the same memory seen as fortran ordered and as ordered (1,0,2) from fastest to slowest
+  const int orderings[3][3] = {{2,1,0}, {0,1,2}, {1,2,0}};
+  const bool ascending[3] = {true, true, true};
+  for(int o = 0;o<3;++o){
+    const anyfold::storage order(orderings[o], ascending);
+    std::vector<int> extents(3);
+    std::vector<int> kernel_extents(3);
+    for(int d = 0;d<3;++d){
+      extents[orderings[o][d]] = shape[2-d];
+      kernel_extents[orderings[o][d]] = kshape[2-d];
+    }
+
+    anyfold::image_stack result(shape);
+    anyfold::cpu::discrete_convolve_3d(image.data(), &extents[0], kernel.data(), &kernel_extents[0], result.data(), order);
+    BOOST_CHECK(std::equal(expected.data(), expected.data() + expected.num_elements(), result.data()));
+  }
+}
+
+BOOST_AUTO_TEST_CASE( generic_iterators_match_pointers )
+{
+
+  std::vector<int> shape(3);
+  shape[0] = 9; shape[1] = 11; shape[2] = 10;
+  std::vector<int> kshape(3);
+  kshape[0] = 5; kshape[1] = 3; kshape[2] = 3;
+
+  std::vector<float> image(9*11*10);
+  std::vector<float> kernel(5*3*3);
+  for(unsigned i = 0;i<image.size();++i)
+    image[i] = float(i % 7);
+  for(unsigned i = 0;i<kernel.size();++i)
+    kernel[i] = float(i % 3);
+
+  std::vector<float> expected(image.size());
+  anyfold::cpu::discrete_convolve_3d(&image[0], &shape[0], &kernel[0], &kshape[0], &expected[0]);
+
+  std::vector<float> result(image.size());
+  anyfold::cpu::discrete_convolve_3d(image.cbegin(), &shape[0], kernel.cbegin(), &kshape[0], result.begin());
+  BOOST_CHECK(expected == result);
+
+  //a single voxel: extents[0] is the fastest axis
+  const long x = 4, y = 5, z = 6;
+  float value = 0;
+  for(long c = 0;c<3;++c)
+    for(long b = 0;b<3;++b)
+      for(long a = 0;a<5;++a)
+	value += image[((z+1-c)*11 + y+1-b)*9 + x+2-a]*kernel[(c*3 + b)*5 + a];
+  BOOST_CHECK_EQUAL(result[(z*11 + y)*9 + x], value);
+}
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE( boundary_convolution_works )
+
+BOOST_AUTO_TEST_CASE( boundary_index_follows_the_mode )
+{
+  BOOST_CHECK_EQUAL(anyfold::boundary_index(-2, 5, anyfold::boundary_mode::zero), -1);
+  BOOST_CHECK_EQUAL(anyfold::boundary_index(6, 5, anyfold::boundary_mode::clamp), 4);
+  BOOST_CHECK_EQUAL(anyfold::boundary_index(-2, 5, anyfold::boundary_mode::mirror), 2);
+  BOOST_CHECK_EQUAL(anyfold::boundary_index(6, 5, anyfold::boundary_mode::mirror), 2);
+  BOOST_CHECK_EQUAL(anyfold::boundary_index(-9, 5, anyfold::boundary_mode::mirror), 1);
+  BOOST_CHECK_EQUAL(anyfold::boundary_index(-2, 5, anyfold::boundary_mode::periodic), 3);
+  BOOST_CHECK_EQUAL(anyfold::boundary_index(11, 5, anyfold::boundary_mode::periodic), 1);
+}
+
+BOOST_AUTO_TEST_CASE( every_mode_matches_explicit_padding )
+{
+
+  std::vector<int> shape(3);
+  shape[0] = 9; shape[1] = 4; shape[2] = 23;
+  //the kernel is wider than the image along dimension 1
+  std::vector<int> kshape(3);
+  kshape[0] = 3; kshape[1] = 7; kshape[2] = 5;
+
+  anyfold::image_stack image(shape);
+  anyfold::image_stack kernel(kshape);
+  anyfold::fill_wave(image);
+  anyfold::fill_scattered(kernel);
+
+  std::vector<int> padded_shape(3);
+  for(int d = 0;d<3;++d)
+    padded_shape[d] = shape[d] + 2*(kshape[d]/2);
+
+  const anyfold::boundary_mode modes[] = {anyfold::boundary_mode::zero, anyfold::boundary_mode::clamp,
+					  anyfold::boundary_mode::mirror, anyfold::boundary_mode::periodic};
+  for(const anyfold::boundary_mode mode : modes){
+    anyfold::image_stack padded(padded_shape);
+    for(int x = 0;x<padded_shape[0];++x)
+      for(int y = 0;y<padded_shape[1];++y)
+	for(int z = 0;z<padded_shape[2];++z){
+	  const long sx = anyfold::boundary_index(x - kshape[0]/2, shape[0], mode);
+	  const long sy = anyfold::boundary_index(y - kshape[1]/2, shape[1], mode);
+	  const long sz = anyfold::boundary_index(z - kshape[2]/2, shape[2], mode);
+	  padded[x][y][z] = (sx < 0 || sy < 0 || sz < 0) ? 0.f : image[sx][sy][sz];
+	}
+
+    anyfold::image_stack padded_result(padded_shape);
+    std::vector<int> offsets(kshape.begin(), kshape.end());
+    for(int d = 0;d<3;++d)
+      offsets[d] /= 2;
+    anyfold::cpu::convolve(padded, kernel, padded_result, offsets);
+    anyfold::image_stack expected = padded_result[boost::indices[anyfold::range(offsets[0], offsets[0] + shape[0])]
+						  [anyfold::range(offsets[1], offsets[1] + shape[1])]
+						  [anyfold::range(offsets[2], offsets[2] + shape[2])]];
+
+    anyfold::image_stack result(shape);
+    anyfold::cpu::convolve_boundary_3d(image.data(), &shape[0], kernel.data(), &kshape[0], result.data(), mode, 2);
+
+    BOOST_CHECK_LT(anyfold::relative_error(expected, result), 1e-10);
+  }
+}
+BOOST_AUTO_TEST_SUITE_END()
+
+#ifdef ANYFOLD_HAS_MMAP
+BOOST_AUTO_TEST_SUITE( out_of_core_convolution_works )
+
+BOOST_AUTO_TEST_CASE( streamed_file_matches_in_memory )
+{
+
+  std::vector<int> shape(3);
+  shape[0] = 31; shape[1] = 12; shape[2] = 40;
+  std::vector<int> kshape(3);
+  kshape[0] = 5; kshape[1] = 3; kshape[2] = 7;
+
+  anyfold::image_stack image(shape);
+  anyfold::image_stack kernel(kshape);
+  anyfold::fill_wave(image);
+  anyfold::fill_scattered(kernel);
+
+  anyfold::image_stack expected(shape);
+  std::fill(expected.data(), expected.data() + expected.num_elements(), 0.f);
+  anyfold::cpu::vectorized_convolve_3d(image.data(), &shape[0], kernel.data(), &kshape[0], expected.data());
+
+  //a directory of its own, parallel or read-only test runs don't collide
+  const boost::filesystem::path directory = boost::filesystem::temp_directory_path() /
+                                            boost::filesystem::unique_path();
+  boost::filesystem::create_directory(directory);
+  const std::string source = (directory / "source.raw").string();
+  const std::string destination = (directory / "destination.raw").string();
+  {
+    std::ofstream out(source.c_str(), std::ios::binary);
+    out.write(reinterpret_cast<const char*>(image.data()), sizeof(float)*image.num_elements());
+  }
+
+  //slabs that don't divide the interior and the automatic slab size
+  const std::size_t slabs[] = {4, 0};
+  for(const std::size_t slab : slabs){
+    anyfold::cpu::stream_convolve_file(source, destination, &shape[0], kernel.data(), &kshape[0], slab, 2);
+
+    anyfold::image_stack result(shape);
+    std::ifstream in(destination.c_str(), std::ios::binary);
+    in.read(reinterpret_cast<char*>(result.data()), sizeof(float)*result.num_elements());
+    BOOST_CHECK(in.gcount() == std::streamsize(sizeof(float)*result.num_elements()));
+    BOOST_CHECK(std::equal(expected.data(), expected.data() + expected.num_elements(), result.data()));
+  }
+
+  std::vector<int> larger(shape);
+  larger[0] += 1;
+  BOOST_CHECK_THROW(anyfold::cpu::stream_convolve_file(source, destination, &larger[0], kernel.data(), &kshape[0]), std::runtime_error);
+
+  boost::filesystem::remove_all(directory);
+}
+BOOST_AUTO_TEST_SUITE_END()
+#endif
+
+BOOST_AUTO_TEST_SUITE( plane_stream_works )
+
+BOOST_AUTO_TEST_CASE( pushed_planes_match_whole_stack )
+{
+
+  std::vector<int> shape(3);
+  shape[0] = 17; shape[1] = 11; shape[2] = 37;
+  anyfold::image_stack image(shape);
+  anyfold::fill_wave(image);
+
+  //odd and even extents along the streamed axis
+  const int depths[] = {5, 4};
+  for(const int depth : depths){
+    std::vector<int> kshape(3);
+    kshape[0] = depth; kshape[1] = 3; kshape[2] = 7;
+    anyfold::image_stack kernel(kshape);
+    anyfold::fill_scattered(kernel);
+
+    anyfold::image_stack expected(shape);
+    std::fill(expected.data(), expected.data() + expected.num_elements(), 0.f);
+    anyfold::cpu::vectorized_convolve_3d(image.data(), &shape[0], kernel.data(), &kshape[0], expected.data());
+
+    anyfold::cpu::plane_stream stream(&shape[1], kernel.data(), &kshape[0], 2);
+    BOOST_CHECK_EQUAL(stream.latency(), kshape[0] - 1 - kshape[0]/2);
+
+    const long plane = shape[1]*shape[2];
+    std::vector<float> output(plane);
+    //two passes to check that reset starts a new stack
+    for(int pass = 0;pass<2;++pass){
+      stream.reset();
+      for(int x = 0;x<shape[0];++x){
+	std::fill(output.begin(), output.end(), 0.f);
+	const bool emitted = stream.push(image.data() + x*plane, &output[0]);
+	BOOST_CHECK_EQUAL(emitted, x >= kshape[0] - 1);
+	if(!emitted)
+	  continue;
+
+	const long index = stream.emitted() - 1 + kshape[0]/2;
+	BOOST_CHECK_EQUAL(index, x - stream.latency());
+	//the extra plane of an even kernel is outside the interior of expected
+	if(index < shape[0] - kshape[0]/2)
+	  BOOST_CHECK(std::equal(output.begin(), output.end(), expected.data() + index*plane));
+      }
+      BOOST_CHECK_EQUAL(stream.emitted(), shape[0] - kshape[0] + 1);
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE( in_place_matches_separate_output )
+{
+
+  std::vector<int> shape(3);
+  shape[0] = 23; shape[1] = 14; shape[2] = 29;
+
+  //odd, even and cubic even kernels
+  const int kernels[][3] = {{7, 5, 3}, {4, 5, 6}, {4, 4, 4}};
+  for(const auto& extents : kernels){
+    std::vector<int> kshape(extents, extents + 3);
+    anyfold::image_stack image(shape);
+    anyfold::image_stack kernel(kshape);
+    anyfold::fill_wave(image);
+    anyfold::fill_scattered(kernel);
+
+    //the border keeps the input values
+    anyfold::image_stack expected = image;
+    anyfold::cpu::vectorized_convolve_3d(image.data(), &shape[0], kernel.data(), &kshape[0], expected.data());
+
+    anyfold::cpu::convolve_in_place_3d(image.data(), &shape[0], kernel.data(), &kshape[0], 2);
+    BOOST_CHECK(std::equal(image.data(), image.data() + image.num_elements(), expected.data()));
+  }
+}
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE( convolution_plan_works )
+
+BOOST_AUTO_TEST_CASE( repeated_executes_match_convolve )
+{
+
+  std::vector<int> shape(3);
+  shape[0] = 21; shape[1] = 26; shape[2] = 33;
+  std::vector<int> kshape(3);
+  kshape[0] = 5; kshape[1] = 7; kshape[2] = 3;
+
+  anyfold::image_stack kernel(kshape);
+  for(int a = 0;a<kshape[0];++a)
+    for(int b = 0;b<kshape[1];++b)
+      for(int c = 0;c<kshape[2];++c)
+	kernel[a][b][c] = std::exp(-.3f*(a-2)*(a-2))*std::exp(-.1f*(b-3)*(b-3))*(1.f + c);
+
+  //two different images through the same plan to see that nothing of the first run sticks
+  std::vector<anyfold::image_stack> images(2, anyfold::image_stack(shape));
+  anyfold::fill_wave(images[0]);
+  for(unsigned i = 0;i<images[1].num_elements();++i)
+    images[1].data()[i] = std::cos(.37f*i);
+
+  anyfold::convolve_options options;
+  options.allow_opencl_ = false;
+
+  for(const anyfold::backend backend : anyfold::all_backends){
+    if(backend >= anyfold::backend::opencl_buffer || backend == anyfold::backend::cpu_low_rank)
+      continue;
+
+    options.backend_ = backend;
+    options.memory_budget_ = (backend == anyfold::backend::cpu_overlap_save) ? (64 << 10) : 0;
+    const anyfold::plan plan = anyfold::make_plan(&shape[0], kernel.data(), &kshape[0], options);
+    BOOST_CHECK(plan.chosen() == backend);
+    BOOST_CHECK_EQUAL(plan.image_shape()[2], shape[2]);
+
+    for(int run = 0;run<3;++run){
+      const anyfold::image_stack& image = images[run % 2];
+      anyfold::image_stack expected(shape);
+      anyfold::image_stack result(shape);
+      anyfold::convolve(image.data(), &shape[0], kernel.data(), &kshape[0], expected.data(), options);
+      plan.execute(image.data(), result.data());
+
+      const float error = anyfold::relative_error(expected, result);
+      BOOST_CHECK_MESSAGE(error < 1e-9, anyfold::name(backend) << " run " << run << " " << error);
+    }
+  }
+
+  std::ostringstream log;
+  options.backend_ = anyfold::backend::automatic;
+  options.log_ = &log;
+  anyfold::make_plan(&shape[0], kernel.data(), &kshape[0], options);
+  BOOST_CHECK_NE(log.str().find("[anyfold::make_plan]"), std::string::npos);
+}
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE( batched_convolution_works )
+
+BOOST_AUTO_TEST_CASE( batches_match_single_executes )
+{
+
+  std::vector<int> shape(3);
+  shape[0] = 14; shape[1] = 17; shape[2] = 23;
+  std::vector<int> kshape(3);
+  kshape[0] = 3; kshape[1] = 5; kshape[2] = 7;
+  const std::size_t count = 5;
+  const std::size_t volume = shape[0]*shape[1]*shape[2];
+
+  anyfold::image_stack kernel(kshape);
+  anyfold::fill_scattered(kernel);
+
+  //the images packed into one 4D buffer, with a gap between them
+  const std::size_t stride = volume + 11;
+  std::vector<float> images(count*stride);
+  anyfold::fill_wave(&images[0], images.size());
+
+  //a pool of its own, so that the images are spread over forks on any host
+  anyfold::cpu::thread_pool pool(3);
+  anyfold::convolve_options options;
+  options.allow_opencl_ = false;
+  options.num_threads_ = pool.size();
+
+  const anyfold::backend backends[] = {anyfold::backend::cpu_vectorized, anyfold::backend::cpu_fft};
+  for(const anyfold::backend backend : backends){
+    options.backend_ = backend;
+    const anyfold::plan plan = anyfold::make_plan(&shape[0], kernel.data(), &kshape[0], options);
+
+    std::vector<float> expected(count*stride, 0.f);
+    for(std::size_t i = 0;i<count;++i)
+      plan.execute(&images[i*stride], &expected[i*stride]);
+
+    std::vector<float> strided(count*stride, 0.f);
+    BOOST_CHECK(anyfold::convolve_batch(&images[0], &strided[0], count, stride,
+					&shape[0], kernel.data(), &kshape[0], options, pool) == backend);
+    //forks transform with one thread, fftw may pick another algorithm for that
+    BOOST_CHECK_LT(anyfold::relative_error(&expected[0], &strided[0], expected.size()), 1e-9);
+
+    std::vector<const float*> src(count);
+    std::vector<float*> out(count);
+    std::vector<float> pointed(count*stride, 0.f);
+    for(std::size_t i = 0;i<count;++i){
+      src[i] = &images[i*stride];
+      out[i] = &pointed[i*stride];
+    }
+    BOOST_CHECK_EQUAL(plan.forks(), 0u);
+    plan.execute_batch(&src[0], &out[0], count, pool);
+    BOOST_CHECK_EQUAL(plan.forks(), pool.size());
+    BOOST_CHECK_LT(anyfold::relative_error(&expected[0], &pointed[0], expected.size()), 1e-9);
+
+    //the forks are kept for the next batch
+    std::fill(pointed.begin(), pointed.end(), 0.f);
+    plan.execute_batch(&src[0], &out[0], count, pool);
+    BOOST_CHECK_EQUAL(plan.forks(), pool.size());
+    BOOST_CHECK_LT(anyfold::relative_error(&expected[0], &pointed[0], expected.size()), 1e-9);
+
+    //a single threaded fork has its own scratch but the same result
+    std::vector<float> forked(volume, 0.f);
+    plan.fork(1).execute(&images[0], &forked[0]);
+    BOOST_CHECK_LT(anyfold::relative_error(&expected[0], &forked[0], volume), 1e-9);
+  }
+}
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE( filter_bank_works )
+
+BOOST_AUTO_TEST_CASE( every_kernel_matches_single_convolution )
+{
+
+  std::vector<int> shape(3);
+  shape[0] = 19; shape[1] = 24; shape[2] = 37;
+
+  //kernels of different sizes, the interiors differ, the last one is even
+  int extents[4][3] = {{3, 3, 3}, {5, 7, 3}, {7, 5, 5}, {4, 6, 2}};
+  int* kernel_extents[4] = {extents[0], extents[1], extents[2], extents[3]};
+  std::vector<anyfold::image_stack> kernels;
+  for(int k = 0;k<4;++k){
+    std::vector<int> kshape(extents[k], extents[k] + 3);
+    kernels.push_back(anyfold::image_stack(kshape));
+    for(unsigned i = 0;i<kernels[k].num_elements();++i)
+      kernels[k].data()[i] = std::cos(1.3f*i*i + k);
+  }
+  const float* kernel_begins[4] = {kernels[0].data(), kernels[1].data(), kernels[2].data(), kernels[3].data()};
+
+  anyfold::image_stack image(shape);
+  anyfold::fill_wave(image);
+
+  std::vector<anyfold::image_stack> expected(4, anyfold::image_stack(shape));
+  for(int k = 0;k<4;++k){
+    std::fill(expected[k].data(), expected[k].data() + expected[k].num_elements(), 0.f);
+    anyfold::cpu::vectorized_convolve_3d(image.data(), &shape[0], kernel_begins[k], kernel_extents[k], expected[k].data());
+  }
+
+  anyfold::convolve_options options;
+  const anyfold::backend backends[] = {anyfold::backend::cpu_tiled, anyfold::backend::cpu_fft};
+  for(const anyfold::backend backend : backends){
+    std::vector<anyfold::image_stack> result(4, anyfold::image_stack(shape));
+    float* out_begins[4];
+    for(int k = 0;k<4;++k){
+      std::fill(result[k].data(), result[k].data() + result[k].num_elements(), 0.f);
+      out_begins[k] = result[k].data();
+    }
+
+    options.backend_ = backend;
+    BOOST_CHECK(anyfold::convolve_bank(image.data(), &shape[0], kernel_begins, kernel_extents, 4, out_begins, options) == backend);
+
+    for(int k = 0;k<4;++k){
+      const float error = anyfold::relative_error(expected[k], result[k]);
+      BOOST_CHECK_MESSAGE(error < 1e-9, anyfold::name(backend) << " kernel " << k << " " << error);
+    }
+  }
+
+  options.backend_ = anyfold::backend::cpu_low_rank;
+  std::vector<float> scratch(image.num_elements());
+  float* scratch_begins[4] = {&scratch[0], &scratch[0], &scratch[0], &scratch[0]};
+  BOOST_CHECK_THROW(anyfold::convolve_bank(image.data(), &shape[0], kernel_begins, kernel_extents, 4, scratch_begins, options), std::runtime_error);
+
+  std::ostringstream log;
+  options.backend_ = anyfold::backend::automatic;
+  options.log_ = &log;
+  anyfold::convolve_bank(image.data(), &shape[0], kernel_begins, kernel_extents, 4, scratch_begins, options);
+  BOOST_CHECK_NE(log.str().find("=> cpu_"), std::string::npos);
+}
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE( scratch_pool_works )
+
+BOOST_AUTO_TEST_CASE( blocks_are_aligned_reused_and_counted )
+{
+
+  anyfold::cpu::scratch_pool pool;
+  void* first = pool.acquire(1000);
+  BOOST_CHECK_EQUAL(reinterpret_cast<std::size_t>(first) % 64, 0u);
+  BOOST_CHECK_EQUAL(pool.bytes_in_use(), 1024u);
+
+  {
+    anyfold::cpu::scratch_buffer<float> buffer(3000, pool);
+    BOOST_CHECK_EQUAL(reinterpret_cast<std::size_t>(buffer.data()) % 64, 0u);
+    BOOST_CHECK_EQUAL(pool.bytes_in_use(), 1024u + 12032u);
+  }
+  BOOST_CHECK_EQUAL(pool.bytes_in_use(), 1024u);
+  BOOST_CHECK_EQUAL(pool.peak_bytes(), 1024u + 12032u);
+  BOOST_CHECK_EQUAL(pool.cached_bytes(), 12032u);
+
+  //a request of the same rounded size gets the cached block back
+  pool.release(first);
+  void* second = pool.acquire(1010);
+  BOOST_CHECK_EQUAL(first, second);
+  pool.release(second);
+  BOOST_CHECK_EQUAL(pool.bytes_in_use(), 0u);
+
+  pool.reset_peak();
+  BOOST_CHECK_EQUAL(pool.peak_bytes(), 0u);
+  pool.trim();
+  BOOST_CHECK_EQUAL(pool.cached_bytes(), 0u);
+
+  pool.set_cache_limit(0);
+  pool.release(pool.acquire(64));
+  BOOST_CHECK_EQUAL(pool.cached_bytes(), 0u);
+}
+
+BOOST_AUTO_TEST_CASE( cache_stays_bounded_for_varying_shapes )
+{
+
+  //one block at a time of ever new sizes, like tiles or fft paddings of changing
+  //image shapes: only the largest working set stays cached
+  anyfold::cpu::scratch_pool pool;
+  std::size_t largest = 0;
+  for(std::size_t n = 1;n<=50;++n){
+    anyfold::cpu::scratch_buffer<float> buffer(1000*n + 7*(n % 3), pool);
+    largest = std::max(largest, pool.bytes_in_use());
+  }
+  BOOST_CHECK_EQUAL(pool.cache_limit(), largest);
+  BOOST_CHECK_LE(pool.cached_bytes(), largest);
+  BOOST_CHECK_GT(pool.cached_bytes(), 0u);
+
+  //the blocks released longest ago go first, the latest of a size is reused
+  pool.trim();
+  pool.set_cache_limit(3*1024);
+  void* blocks[4];
+  for(int i = 0;i<4;++i)
+    blocks[i] = pool.acquire(1024);
+  for(int i = 0;i<4;++i)
+    pool.release(blocks[i]);
+  BOOST_CHECK_EQUAL(pool.cached_bytes(), 3*1024u);
+  void* reused = pool.acquire(1024);
+  BOOST_CHECK_EQUAL(reused, blocks[3]);
+  pool.release(reused);
+
+  //a smaller limit evicts at once
+  pool.set_cache_limit(1024);
+  BOOST_CHECK_EQUAL(pool.cached_bytes(), 1024u);
+  pool.set_cache_limit(anyfold::cpu::scratch_pool::automatic_limit);
+  BOOST_CHECK_EQUAL(pool.cache_limit(), largest);
+}
+
+BOOST_AUTO_TEST_CASE( repeated_fft_convolutions_allocate_nothing_new )
+{
+
+  std::vector<int> shape(3);
+  shape[0] = 21; shape[1] = 30; shape[2] = 17;
+  std::vector<int> kshape(3, 5);
+
+  anyfold::image_stack image(shape);
+  anyfold::image_stack kernel(kshape);
+  anyfold::image_stack output(shape);
+  anyfold::fill_wave(image);
+  anyfold::fill_scattered(kernel);
+
+  anyfold::cpu::scratch_pool& pool = anyfold::cpu::scratch_pool::global();
+  const std::size_t in_use = pool.bytes_in_use();
+  anyfold::cpu::fft_convolve_3d(image.data(), &shape[0], kernel.data(), &kshape[0], output.data(), 1);
+  BOOST_CHECK_EQUAL(pool.bytes_in_use(), in_use);
+
+  const std::size_t cached = pool.cached_bytes();
+  pool.reset_peak();
+  anyfold::cpu::fft_convolve_3d(image.data(), &shape[0], kernel.data(), &kshape[0], output.data(), 1);
+  BOOST_CHECK_EQUAL(pool.cached_bytes(), cached);
+  BOOST_CHECK_GT(pool.peak_bytes(), in_use);
+}
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE( reduced_precision_works )
+
+BOOST_AUTO_TEST_CASE( conversions_round_trip_and_agree_with_simd )
+{
+
+  //every binary16 value survives the way through float, nan stays nan
+  for(std::uint32_t bits = 0;bits<0x10000;++bits){
+    anyfold::float16 value;
+    value.bits_ = bits;
+    const float wide = anyfold::to_float(value);
+    //bit tests, fast math builds may assume there is no nan
+    if((bits & 0x7c00) == 0x7c00 && (bits & 0x3ff))
+      BOOST_CHECK((anyfold::to_float16(wide).bits_ & 0x7e00) == 0x7e00);
+    else
+      BOOST_CHECK_EQUAL(anyfold::to_float16(wide).bits_, value.bits_);
+  }
+  BOOST_CHECK_EQUAL(anyfold::to_float(anyfold::to_float16(1.f/3.f)), 0.333251953125f);
+  BOOST_CHECK_EQUAL(anyfold::to_float16(65520.f).bits_, 0x7c00);
+  BOOST_CHECK_EQUAL(anyfold::to_float16(5.96046448e-8f).bits_, 0x0001);
+  BOOST_CHECK_EQUAL(anyfold::to_float(anyfold::to_bfloat16(1.00390625f)), 1.f);
+  BOOST_CHECK_EQUAL(anyfold::to_float(anyfold::to_bfloat16(1.01171875f)), 1.015625f);
+
+  std::vector<float> values(1003);
+  for(unsigned i = 0;i<values.size();++i)
+    values[i] = std::sin(.37f*i)*std::pow(10.f, float(i % 9) - 4.f);
+
+  std::vector<anyfold::float16> halves[2] = {std::vector<anyfold::float16>(values.size()), std::vector<anyfold::float16>(values.size())};
+  std::vector<anyfold::bfloat16> brains[2] = {std::vector<anyfold::bfloat16>(values.size()), std::vector<anyfold::bfloat16>(values.size())};
+  std::vector<float> back[4] = {values, values, values, values};
+  const anyfold::cpu::instruction_set isas[2] = {anyfold::cpu::instruction_set::scalar, anyfold::cpu::best_instruction_set()};
+  for(int i = 0;i<2;++i){
+    anyfold::cpu::store_samples(&values[0], &halves[i][0], values.size(), isas[i]);
+    anyfold::cpu::store_samples(&values[0], &brains[i][0], values.size(), isas[i]);
+    anyfold::cpu::load_samples(&halves[i][0], &back[i][0], values.size(), isas[i]);
+    anyfold::cpu::load_samples(&brains[i][0], &back[2 + i][0], values.size(), isas[i]);
+  }
+  for(unsigned i = 0;i<values.size();++i){
+    BOOST_CHECK_EQUAL(halves[0][i].bits_, halves[1][i].bits_);
+    BOOST_CHECK_EQUAL(brains[0][i].bits_, brains[1][i].bits_);
+  }
+  BOOST_CHECK(back[0] == back[1]);
+  BOOST_CHECK(back[2] == back[3]);
+}
+
+BOOST_AUTO_TEST_CASE( half_storage_matches_float_convolution )
+{
+
+  std::vector<int> shape(3);
+  shape[0] = 13; shape[1] = 22; shape[2] = 41;
+  anyfold::image_stack image(shape);
+  anyfold::fill_wave(image);
+
+  //an odd kernel and one that is even along the streamed axis
+  const int kernels[][3] = {{3, 5, 7}, {4, 5, 6}};
+  for(const auto& extents : kernels){
+    std::vector<int> kshape(extents, extents + 3);
+    anyfold::image_stack kernel(kshape);
+    anyfold::fill_scattered(kernel, kernel.num_elements());
+
+    //the reference sees the same rounded input
+    std::vector<anyfold::float16> halves(image.num_elements());
+    std::vector<anyfold::bfloat16> brains(image.num_elements());
+    anyfold::image_stack rounded[2] = {image, image};
+    for(unsigned i = 0;i<image.num_elements();++i){
+      halves[i] = anyfold::to_float16(image.data()[i]);
+      brains[i] = anyfold::to_bfloat16(image.data()[i]);
+      rounded[0].data()[i] = anyfold::to_float(halves[i]);
+      rounded[1].data()[i] = anyfold::to_float(brains[i]);
+    }
+
+    anyfold::image_stack expected[2] = {anyfold::image_stack(shape), anyfold::image_stack(shape)};
+    for(int t = 0;t<2;++t){
+      std::fill(expected[t].data(), expected[t].data() + expected[t].num_elements(), 0.f);
+      anyfold::cpu::vectorized_convolve_3d(rounded[t].data(), &shape[0], kernel.data(), &kshape[0], expected[t].data());
+    }
+
+    std::vector<anyfold::float16> half_result(image.num_elements(), anyfold::to_float16(0.f));
+    std::vector<anyfold::bfloat16> brain_result(image.num_elements(), anyfold::to_bfloat16(0.f));
+    std::vector<float> float_result(image.num_elements(), 0.f);
+    anyfold::cpu::typed_convolve_3d(&halves[0], &shape[0], kernel.data(), &kshape[0], &half_result[0], 2);
+    anyfold::cpu::typed_convolve_3d(&brains[0], &shape[0], kernel.data(), &kshape[0], &brain_result[0], 2);
+    anyfold::cpu::typed_convolve_3d(&halves[0], &shape[0], kernel.data(), &kshape[0], &float_result[0], 2);
+
+    //only the final rounding to the storage type differs
+    for(unsigned i = 0;i<image.num_elements();++i){
+      BOOST_CHECK_EQUAL(half_result[i].bits_, anyfold::to_float16(expected[0].data()[i]).bits_);
+      BOOST_CHECK_EQUAL(brain_result[i].bits_, anyfold::to_bfloat16(expected[1].data()[i]).bits_);
+      BOOST_CHECK_EQUAL(float_result[i], expected[0].data()[i]);
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE( integer_samples_convert_scale_and_saturate )
+{
+
+  std::vector<float> values(259);
+  for(unsigned i = 0;i<values.size();++i)
+    values[i] = 300.f*std::sin(.41f*i) + 100.f;
+  values[3] = 2.5f;
+  values[4] = 3.5f;
+  values[5] = -7.f;
+  values[6] = 70000.f;
+
+  const anyfold::cpu::instruction_set isas[2] = {anyfold::cpu::instruction_set::scalar, anyfold::cpu::best_instruction_set()};
+  std::vector<std::uint8_t> bytes[2] = {std::vector<std::uint8_t>(values.size()), std::vector<std::uint8_t>(values.size())};
+  std::vector<std::uint16_t> words[2] = {std::vector<std::uint16_t>(values.size()), std::vector<std::uint16_t>(values.size())};
+  for(int i = 0;i<2;++i){
+    anyfold::cpu::store_samples(&values[0], &bytes[i][0], values.size(), isas[i]);
+    anyfold::cpu::store_samples(&values[0], &words[i][0], values.size(), isas[i]);
+  }
+  BOOST_CHECK(bytes[0] == bytes[1]);
+  BOOST_CHECK(words[0] == words[1]);
+  BOOST_CHECK_EQUAL(int(bytes[0][3]), 2);
+  BOOST_CHECK_EQUAL(int(bytes[0][4]), 4);
+  BOOST_CHECK_EQUAL(int(bytes[0][5]), 0);
+  BOOST_CHECK_EQUAL(int(bytes[0][6]), 255);
+  BOOST_CHECK_EQUAL(int(words[0][6]), 65535);
+
+  std::vector<float> back[2] = {values, values};
+  for(int i = 0;i<2;++i)
+    anyfold::cpu::load_samples(&words[0][0], &back[i][0], values.size(), isas[i]);
+  BOOST_CHECK(back[0] == back[1]);
+  for(unsigned i = 0;i<values.size();++i)
+    BOOST_CHECK_EQUAL(back[0][i], float(words[0][i]));
+
+  //camera frames in, a scaled 8 bit result out
+  std::vector<int> shape(3);
+  shape[0] = 9; shape[1] = 16; shape[2] = 35;
+  std::vector<int> kshape(3, 3);
+  std::vector<std::uint16_t> image(shape[0]*shape[1]*shape[2]);
+  anyfold::image_stack reference(shape);
+  for(unsigned i = 0;i<image.size();++i){
+    image[i] = (i*7919) % 4096;
+    reference.data()[i] = image[i];
+  }
+  anyfold::image_stack kernel(kshape);
+  std::fill(kernel.data(), kernel.data() + kernel.num_elements(), 1.f/27);
+
+  anyfold::image_stack expected(shape);
+  std::fill(expected.data(), expected.data() + expected.num_elements(), 0.f);
+  anyfold::cpu::vectorized_convolve_3d(reference.data(), &shape[0], kernel.data(), &kshape[0], expected.data());
+
+  const anyfold::cpu::sample_scaling scaling(1.f/16, -8.f);
+  std::vector<std::uint8_t> result(image.size(), 0);
+  anyfold::cpu::typed_convolve_3d(&image[0], &shape[0], kernel.data(), &kshape[0], &result[0], scaling, 2);
+  for(int x = 1;x<shape[0] - 1;++x)
+    for(int y = 1;y<shape[1] - 1;++y)
+      for(int z = 1;z<shape[2] - 1;++z){
+	const long i = (x*shape[1] + y)*shape[2] + z;
+	BOOST_CHECK_EQUAL(int(result[i]), int(anyfold::saturate_sample<std::uint8_t>(expected.data()[i]/16 - 8.f)));
+      }
+}
+BOOST_AUTO_TEST_SUITE_END()
@@ -6,6 +6,8 @@
 #include "test_fixtures.hpp"
 #include <numeric>
 #include <algorithm>
+#include <cstdlib>
+#include <boost/filesystem.hpp>
 #include "anyfold.hpp"
 
 #include "test_algorithms.hpp"
@@ -530,3 +532,309 @@ BOOST_FIXTURE_TEST_CASE_TEMPLATE(all1_convolveImageLocalMem, T, Fixtures, T)
 				       T::output_.num_elements());
 	BOOST_REQUIRE_CLOSE(l2norm, 0, .00001);
 }
+
+BOOST_FIXTURE_TEST_CASE_TEMPLATE(all1_convolveSeparable, T, Fixtures, T)
+{
+	std::vector<float> k0(T::kernel_dims_[0], 1.f);
+	std::vector<float> k1(T::kernel_dims_[1], 1.f);
+	std::vector<float> k2(T::kernel_dims_[2], 1.f);
+
+	anyfold::opencl::convolve_3dSeparable(T::padded_image_.data(),(int*)&T::padded_image_shape_[0],
+	                             &k0[0], &k1[0], &k2[0], &T::kernel_dims_[0],
+	                             T::padded_output_.data());
+
+	float l2norm = anyfold::l2norm(T::padded_output_.data(),
+				       T::padded_image_folded_by_all1_.data(),
+				       T::padded_output_.num_elements());
+	BOOST_REQUIRE_CLOSE(l2norm, 0, .00001);
+}
+
+BOOST_FIXTURE_TEST_CASE_TEMPLATE(all1_variants_share_runtime, T, Fixtures, T)
+{
+	const cl_context context = anyfold::opencl::Runtime::global().context()();
+
+	anyfold::opencl::convolve_3dBuffer(T::image_.data(),(int*)&T::image_shape_[0],
+	                             T::all1_kernel_.data(),&T::kernel_dims_[0],
+	                             T::output_.data());
+	float l2norm = anyfold::l2norm(T::output_.data(),
+				       T::image_folded_by_all1_.data(),
+				       T::output_.num_elements());
+	BOOST_CHECK_CLOSE(l2norm, 0, .00001);
+
+	anyfold::opencl::convolve_3dImage(T::image_.data(),(int*)&T::image_shape_[0],
+	                             T::all1_kernel_.data(),&T::kernel_dims_[0],
+	                             T::output_.data());
+	l2norm = anyfold::l2norm(T::output_.data(),
+				 T::image_folded_by_all1_.data(),
+				 T::output_.num_elements());
+	BOOST_CHECK_CLOSE(l2norm, 0, .00001);
+
+	// no call created a context of its own
+	BOOST_CHECK(anyfold::opencl::Runtime::global().context()() == context);
+}
+
+BOOST_FIXTURE_TEST_CASE_TEMPLATE(repeated_convolveBuffer_compiles_once, T, Fixtures, T)
+{
+	anyfold::opencl::convolve_3dBuffer(T::image_.data(),(int*)&T::image_shape_[0],
+	                             T::all1_kernel_.data(),&T::kernel_dims_[0],
+	                             T::output_.data());
+	const std::size_t compilations = anyfold::opencl::Runtime::global().compilations();
+
+	// same source, defines and device: the program comes from the cache
+	anyfold::opencl::convolve_3dBuffer(T::image_.data(),(int*)&T::image_shape_[0],
+	                             T::all1_kernel_.data(),&T::kernel_dims_[0],
+	                             T::output_.data());
+	BOOST_CHECK_EQUAL(anyfold::opencl::Runtime::global().compilations(), compilations);
+
+	float l2norm = anyfold::l2norm(T::output_.data(),
+				       T::image_folded_by_all1_.data(),
+				       T::output_.num_elements());
+	BOOST_CHECK_CLOSE(l2norm, 0, .00001);
+}
+
+BOOST_FIXTURE_TEST_CASE(programs_are_loaded_from_the_disk_cache, fixture_3D_64_5_9_13)
+{
+	// a fresh cache below directories that don't exist yet
+	const boost::filesystem::path root = boost::filesystem::temp_directory_path() /
+	                                     boost::filesystem::unique_path();
+	const boost::filesystem::path directory = root / "nested" / "cache";
+	const char* previous = std::getenv("ANYFOLD_CL_CACHE");
+	const std::string restore = previous ? previous : "";
+	setenv("ANYFOLD_CL_CACHE", directory.string().c_str(), 1);
+
+	anyfold::opencl::Runtime& runtime = anyfold::opencl::Runtime::global();
+	anyfold::image_stack_cref kernel(all1_kernel_.data(), kernel_dims_);
+	std::vector<int> offsets(3);
+	for (unsigned i = 0; i < offsets.size(); ++i)
+		offsets[i] = kernel_dims_[i]/2;
+	auto convolve = [&](){
+		anyfold::opencl::Convolution3DCLBuffer c;
+		c.setupCLcontext();
+		c.createProgramAndLoadKernel("convolution3dBuffer.cl", "convolution3d", kernel.shape());
+		c.setupKernelArgs(padded_image_, kernel, offsets);
+		c.execute();
+		c.getResult(padded_output_);
+	};
+
+	// compiled, the binary is renamed into place
+	runtime.forgetPrograms();
+	const std::size_t compilations = runtime.compilations();
+	convolve();
+	BOOST_CHECK_EQUAL(runtime.compilations(), compilations + 1);
+	std::vector<boost::filesystem::path> files;
+	if(boost::filesystem::is_directory(directory))
+		for(boost::filesystem::directory_iterator i(directory); i != boost::filesystem::directory_iterator(); ++i)
+			files.push_back(i->path());
+	BOOST_REQUIRE_EQUAL(files.size(), 1u);
+	BOOST_CHECK_EQUAL(files[0].extension().string(), ".bin");
+	BOOST_CHECK_GT(boost::filesystem::file_size(files[0]), 0u);
+
+	// nothing in memory, the binary is loaded instead of compiled
+	runtime.forgetPrograms();
+	std::fill(padded_output_.data(), padded_output_.data() + padded_output_.num_elements(), 0.f);
+	convolve();
+	BOOST_CHECK_EQUAL(runtime.compilations(), compilations + 1);
+	BOOST_CHECK_CLOSE(anyfold::l2norm(padded_output_.data(),
+	                                  padded_image_folded_by_all1_.data(),
+	                                  padded_output_.num_elements()), 0, .00001);
+
+	if(previous)
+		setenv("ANYFOLD_CL_CACHE", restore.c_str(), 1);
+	else
+		unsetenv("ANYFOLD_CL_CACHE");
+	boost::filesystem::remove_all(root);
+}
+
+BOOST_AUTO_TEST_CASE(kernel_sources_are_embedded)
+{
+	// found by file name or path, without the source tree
+	BOOST_CHECK(anyfold::opencl::hasKernelSource("convolution3dBuffer.cl"));
+	BOOST_CHECK(anyfold::opencl::hasKernelSource("/nowhere/convolution3dSeparable.cl"));
+	BOOST_CHECK(anyfold::opencl::kernelSource("convolution3dImageLocalMem.cl").find("convolution3d") != std::string::npos);
+
+	// a missing kernel is an error instead of an empty program
+	BOOST_CHECK(!anyfold::opencl::hasKernelSource("missing.cl"));
+	BOOST_CHECK_THROW(anyfold::opencl::kernelSource("missing.cl"), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(devices_are_listed_and_selected)
+{
+	const std::vector<anyfold::opencl::DeviceInfo> devices = anyfold::opencl::Runtime::listDevices();
+	BOOST_REQUIRE(!devices.empty());
+	for(std::size_t i = 0; i < devices.size(); ++i)
+		BOOST_CHECK_EQUAL(devices[i].index, i);
+
+	// by index
+	const anyfold::opencl::DeviceInfo& current = anyfold::opencl::Runtime::global().deviceInfo();
+	BOOST_CHECK_EQUAL(anyfold::opencl::Runtime::findDevice(std::to_string(current.index)).name, current.name);
+
+	// the default is the fastest device, ranked once and remembered in a fresh
+	// cache (a single device needs no ranking), also if nothing matches
+	const boost::filesystem::path root = boost::filesystem::temp_directory_path() /
+	                                     boost::filesystem::unique_path();
+	const char* previous = std::getenv("ANYFOLD_CL_CACHE");
+	const std::string restore = previous ? previous : "";
+	setenv("ANYFOLD_CL_CACHE", root.string().c_str(), 1);
+	const std::size_t fastest = anyfold::opencl::Runtime::findDevice("").index;
+	const long available = std::count_if(devices.begin(), devices.end(),
+	                                     [](const anyfold::opencl::DeviceInfo& d){ return d.available; });
+	BOOST_CHECK_EQUAL(boost::filesystem::exists(root / "devices.rank"), available > 1);
+	BOOST_CHECK_EQUAL(anyfold::opencl::Runtime::findDevice("").index, fastest);
+	BOOST_CHECK_EQUAL(anyfold::opencl::Runtime::findDevice("no such device").index, fastest);
+	if(previous)
+		setenv("ANYFOLD_CL_CACHE", restore.c_str(), 1);
+	else
+		unsetenv("ANYFOLD_CL_CACHE");
+	boost::filesystem::remove_all(root);
+
+	const std::vector<anyfold::opencl::DeviceInfo> ranked = anyfold::opencl::Runtime::rankDevices();
+	BOOST_REQUIRE(!ranked.empty());
+	for(std::size_t i = 1; i < ranked.size(); ++i)
+		BOOST_CHECK(ranked[i-1].probeSeconds <= ranked[i].probeSeconds);
+
+	// the shared runtime exists, its device can't change anymore
+	BOOST_CHECK_THROW(anyfold::opencl::Runtime::selectDevice("cpu"), std::runtime_error);
+}
+
+BOOST_FIXTURE_TEST_CASE_TEMPLATE(zero_copy_matches_copy, T, Fixtures, T)
+{
+	anyfold::image_stack_cref kernel(T::all1_kernel_.data(), T::kernel_dims_);
+	std::vector<int> offsets(3);
+	for (unsigned i = 0; i < offsets.size(); ++i)
+		offsets[i] = T::kernel_dims_[i]/2;
+
+	const anyfold::opencl::HostMemory modes[] = {anyfold::opencl::HostMemory::copy,
+	                                            anyfold::opencl::HostMemory::zeroCopy,
+	                                            anyfold::opencl::HostMemory::staged};
+	for(anyfold::opencl::HostMemory mode : modes)
+	{
+		anyfold::opencl::Convolution3DCLBuffer c;
+		c.setupCLcontext();
+		c.setHostMemory(mode);
+		c.createProgramAndLoadKernel("convolution3dBuffer.cl", "convolution3d", kernel.shape());
+		c.setupKernelArgs(T::padded_image_, kernel, offsets);
+		c.execute();
+		c.getResult(T::padded_output_);
+		BOOST_CHECK_CLOSE(anyfold::l2norm(T::padded_output_.data(),
+		                                  T::padded_image_folded_by_all1_.data(),
+		                                  T::padded_output_.num_elements()), 0, .00001);
+
+		// another array with the same image, wrapped or copied anew
+		anyfold::image_stack other(T::padded_image_);
+		c.uploadImage(other);
+		c.execute();
+		c.getResult(T::padded_output_);
+		BOOST_CHECK_CLOSE(anyfold::l2norm(T::padded_output_.data(),
+		                                  T::padded_image_folded_by_all1_.data(),
+		                                  T::padded_output_.num_elements()), 0, .00001);
+	}
+}
+
+BOOST_AUTO_TEST_CASE(half_storage_matches_cpu_typed_convolution)
+{
+	std::vector<int> shape(3);
+	shape[0] = 13; shape[1] = 22; shape[2] = 41;
+	std::vector<int> kshape(3);
+	kshape[0] = 3; kshape[1] = 5; kshape[2] = 7;
+
+	anyfold::image_stack kernel(kshape);
+	anyfold::fill_scattered(kernel, kernel.num_elements());
+
+	anyfold::image_stack image(shape);
+	anyfold::fill_wave(image);
+	const std::size_t size = image.num_elements();
+	std::vector<anyfold::float16> halves(size);
+	std::vector<anyfold::bfloat16> brains(size);
+	for(unsigned i = 0;i<size;++i){
+		halves[i] = anyfold::to_float16(image.data()[i]);
+		brains[i] = anyfold::to_bfloat16(image.data()[i]);
+	}
+
+	std::vector<anyfold::float16> half_expected(size, anyfold::to_float16(0.f));
+	std::vector<anyfold::bfloat16> brain_expected(size, anyfold::to_bfloat16(0.f));
+	anyfold::cpu::typed_convolve_3d(&halves[0], &shape[0], kernel.data(), &kshape[0], &half_expected[0]);
+	anyfold::cpu::typed_convolve_3d(&brains[0], &shape[0], kernel.data(), &kshape[0], &brain_expected[0]);
+
+	// the templated front door and the class driven by setSampleType directly
+	std::vector<anyfold::float16> half_result(size, anyfold::to_float16(0.f));
+	anyfold::opencl::convolve_3dBuffer(&halves[0], &shape[0], kernel.data(), &kshape[0], &half_result[0]);
+
+	std::vector<anyfold::bfloat16> brain_result(size, anyfold::to_bfloat16(0.f));
+	const std::size_t image_shape[3] = {std::size_t(shape[0]), std::size_t(shape[1]), std::size_t(shape[2])};
+	std::vector<int> offsets(3);
+	for (unsigned i = 0; i < offsets.size(); ++i)
+		offsets[i] = kshape[i]/2;
+	anyfold::opencl::Convolution3DCLBuffer c;
+	c.setupCLcontext();
+	c.setSampleType(anyfold::sample_type::bf16);
+	c.createProgramAndLoadKernel("convolution3dBuffer.cl", "convolution3d", kernel.shape());
+	c.setupKernelArgs(&brains[0], image_shape, kernel, offsets);
+	c.execute();
+	c.getResultSamples(&brain_result[0]);
+
+	// the summation order differs, the results agree up to one storage ulp
+	// (results are below 1 in magnitude)
+	for(unsigned i = 0;i<size;++i){
+		BOOST_CHECK_SMALL(anyfold::to_float(half_result[i]) - anyfold::to_float(half_expected[i]), 1e-3f);
+		BOOST_CHECK_SMALL(anyfold::to_float(brain_result[i]) - anyfold::to_float(brain_expected[i]), 8e-3f);
+	}
+}
+
+BOOST_AUTO_TEST_CASE(camera_frames_are_scaled_to_bytes_on_the_device)
+{
+	std::vector<int> shape(3);
+	shape[0] = 9; shape[1] = 16; shape[2] = 35;
+	std::vector<int> kshape(3, 3);
+	std::vector<std::uint16_t> image(shape[0]*shape[1]*shape[2]);
+	for(unsigned i = 0;i<image.size();++i)
+		image[i] = (i*7919) % 4096;
+	anyfold::image_stack kernel(kshape);
+	std::fill(kernel.data(), kernel.data() + kernel.num_elements(), 1.f/27);
+
+	// wide enough to saturate at both ends
+	const anyfold::cpu::sample_scaling scaling(1.f/2, -900.f);
+	std::vector<std::uint8_t> expected(image.size(), 0);
+	anyfold::cpu::typed_convolve_3d(&image[0], &shape[0], kernel.data(), &kshape[0], &expected[0], scaling);
+
+	std::vector<std::uint8_t> result(image.size(), 0);
+	anyfold::opencl::convolve_3dBuffer(&image[0], &shape[0], kernel.data(), &kshape[0], &result[0], scaling);
+
+	// ties may round either way after another summation order
+	int low = 0, high = 0;
+	for(int x = 1;x<shape[0] - 1;++x)
+		for(int y = 1;y<shape[1] - 1;++y)
+			for(int z = 1;z<shape[2] - 1;++z){
+				const long i = (x*shape[1] + y)*shape[2] + z;
+				BOOST_CHECK_LE(std::abs(int(result[i]) - int(expected[i])), 1);
+				low += expected[i] == 0;
+				high += expected[i] == 255;
+			}
+	BOOST_CHECK_GT(low, 0);
+	BOOST_CHECK_GT(high, 0);
+}
+
+BOOST_FIXTURE_TEST_CASE_TEMPLATE(plans_upload_images_that_die_after_execute, T, Fixtures, T)
+{
+	anyfold::convolve_options options;
+	options.allow_opencl_ = true;
+	const anyfold::backend backends[] = {anyfold::backend::opencl_buffer,
+	                                     anyfold::backend::opencl_buffer_local_mem};
+	for(const anyfold::backend backend : backends)
+	{
+		options.backend_ = backend;
+		const anyfold::plan plan = anyfold::make_plan(&T::padded_image_shape_[0], T::all1_kernel_.data(),
+		                                              &T::kernel_dims_[0], options);
+
+		// every image is a temporary of its own, none may be used after its execute
+		for(int run = 0; run < 3; ++run)
+		{
+			std::unique_ptr<anyfold::image_stack> image(new anyfold::image_stack(T::padded_image_));
+			std::fill(T::padded_output_.data(), T::padded_output_.data() + T::padded_output_.num_elements(), 0.f);
+			plan.execute(image->data(), T::padded_output_.data());
+			image.reset();
+			BOOST_CHECK_CLOSE(anyfold::l2norm(T::padded_output_.data(),
+			                                  T::padded_image_folded_by_all1_.data(),
+			                                  T::padded_output_.num_elements()), 0, .00001);
+		}
+	}
+}